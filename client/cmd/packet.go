@@ -4,7 +4,9 @@ import (
 	"encoding/binary"
 	"errors"
 	"fmt"
+	"io"
 	"math"
+	"net"
 )
 
 type Serializable interface {
@@ -20,11 +22,18 @@ const (
 
 	RequestFilePacket    MessageType = 15
 	RequestFilePacketRes MessageType = 16
+	ReadFragmentPacket   MessageType = 17
+
+	DeclareFragmentPacket MessageType = 21
 
 	StatusOK    MessageType = 200
 	StatusNotOK MessageType = 220
 )
 
+// presented by connections that only read fragments from their holder,
+// the node keeps them next to its client instead of in its place
+const DirectReaderID uint64 = math.MaxUint64 - 1
+
 type CommunicationPacket[T Serializable] struct {
 	Size     uint16
 	SenderID uint64
@@ -103,6 +112,7 @@ func (c *FileDeclarationPacket) Unserialize(b []byte) error {
 
 type FileRequestPacket struct {
 	FileName [200]byte
+	Direct   bool // only the fragment map comes back, see HandleDirectFileRequest
 }
 
 func (c *FileRequestPacket) Serialize() []byte {
@@ -110,6 +120,12 @@ func (c *FileRequestPacket) Serialize() []byte {
 	b := make([]byte, 0, 256)
 	b = append(b, c.FileName[:]...)
 
+	if c.Direct {
+		b = append(b, 1)
+	} else {
+		b = append(b, 0)
+	}
+
 	return b
 }
 
@@ -123,6 +139,8 @@ type FileResponsePacket struct {
 	FileSize           uint64
 	FileId             uint64
 	FragmentCountTotal uint8
+	Parity             uint8
+	Locations          uint16 // FragmentLocation that follow a direct response
 }
 
 func (c *FileResponsePacket) Serialize() []byte {
@@ -142,11 +160,104 @@ func (c *FileResponsePacket) Unserialize(b []byte) error {
 	c.FileId = binary.LittleEndian.Uint64(b[8:16])
 	c.FragmentCountTotal = b[16]
 
+	if len(b) >= 20 {
+		c.Parity = b[17]
+		c.Locations = binary.LittleEndian.Uint16(b[18:20])
+	}
+
 	fmt.Printf("UNSERIALIZING FRP\n")
 
 	return nil
 }
 
+// ------------------------------------------------------------
+
+// one holder of a data fragment, as the node packs it
+type FragmentLocation struct {
+	Fragment uint8
+	Offset   uint64
+	Size     uint64
+	NodeID   uint64
+	Addr     string
+}
+
+const FragmentLocationSize = 31
+
+func ParseFragmentLocations(b []byte) []FragmentLocation {
+
+	locs := make([]FragmentLocation, 0, len(b)/FragmentLocationSize)
+
+	for at := 0; at+FragmentLocationSize <= len(b); at += FragmentLocationSize {
+		l := b[at : at+FragmentLocationSize]
+
+		locs = append(locs, FragmentLocation{
+			Fragment: l[0],
+			Offset:   binary.LittleEndian.Uint64(l[1:9]),
+			Size:     binary.LittleEndian.Uint64(l[9:17]),
+			NodeID:   binary.LittleEndian.Uint64(l[17:25]),
+			Addr:     fmt.Sprintf("%d.%d.%d.%d:%d", l[25], l[26], l[27], l[28], binary.LittleEndian.Uint16(l[29:31])),
+		})
+	}
+
+	return locs
+}
+
+// ------------------------------------------------------------
+
+type FragmentReadPacket struct {
+	FileId     uint64
+	FragmentId uint64
+}
+
+func (c *FragmentReadPacket) Serialize() []byte {
+
+	b := make([]byte, 0, 16)
+
+	b = binary.LittleEndian.AppendUint64(b, c.FileId)
+	b = binary.LittleEndian.AppendUint64(b, c.FragmentId)
+
+	return b
+}
+
+func (c *FragmentReadPacket) Unserialize(b []byte) error {
+	return nil
+}
+
+// ------------------------------------------------------------
+
+type FragmentDeclarationPacket struct {
+	FileId     uint64
+	FragmentId uint64
+	FragSize   uint64
+	FileSize   uint64
+	WireSize   uint64
+	Codec      uint8
+	Checked    bool
+	Crc        uint32 // CRC32C of the fragment
+}
+
+func (c *FragmentDeclarationPacket) Serialize() []byte {
+	return make([]byte, 0)
+}
+
+func (c *FragmentDeclarationPacket) Unserialize(b []byte) error {
+
+	if len(b) < 48 {
+		return errors.New("invalid len")
+	}
+
+	c.FileId = binary.LittleEndian.Uint64(b[0:8])
+	c.FragmentId = binary.LittleEndian.Uint64(b[8:16])
+	c.FragSize = binary.LittleEndian.Uint64(b[16:24])
+	c.FileSize = binary.LittleEndian.Uint64(b[24:32])
+	c.WireSize = binary.LittleEndian.Uint64(b[32:40])
+	c.Codec = b[40]
+	c.Checked = b[41] != 0
+	c.Crc = binary.LittleEndian.Uint32(b[44:48])
+
+	return nil
+}
+
 type Empty struct {
 }
 
@@ -205,3 +316,34 @@ func ReadPacket[T Serializable](state *ClientState, content T) (*CommunicationPa
 
 	return c, nil
 }
+
+// same as ReadPacket, from any connection and without logging
+func ReadPacketFrom[T Serializable](conn net.Conn, content T) (*CommunicationPacket[T], error) {
+
+	var sizeBuf [2]byte
+	if _, err := io.ReadFull(conn, sizeBuf[:]); err != nil {
+		return nil, fmt.Errorf("failed to read packet size: %w", err)
+	}
+
+	packetSize := binary.LittleEndian.Uint16(sizeBuf[:])
+	if packetSize < 2 {
+		return nil, fmt.Errorf("invalid packet size: %d", packetSize)
+	}
+
+	fullBuf := make([]byte, packetSize)
+	copy(fullBuf[:2], sizeBuf[:])
+
+	if _, err := io.ReadFull(conn, fullBuf[2:]); err != nil {
+		return nil, fmt.Errorf("failed to read full packet: %w", err)
+	}
+
+	c := &CommunicationPacket[T]{
+		Content: content,
+	}
+
+	if err := c.Unserialize(fullBuf); err != nil {
+		return nil, fmt.Errorf("failed to unserialize packet: %w", err)
+	}
+
+	return c, nil
+}
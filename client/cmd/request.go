@@ -3,10 +3,12 @@ package cmd
 import (
 	"errors"
 	"fmt"
+	"hash/crc32"
 	"io"
 	"net"
 	"os"
 	"path/filepath"
+	"sync"
 	"time"
 )
 
@@ -58,6 +60,8 @@ func HandleRequest(state *ClientState, args []string) *CommandResult {
 	switch subcommand {
 	case "file":
 		return HandleFileRequest(state, args[1:])
+	case "direct":
+		return HandleDirectFileRequest(state, args[1:])
 	default:
 		return Warning("invalid action :" + subcommand + ". not a valid subcommand.")
 	}
@@ -137,6 +141,217 @@ func HandleFileRequest(state *ClientState, args []string) *CommandResult {
 	return Success("File successfully saved to " + storeAt + " as " + fileName)
 }
 
+// HandleDirectFileRequest gets only the fragment map from the node and
+// reads every fragment straight from its holders, in parallel. Files
+// that can't be read that way right now go through the node instead.
+func HandleDirectFileRequest(state *ClientState, args []string) *CommandResult {
+
+	if len(args) < 1 {
+		return Warning("Usage: req direct <name> <?path>")
+	}
+
+	fileName := args[0]
+
+	storeAt := "./files"
+	if len(args) > 1 {
+		storeAt = args[1]
+	}
+
+	pkt := FileRequestPacket{
+		FileName: ToFixed200([]byte(fileName)),
+		Direct:   true,
+	}
+
+	ok := sendBytes(state, Packet(RequestFilePacket, &pkt).Serialize(), "request")
+	if ok.Status == StatusError {
+		return ok
+	}
+
+	frp, err := ReadPacketFrom(state.Conn, &FileResponsePacket{})
+	if err != nil {
+		return Failure("Error reading FILE DESCRIPTOR", err)
+	}
+
+	if frp.Type != RequestFilePacketRes {
+		return Failure("Server responded with NOT OK", errors.New("err code=2"))
+	}
+
+	if frp.Content.Locations == 0 {
+		state.Console.AddLog("NO FRAGMENT MAP, READING THROUGH THE NODE")
+		state.Console.Draw()
+		return HandleFileRequest(state, args)
+	}
+
+	raw := make([]byte, int(frp.Content.Locations)*FragmentLocationSize)
+	if _, err := io.ReadFull(state.Conn, raw); err != nil {
+		return Failure("Error reading fragment map", err)
+	}
+
+	// holders of each fragment, in the index's order
+	holders := map[uint8][]FragmentLocation{}
+	for _, l := range ParseFragmentLocations(raw) {
+		holders[l.Fragment] = append(holders[l.Fragment], l)
+	}
+
+	state.Console.AddLog(fmt.Sprintf("<< FILE %d SIZE = %d, %d FRAGMENTS FROM THEIR HOLDERS", frp.Content.FileId, frp.Content.FileSize, len(holders)))
+	state.Console.Draw()
+
+	buf := make([]byte, frp.Content.FileSize)
+
+	// one connection per holder, presented as a direct reader so it
+	// is kept next to the holder's client. Its fragments go one after
+	// the other, and the entry node is asked over the one we have.
+	tried := map[uint8]int{}
+
+	for len(holders) > 0 {
+		byNode := map[uint64][]FragmentLocation{}
+
+		for frag, locs := range holders {
+			if tried[frag] >= len(locs) {
+				return Failure("Error reading fragments.", fmt.Errorf("fragment #%d: no holder sent it", frag))
+			}
+
+			l := locs[tried[frag]]
+			byNode[l.NodeID] = append(byNode[l.NodeID], l)
+		}
+
+		failed := make(chan []FragmentLocation, len(byNode))
+
+		var wg sync.WaitGroup
+
+		for node, locs := range byNode {
+			wg.Add(1)
+
+			go func(node uint64, locs []FragmentLocation) {
+				defer wg.Done()
+
+				if node == frp.SenderID {
+					failed <- readFragmentsFrom(state.Conn, locs, frp.Content.FileId, buf)
+					return
+				}
+
+				conn, err := dialHolder(locs[0].Addr)
+				if err != nil {
+					failed <- locs
+					return
+				}
+				defer conn.Close()
+
+				failed <- readFragmentsFrom(conn, locs, frp.Content.FileId, buf)
+			}(node, locs)
+		}
+
+		wg.Wait()
+		close(failed)
+
+		done := holders
+		holders = map[uint8][]FragmentLocation{}
+
+		// what did not come is asked from its next holder
+		for locs := range failed {
+			for _, l := range locs {
+				tried[l.Fragment]++
+				holders[l.Fragment] = done[l.Fragment]
+			}
+		}
+	}
+
+	if err := SaveBufferToFile(buf, storeAt, fileName); err != nil {
+		return Failure("Error saving buffer.", err)
+	}
+
+	return Success("File successfully saved to " + storeAt + " as " + fileName)
+}
+
+// a presented connection to a fragment holder
+func dialHolder(addr string) (net.Conn, error) {
+
+	conn, err := net.DialTimeout("tcp", addr, 5*time.Second)
+	if err != nil {
+		return nil, err
+	}
+
+	p := Packet[*Empty](PresentItself, &Empty{})
+	p.SenderID = DirectReaderID
+
+	if _, err := conn.Write(p.Serialize()); err != nil {
+		conn.Close()
+		return nil, err
+	}
+
+	ok, err := ReadPacketFrom(conn, &Empty{})
+	if err != nil || ok.Type != StatusOK {
+		conn.Close()
+		return nil, errors.New("holder refused the connection")
+	}
+
+	return conn, nil
+}
+
+// asks one holder for its fragments and puts them where they go in
+// `buf`, returns the ones it did not send
+func readFragmentsFrom(conn net.Conn, locs []FragmentLocation, fileId uint64, buf []byte) []FragmentLocation {
+
+	var failed []FragmentLocation
+
+	for i, l := range locs {
+		kept, err := readFragment(conn, l, fileId, buf)
+
+		if err != nil {
+			// the connection is out of step, nothing more from it
+			return append(failed, locs[i:]...)
+		}
+
+		if !kept {
+			failed = append(failed, l)
+		}
+	}
+
+	return failed
+}
+
+// false if the holder does not keep it (or sent it damaged), an error
+// if the connection can not be used anymore
+func readFragment(conn net.Conn, l FragmentLocation, fileId uint64, buf []byte) (bool, error) {
+
+	if l.Offset+l.Size > uint64(len(buf)) {
+		return false, nil
+	}
+
+	req := FragmentReadPacket{FileId: fileId, FragmentId: uint64(l.Fragment)}
+	if _, err := conn.Write(Packet(ReadFragmentPacket, &req).Serialize()); err != nil {
+		return false, err
+	}
+
+	d, err := ReadPacketFrom(conn, &FragmentDeclarationPacket{})
+	if err != nil {
+		return false, err
+	}
+
+	if d.Type != DeclareFragmentPacket {
+		return false, nil
+	}
+
+	if d.Content.WireSize != l.Size {
+		// its bytes are on their way all the same
+		if _, err := io.CopyN(io.Discard, conn, int64(d.Content.WireSize)); err != nil {
+			return false, err
+		}
+		return false, nil
+	}
+
+	part := buf[l.Offset : l.Offset+l.Size]
+	if _, err := io.ReadFull(conn, part); err != nil {
+		return false, err
+	}
+
+	if d.Content.Checked && crc32.Checksum(part, crc32.MakeTable(crc32.Castagnoli)) != d.Content.Crc {
+		return false, nil
+	}
+
+	return true, nil
+}
+
 func SaveBufferToFile(buf []byte, storeTo, fileName string) error {
 
 	if err := os.MkdirAll(storeTo, os.ModePerm); err != nil {
@@ -150,7 +150,19 @@ func HandleFileTransmission(state *ClientState, args []string) *CommandResult {
 		state.Console.Draw()
 	}
 
-	return Warning("Sending done.")
+	/**
+	Index confirms once every replica is stored
+	*/
+	c, err := ReadPacket(state, &Empty{})
+	if err != nil {
+		return Failure("Error reading upload confirmation", err)
+	}
+
+	if c.Type != StatusOK {
+		return Failure("Upload was not fully replicated.", nil)
+	}
+
+	return Success("File stored.")
 }
 
 func ToFixed200(b []byte) [200]byte {
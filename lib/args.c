@@ -8,10 +8,14 @@
 #define FLAG_PEER_ID  "-peer-id"
 #define FLAG_PEER_IP  "-peer-ip"
 #define FLAG_NETSIZE  "-network-size"
+#define FLAG_CHUNK    "-chunk-size"
+#define FLAG_DATA_DIR "-data-dir"
+#define FLAG_BUDGET   "-memory-budget"
 
 void debug_args_inline(const Args *args) {
-    printf("[Args] id=%d ip=%s peer_id=%d peer_ip=%s netsize=%d\n",
-           args->id, args->ip, args->peer_id, args->peer_ip, args->netsize);
+    printf("[Args] id=%d ip=%s peer_id=%d peer_ip=%s netsize=%d chunk_size=%d data_dir=%s memory_budget=%dMB\n",
+           args->id, args->ip, args->peer_id, args->peer_ip, args->netsize, args->chunk_size,
+           args->data_dir[0] ? args->data_dir : "(memory)", args->memory_budget);
 }
 
 int parse_args(int argc, char **argv, Args *args) {
@@ -19,8 +23,11 @@ int parse_args(int argc, char **argv, Args *args) {
     args->id            = 0;
     args->peer_id       = 0;
     args->netsize       = 0;
+    args->chunk_size    = 0;
     args->peer_ip[0]    = '\0';
     args->ip[0]         = '\0';
+    args->data_dir[0]   = '\0';
+    args->memory_budget = -1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], FLAG_ID) == 0 && i + 1 < argc) {
@@ -50,6 +57,22 @@ int parse_args(int argc, char **argv, Args *args) {
             continue;
         }
 
+        if (strcmp(argv[i], FLAG_CHUNK) == 0 && i + 1 < argc) {
+            args->chunk_size = atoi(argv[++i]);
+            continue;
+        }
+
+        if (strcmp(argv[i], FLAG_DATA_DIR) == 0 && i + 1 < argc) {
+            strncpy(args->data_dir, argv[++i], sizeof(args->data_dir) - 1);
+            args->data_dir[sizeof(args->data_dir) - 1] = '\0';
+            continue;
+        }
+
+        if (strcmp(argv[i], FLAG_BUDGET) == 0 && i + 1 < argc) {
+            args->memory_budget = atoi(argv[++i]);
+            continue;
+        }
+
         fprintf(stderr, "Unknown or incomplete argument: %s\n", argv[i]);
         return 0;
     }
@@ -70,6 +93,16 @@ int parse_args(int argc, char **argv, Args *args) {
         return 0;
     }
 
+    if ( args->chunk_size < 0 ) {
+        fprintf(stderr, "Invalid chunk size: %d. \n", args->chunk_size);
+        return 0;
+    }
+
+    if ( args->memory_budget < -1 ) {
+        fprintf(stderr, "Invalid memory budget: %d. \n", args->memory_budget);
+        return 0;
+    }
+
     return 1;
 }
 
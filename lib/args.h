@@ -7,6 +7,9 @@ typedef struct __Args {
     int peer_id;
     char peer_ip[64];
     int netsize;
+    int chunk_size;
+    char data_dir[256];
+    int memory_budget; // MB of fragments kept in memory, 0 is no limit
 } Args;
 
 
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C (Castagnoli) of `n` more bytes, start from 0 and feed the
+// previous result back in to checksum something piece by piece
+uint32_t xcrc32c(uint32_t crc, const void *buf, size_t n);
+
+const char *xcrc32c_engine(void);
+
+#endif // CRC32C_H
@@ -0,0 +1,172 @@
+#include "erasure.h"
+#include "gf256.h"
+#include "../memory/slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Reed-Solomon erasure coding of a file's fragments
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Systematic: the k data fragments are the file itself, the
+ *      m parity ones are rows of a Cauchy matrix applied to them,
+ *      parity p = sum over i of 1 / ((k + p) ^ i) * data i. Every
+ *      k x k pick of identity and Cauchy rows is invertible, so
+ *      any k fragments give the file back.
+ *
+ *      Parity is linear, it is built up window by window while an
+ *      upload streams in, each window only touching the bytes of
+ *      the data fragments it covers.
+ */
+
+static uint8_t erasure_coef(const xErasureShape *s, int p, int i) {
+    return xgf_inv((uint8_t)((s->data + p) ^ i));
+}
+
+void xerasure_shape(xErasureShape *s, uint64_t file_size, uint8_t data, uint8_t parity) {
+    memset(s, 0, sizeof(xErasureShape));
+
+    s->data      = data ? data : 1;
+    s->parity    = parity;
+    s->file_size = file_size;
+    s->base      = file_size / s->data;
+    s->shard     = file_size - s->base * (s->data - 1);
+}
+
+// where a fragment starts, parity ones are laid out after the file
+uint64_t xerasure_offset(const xErasureShape *s, int fragment_id) {
+    if (fragment_id <= s->data) return s->base * (fragment_id - 1);
+
+    return s->file_size + s->shard * (fragment_id - s->data - 1);
+}
+
+uint64_t xerasure_size(const xErasureShape *s, int fragment_id) {
+    return fragment_id < s->data ? s->base : s->shard;
+}
+
+// -----------------------------------------------------------------------------
+// Window by window, `out` starts zeroed and is shard bytes long
+// -----------------------------------------------------------------------------
+void xerasure_absorb(const xErasureShape *s, int fragment_id, char *out, const char *window, uint64_t base, size_t len) {
+    int p = fragment_id - s->data - 1;
+
+    if (p < 0 || p >= s->parity) return;
+
+    for (int i = 0; i < s->data; i++) {
+        uint64_t at   = xerasure_offset(s, i + 1);
+        uint64_t from = base > at ? base : at;
+        uint64_t to   = base + len < at + xerasure_size(s, i + 1) ? base + len : at + xerasure_size(s, i + 1);
+
+        if (from >= to) continue;
+
+        xgf_mul_add(erasure_coef(s, p, i), window + (from - base), out + (from - at), to - from);
+    }
+}
+
+// a parity fragment of the whole `file`, slab
+char *xerasure_parity(const xErasureShape *s, int fragment_id, const char *file) {
+    char *out = xslab_calloc(1, s->shard);
+    if (out == NULL) return NULL;
+
+    xerasure_absorb(s, fragment_id, out, file, 0, s->file_size);
+
+    return out;
+}
+
+// -----------------------------------------------------------------------------
+// Gauss-Jordan over GF(2^8), `a` becomes the identity and `inv` its inverse
+// -----------------------------------------------------------------------------
+static int erasure_invert(uint8_t *a, uint8_t *inv, int n) {
+    memset(inv, 0, n * n);
+    for (int i = 0; i < n; i++) inv[i * n + i] = 1;
+
+    for (int c = 0; c < n; c++) {
+        int r = c;
+        while (r < n && a[r * n + c] == 0) r++;
+
+        if (r == n) return 0;
+
+        if (r != c) {
+            for (int j = 0; j < n; j++) {
+                uint8_t t = a[c * n + j];   a[c * n + j]   = a[r * n + j];   a[r * n + j]   = t;
+                t = inv[c * n + j]; inv[c * n + j] = inv[r * n + j]; inv[r * n + j] = t;
+            }
+        }
+
+        uint8_t scale = xgf_inv(a[c * n + c]);
+
+        for (int j = 0; j < n; j++) {
+            a[c * n + j]   = xgf_mul(a[c * n + j], scale);
+            inv[c * n + j] = xgf_mul(inv[c * n + j], scale);
+        }
+
+        for (int k = 0; k < n; k++) {
+            uint8_t f = a[k * n + c];
+
+            if (k == c || f == 0) continue;
+
+            for (int j = 0; j < n; j++) {
+                a[k * n + j]   ^= xgf_mul(f, a[c * n + j]);
+                inv[k * n + j] ^= xgf_mul(f, inv[c * n + j]);
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ *  Rebuilds the data fragments that are missing.
+ * ------------------------------------------------------------
+ *  Notes:
+ *      `frags` holds the data + parity fragments at hand by id - 1,
+ *      NULL for the others. `out` has one shard long buffer for
+ *      every data fragment to rebuild, NULL for those present.
+ *      Returns 0 when fewer than k fragments are at hand.
+ */
+int xerasure_rebuild(const xErasureShape *s, const char **frags, char **out) {
+    int k = s->data;
+
+    int *rows = malloc(k * sizeof(int));
+    uint8_t *a   = malloc(k * k);
+    uint8_t *inv = malloc(k * k);
+
+    int n = 0;
+    int ok = rows && a && inv;
+
+    // data first, those rows are the identity
+    for (int id = 1; ok && id <= k + s->parity && n < k; id++) {
+        if (frags[id - 1] != NULL) rows[n++] = id;
+    }
+
+    ok = ok && n == k;
+
+    for (int r = 0; ok && r < k; r++) {
+        for (int i = 0; i < k; i++) {
+            a[r * k + i] = rows[r] <= k
+                ? (rows[r] == i + 1)
+                : erasure_coef(s, rows[r] - k - 1, i);
+        }
+    }
+
+    ok = ok && erasure_invert(a, inv, k);
+
+    for (int i = 0; ok && i < k; i++) {
+        if (out[i] == NULL) continue;
+
+        memset(out[i], 0, s->shard);
+
+        // missing bytes past a shorter fragment's end are its padding
+        for (int r = 0; r < k; r++) {
+            xgf_mul_add(inv[i * k + r], frags[rows[r] - 1], out[i], xerasure_size(s, rows[r]));
+        }
+    }
+
+    free(rows);
+    free(a);
+    free(inv);
+
+    return ok;
+}
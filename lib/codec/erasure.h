@@ -0,0 +1,31 @@
+#ifndef ERASURE_H
+#define ERASURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ERASURE_MAX_FRAGMENTS   ( 255 )     // data + parity, ids are a byte
+
+// how a file is cut. Data fragments are the file's bytes as with
+// replication, every one `base` long but the last that takes the
+// rest. Parity fragments are as long as that last one, the shorter
+// data fragments count as zero padded to it.
+typedef struct xErasureShape {
+    uint8_t  data;          // k
+    uint8_t  parity;        // m, 0 for a replicated file
+    uint64_t file_size;
+    uint64_t base;
+    uint64_t shard;         // longest fragment
+} xErasureShape;
+
+void     xerasure_shape(xErasureShape *s, uint64_t file_size, uint8_t data, uint8_t parity);
+uint64_t xerasure_offset(const xErasureShape *s, int fragment_id);
+uint64_t xerasure_size(const xErasureShape *s, int fragment_id);
+
+// adds bytes [base, base+len) of the file to parity fragment `fragment_id`
+void  xerasure_absorb(const xErasureShape *s, int fragment_id, char *out, const char *window, uint64_t base, size_t len);
+char *xerasure_parity(const xErasureShape *s, int fragment_id, const char *file);
+
+int xerasure_rebuild(const xErasureShape *s, const char **frags, char **out);
+
+#endif // ERASURE_H
@@ -0,0 +1,198 @@
+#include "gf256.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ *  GF(2^8) multiply-accumulate for erasure coding
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Multiplying by a constant splits every byte in two
+ *      nibbles, c * b = c * (b & 0x0f) ^ c * (b & 0xf0), so two
+ *      16 entry tables cover it. Those fit a shuffle register:
+ *      x86-64 looks them up 32 bytes at a time with AVX2 or 16
+ *      with SSSE3 (whichever the cpu has, checked once), ARMv8
+ *      with NEON. Anything else, and the tail the vectors leave,
+ *      looks both nibbles up one byte at a time.
+ */
+
+#define GF_POLY ( 0x11d )
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static bool gf_ready = false;
+
+static void gf_init(void) {
+    int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+
+    // no modulo when adding two logs
+    for (int i = 255; i < 512; i++) gf_exp[i] = gf_exp[i - 255];
+
+    gf_ready = true;
+}
+
+uint8_t xgf_mul(uint8_t a, uint8_t b) {
+    if (!gf_ready) gf_init();
+
+    if (a == 0 || b == 0) return 0;
+
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t xgf_inv(uint8_t a) {
+    if (!gf_ready) gf_init();
+
+    if (a == 0) return 0;
+
+    return gf_exp[255 - gf_log[a]];
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static size_t gf_mul_add_avx2(const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst, size_t n) {
+    const __m256i tl   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    const __m256i th   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+        __m256i l = _mm256_shuffle_epi8(tl, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(th, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t gf_mul_add_ssse3(const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst, size_t n) {
+    const __m128i tl   = _mm_loadu_si128((const __m128i *)lo);
+    const __m128i th   = _mm_loadu_si128((const __m128i *)hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+        __m128i l = _mm_shuffle_epi8(tl, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(th, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+
+    return i;
+}
+
+typedef enum { GF_UNKNOWN = 0, GF_SCALAR, GF_SSSE3, GF_AVX2 } eGfEngine;
+
+static eGfEngine gf_engine(void) {
+    static eGfEngine e = GF_UNKNOWN;
+
+    if (e == GF_UNKNOWN) {
+        e = __builtin_cpu_supports("avx2") ? GF_AVX2
+          : __builtin_cpu_supports("ssse3") ? GF_SSSE3
+          : GF_SCALAR;
+    }
+
+    return e;
+}
+
+static size_t gf_mul_add_simd(const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst, size_t n) {
+    switch (gf_engine()) {
+    case GF_AVX2:  return gf_mul_add_avx2(lo, hi, src, dst, n);
+    case GF_SSSE3: return gf_mul_add_ssse3(lo, hi, src, dst, n);
+    default:       return 0;
+    }
+}
+
+const char *xgf_engine(void) {
+    switch (gf_engine()) {
+    case GF_AVX2:  return "AVX2";
+    case GF_SSSE3: return "SSSE3";
+    default:       return "SCALAR";
+    }
+}
+
+#elif defined(__aarch64__)
+
+static size_t gf_mul_add_simd(const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst, size_t n) {
+    const uint8x16_t tl   = vld1q_u8(lo);
+    const uint8x16_t th   = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+
+        uint8x16_t l = vqtbl1q_u8(tl, vandq_u8(s, mask));
+        uint8x16_t h = vqtbl1q_u8(th, vshrq_n_u8(s, 4));
+
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(l, h)));
+    }
+
+    return i;
+}
+
+const char *xgf_engine(void) {
+    return "NEON";
+}
+
+#else
+
+static size_t gf_mul_add_simd(const uint8_t *lo, const uint8_t *hi, const uint8_t *src, uint8_t *dst, size_t n) {
+    (void)lo; (void)hi; (void)src; (void)dst; (void)n;
+    return 0;
+}
+
+const char *xgf_engine(void) {
+    return "SCALAR";
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+void xgf_mul_add(uint8_t c, const void *src, void *dst, size_t n) {
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+
+    if (c == 0 || n == 0) return;
+
+    if (c == 1) {
+        for (size_t i = 0; i < n; i++) d[i] ^= s[i];
+        return;
+    }
+
+    uint8_t lo[16], hi[16];
+
+    for (int x = 0; x < 16; x++) {
+        lo[x] = xgf_mul(c, (uint8_t)x);
+        hi[x] = xgf_mul(c, (uint8_t)(x << 4));
+    }
+
+    size_t i = gf_mul_add_simd(lo, hi, s, d, n);
+
+    for (; i < n; i++) d[i] ^= lo[s[i] & 0x0f] ^ hi[s[i] >> 4];
+}
@@ -0,0 +1,16 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1, the Reed-Solomon field
+uint8_t xgf_mul(uint8_t a, uint8_t b);
+uint8_t xgf_inv(uint8_t a);
+
+// dst ^= c * src, `n` bytes
+void xgf_mul_add(uint8_t c, const void *src, void *dst, size_t n);
+
+const char *xgf_engine(void);
+
+#endif // GF256_H
@@ -0,0 +1,271 @@
+#include "lz.h"
+#include "../defines.h"
+#include "../memory/slab.h"
+
+#include <string.h>
+
+/**
+ *  Byte oriented LZ77 codec for fragments
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Same sequence layout as an LZ4 block: a token with the
+ *      literal run in its high nibble and the match length - 4
+ *      in the low one (15 means more bytes follow, each adding
+ *      up to 255), the literals, then a 2 byte little endian
+ *      offset. The last sequence only has literals.
+ *
+ *      One pass, a 4096 entry table of 4 byte prefixes, no
+ *      entropy stage. It is there to be cheap, not to be tight.
+ *
+ *      Before packing a whole fragment a few samples of it are
+ *      compressed, data that is already compressed (PNG, zip,
+ *      media) fails them and is left alone.
+ */
+
+#define LZ_MIN_MATCH    ( 4 )
+#define LZ_MAX_OFFSET   ( 65535 )
+#define LZ_HASH_BITS    ( 12 )
+
+static uint32_t lz_read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// length bytes past a nibble of 15
+static size_t lz_put_length(char *dst, size_t len) {
+    size_t n = 0;
+
+    for (; len >= 255; len -= 255) dst[n++] = (char)255;
+    dst[n++] = (char)len;
+
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+// Worst case of `n` bytes that do not compress at all
+// -----------------------------------------------------------------------------
+size_t xlz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+// -----------------------------------------------------------------------------
+// One sequence, 0 if it does not fit in what is left of `cap`
+// -----------------------------------------------------------------------------
+static size_t lz_emit(char *dst, size_t cap, const char *lit, size_t lit_len, size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if (need > cap) return 0;
+
+    size_t n = 1;
+    uint8_t token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+
+    if (lit_len >= 15) n += lz_put_length(dst + n, lit_len - 15);
+
+    memcpy(dst + n, lit, lit_len);
+    n += lit_len;
+
+    if (match_len) {
+        size_t m = match_len - LZ_MIN_MATCH;
+
+        token |= (uint8_t)(m >= 15 ? 15 : m);
+
+        dst[n++] = (char)(offset & 0xff);
+        dst[n++] = (char)(offset >> 8);
+
+        if (m >= 15) n += lz_put_length(dst + n, m - 15);
+    }
+
+    dst[0] = (char)token;
+
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+// Compresses `n` bytes into `dst`. Returns the packed size, 0 if it
+// would take more than `cap`.
+// -----------------------------------------------------------------------------
+size_t xlz_compress(const char *src, size_t n, char *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t i = 0, anchor = 0, out = 0;
+
+    // the tail always goes out as literals
+    size_t limit = n > 12 ? n - 5 : 0;
+
+    while (i + LZ_MIN_MATCH <= limit) {
+        uint32_t seq = lz_read32(src + i);
+        uint32_t h   = lz_hash(seq);
+        size_t cand  = table[h];
+
+        table[h] = (uint32_t)i;
+
+        if (cand >= i || i - cand > LZ_MAX_OFFSET || lz_read32(src + cand) != seq) {
+            i++;
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+
+        // eight bytes at a time, the first differing one ends it
+        while (i + len + 8 <= n) {
+            uint64_t a, b;
+            memcpy(&a, src + cand + len, 8);
+            memcpy(&b, src + i + len, 8);
+
+            if (a != b) break;
+            len += 8;
+        }
+        while (i + len < n && src[cand + len] == src[i + len]) len++;
+
+        size_t w = lz_emit(dst + out, cap - out, src + anchor, i - anchor, i - cand, len);
+        if (w == 0) return 0;
+
+        out += w;
+        i   += len;
+        anchor = i;
+
+        // a position the match skipped, helps the next one start early
+        if (i + 2 <= n) table[lz_hash(lz_read32(src + i - 2))] = (uint32_t)(i - 2);
+    }
+
+    size_t w = lz_emit(dst + out, cap - out, src + anchor, n - anchor, 0, 0);
+    if (w == 0) return 0;
+
+    return out + w;
+}
+
+// -----------------------------------------------------------------------------
+// Unpacks exactly `out` bytes, 0 on anything malformed
+// -----------------------------------------------------------------------------
+int xlz_decompress(const char *src, size_t n, char *dst, size_t out) {
+    const uint8_t *ip = (const uint8_t *)src;
+    size_t i = 0, o = 0;
+
+    while (i < n) {
+        uint8_t token = ip[i++];
+
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (i >= n) return 0;
+                b = ip[i++];
+                lit += b;
+            } while (b == 255);
+        }
+
+        if (lit > n - i || lit > out - o) return 0;
+
+        memcpy(dst + o, src + i, lit);
+        i += lit;
+        o += lit;
+
+        // the last sequence has no match
+        if (i == n) break;
+
+        if (n - i < 2) return 0;
+
+        size_t offset = ip[i] | ((size_t)ip[i + 1] << 8);
+        i += 2;
+
+        if (offset == 0 || offset > o) return 0;
+
+        size_t len = token & 15;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (i >= n) return 0;
+                b = ip[i++];
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ_MIN_MATCH;
+
+        if (len > out - o) return 0;
+
+        // overlapping copies repeat the bytes just written
+        if (offset >= len) {
+            memcpy(dst + o, dst + o - offset, len);
+        }
+        else {
+            for (size_t k = 0; k < len; k++) dst[o + k] = dst[o + k - offset];
+        }
+
+        o += len;
+    }
+
+    return o == out;
+}
+
+// what packing should at least save, anything less is not worth unpacking
+static size_t lz_cap(size_t n) {
+    return n - n * COMPRESSION_MIN_GAIN_PCT / 100;
+}
+
+// -----------------------------------------------------------------------------
+// Compresses a few samples, false when they hardly shrink
+// -----------------------------------------------------------------------------
+bool xlz_worth_it(const char *src, size_t n) {
+    if (n < LZ_MIN_INPUT) return false;
+
+    // small enough to just try the whole thing
+    if (n <= LZ_SAMPLE_SIZE * LZ_SAMPLES) return true;
+
+    char scratch[LZ_SAMPLE_SIZE];
+    int good = 0;
+
+    for (int s = 0; s < LZ_SAMPLES; s++) {
+        size_t at = (n - LZ_SAMPLE_SIZE) / (LZ_SAMPLES - 1) * s;
+
+        if (xlz_compress(src + at, LZ_SAMPLE_SIZE, scratch, lz_cap(LZ_SAMPLE_SIZE)) > 0) good++;
+    }
+
+    return good * 2 >= LZ_SAMPLES;
+}
+
+// -----------------------------------------------------------------------------
+// A slab block with the header and the packed bytes, NULL if `src` is
+// not worth it. `packed` gets the block's size.
+// -----------------------------------------------------------------------------
+char *xlz_pack(const char *src, size_t n, size_t *packed) {
+    if (!xlz_worth_it(src, n)) return NULL;
+
+    size_t cap = lz_cap(n);
+
+    char *blob = xslab_alloc(sizeof(xLzHeader) + cap);
+    if (blob == NULL) return NULL;
+
+    size_t body = xlz_compress(src, n, blob + sizeof(xLzHeader), cap - sizeof(xLzHeader));
+
+    if (body == 0) {
+        xslab_free(blob);
+        return NULL;
+    }
+
+    xLzHeader h = { n };
+    memcpy(blob, &h, sizeof(h));
+
+    *packed = sizeof(xLzHeader) + body;
+
+    return blob;
+}
+
+int xlz_unpack(const char *blob, size_t packed, char *dst, size_t logical) {
+    if (packed < sizeof(xLzHeader) || xlz_logical(blob, packed) != logical) return 0;
+
+    return xlz_decompress(blob + sizeof(xLzHeader), packed - sizeof(xLzHeader), dst, logical);
+}
+
+uint64_t xlz_logical(const char *blob, size_t packed) {
+    xLzHeader h;
+
+    if (packed < sizeof(xLzHeader)) return 0;
+
+    memcpy(&h, blob, sizeof(h));
+    return h.logical;
+}
@@ -0,0 +1,34 @@
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMPRESSION_OFF     ( 0 )
+#define COMPRESSION_WIRE    ( 1 )           // holders pack a fragment when sending it
+#define COMPRESSION_AT_REST ( 2 )           // holders keep it packed, it travels that way
+
+#define LZ_CODEC_NONE       ( 0 )
+#define LZ_CODEC_LZ         ( 1 )
+
+#define LZ_MIN_INPUT        ( 512 )         // smaller fragments are kept as they are
+#define LZ_SAMPLE_SIZE      ( 4096 )
+#define LZ_SAMPLES          ( 4 )           // spread over the fragment
+
+// in front of every packed block
+typedef struct xLzHeader {
+    uint64_t logical;       // bytes it unpacks to
+} xLzHeader;
+
+
+size_t xlz_bound(size_t n);
+size_t xlz_compress(const char *src, size_t n, char *dst, size_t cap);
+int    xlz_decompress(const char *src, size_t n, char *dst, size_t out);
+
+bool  xlz_worth_it(const char *src, size_t n);
+char *xlz_pack(const char *src, size_t n, size_t *packed);
+int   xlz_unpack(const char *blob, size_t packed, char *dst, size_t logical);
+uint64_t xlz_logical(const char *blob, size_t packed);
+
+#endif // LZ_CODEC_H
@@ -5,6 +5,51 @@
 // ------------------------------------------------------------ 
 #define MINIMAL_SIZE_FOR_SPLIT              (100)
 #define REDUNDANCY                          (2)
+#define CHAIN_REPLICATION                   1 // index sends each fragment once, holders pass it along the ring
 // ------------------------------------------------------------ 
 #define SERVER_BUCKET_SIZE                 (4096)
+#define SERVER_READER_BUFFER_SIZE           (2 * SERVER_BUCKET_SIZE)
+#define SERVER_SEND_CHUNK_SIZE              (256 * 1024) // -chunk-size overrides it
+#define SERVER_SEND_ZEROCOPY                1 // fragments between nodes, the sender waits for the ACKs
+#define SERVER_ZEROCOPY_MIN_SIZE            (64 * 1024) // pinning pages costs more than copying below that
+// ------------------------------------------------------------ 
+#define SERVER_LOOP_TICK_MS                 (100) // 0 disables the timerfd
+#define SERVER_LOOP_MAX_EVENTS              (32)
+// ------------------------------------------------------------ 
+#define POOL_BACKOFF_MIN_MS                 (10)
+#define POOL_BACKOFF_MAX_MS                 (2000)
+#define POOL_CONNECT_TIMEOUT_MS             (5000)
+#define POOL_PRESENT_TIMEOUT_MS             (1000)
+// ------------------------------------------------------------ 
+#define FANOUT_STALL_TIMEOUT_MS             (5000) // no transfer moved for that long
 
+#define GET_STREAMING                       1 // 0 holds a GET back until every fragment is in
+#define GATHER_STALL_TIMEOUT_MS             (5000) // a GET whose fragments stopped coming for that long is given up, its client dropped
+// ------------------------------------------------------------ 
+#define INGEST_STREAMING                    1 // index places uploads while they arrive, 0 buffers them whole
+#define INGEST_WINDOW_SIZE                  (256 * 1024) // upload bytes held at once by the entry node and the index. parity shards of a coded file are built whole on the index
+// ------------------------------------------------------------ 
+#define FRAGMENT_COMPRESSION                COMPRESSION_OFF // COMPRESSION_WIRE packs GET transfers, COMPRESSION_AT_REST also keeps fragments packed
+#define COMPRESSION_MIN_GAIN_PCT            (12) // fragments (and samples of them) shrinking less than that stay raw
+// ------------------------------------------------------------ 
+#define FRAGMENT_DEDUP                      0 // index hashes fragments, holders of identical bytes share them instead of getting them again. Needs whole uploads, overrides INGEST_STREAMING
+// ------------------------------------------------------------ 
+#define ERASURE_CODING                      0 // big files get k data + ERASURE_PARITY parity fragments, one per live node, instead of REDUNDANCY copies
+#define ERASURE_PARITY                      (2) // fragments a coded file can lose
+#define ERASURE_MIN_SIZE                    (64 * 1024) // smaller files stay replicated
+// ------------------------------------------------------------ 
+#define SCRUB_BYTES_PER_SEC                 (16 * 1024 * 1024) // kept fragments re-checked against their CRC32C from IDLE, 0 turns the scrubber off
+#define SCRUB_PASS_INTERVAL_MS              (60 * 1000) // a pass over every fragment starts at most that often
+// ------------------------------------------------------------ 
+#define MEMORY_BUDGET_MB                    (0) // fragments a node without a data dir keeps in memory, the coldest spill past it. 0 is no limit, -memory-budget overrides it
+#define SPILL_DIR                           "/tmp/xfs-spill" // where they spill, wiped on boot
+#define LOAD_REPORT_INTERVAL_MS             (2000) // nodes tell the index how full and how busy they are
+#define PLACEMENT_BUSY_BYTES_PER_SEC        (32 * 1024 * 1024) // a node moving that much gets half the new fragments it would otherwise
+#define PLACEMENT_BUSY_TRANSFERS            (8) // same for fragments it is passing on
+// ------------------------------------------------------------ 
+#define SLAB_CACHE_LIMIT                    (64 * 1024 * 1024) // freed big blocks kept for reuse, past that they go back to malloc
+// ------------------------------------------------------------ 
+#define INDEX_LOG_SNAPSHOT_EVERY            (1024) // log records before the index writes a snapshot and starts over
+// ------------------------------------------------------------ 
+#define STANDBY_INDEX                       1 // the index mirrors its metadata to a standby node, which takes over right away when the index dies
+#define STANDBY_RETRY_MS                    (1000) // between attempts to set one up
@@ -0,0 +1,202 @@
+#include "dedup.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Content table of the fragments the index placed
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Keys are the SHA-256 of the bytes plus their length. Two
+ *      fragments sharing a key are taken as the same bytes, the
+ *      holders never see the new copy to compare. A fast 128 bit
+ *      hash would let a client craft a fragment that reads back
+ *      as someone else's, SHA-256 costs more cycles per byte but
+ *      a collision can't be made on purpose.
+ *
+ *      The table lives in the index's memory only, after a
+ *      restart new uploads are only compared with each other.
+ */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19)  ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+// -----------------------------------------------------------------------------
+// SHA-256 of the bytes, FIPS 180-4
+// -----------------------------------------------------------------------------
+xDedupKey xdedup_key(const void *bytes, uint64_t size) {
+    const uint8_t *data = bytes;
+
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    uint64_t blocks = size / 64;
+
+    for (uint64_t i = 0; i < blocks; i++) sha256_block(h, data + i * 64);
+
+    // the tail, a 1 bit, zeros and the length in bits take one or two blocks
+    uint8_t tail[128] = {0};
+    uint64_t rest = size % 64;
+
+    memcpy(tail, data + blocks * 64, rest);
+    tail[rest] = 0x80;
+
+    int last = rest < 56 ? 64 : 128;
+    uint64_t bits = size * 8;
+
+    for (int i = 0; i < 8; i++) tail[last - 1 - i] = (uint8_t)(bits >> (i * 8));
+
+    sha256_block(h, tail);
+    if (last == 128) sha256_block(h, tail + 64);
+
+    xDedupKey key = {0};
+
+    for (int i = 0; i < 8; i++) {
+        key.digest[i * 4]     = (uint8_t)(h[i] >> 24);
+        key.digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        key.digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        key.digest[i * 4 + 3] = (uint8_t)h[i];
+    }
+
+    key.size = size;
+
+    return key;
+}
+
+static bool dedup_same(const xDedupKey *a, const xDedupKey *b) {
+    return a->size == b->size && memcmp(a->digest, b->digest, sizeof(a->digest)) == 0;
+}
+
+// probe for `key`, lands on its entry or the empty slot it would take
+static xDedupEntry *dedup_slot(xDedupEntry *slots, uint32_t size, const xDedupKey *key) {
+    uint32_t mask = size - 1;
+    uint32_t start;
+
+    memcpy(&start, key->digest, sizeof(start));
+
+    for (uint32_t i = start & mask; ; i = (i + 1) & mask) {
+        if (slots[i].refs == 0 || dedup_same(&slots[i].key, key)) return slots + i;
+    }
+}
+
+static int dedup_grow(xDedupTable *t) {
+    uint32_t size = t->size * 2;
+
+    xDedupEntry *slots = calloc(size, sizeof(xDedupEntry));
+    if (!slots) return 0;
+
+    for (uint32_t i = 0; i < t->size; i++) {
+        if (t->slots[i].refs == 0) continue;
+
+        *dedup_slot(slots, size, &t->slots[i].key) = t->slots[i];
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->size  = size;
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+int xdedup_init(xDedupTable *t) {
+    memset(t, 0, sizeof(xDedupTable));
+
+    t->slots = calloc(DEDUP_INITIAL_SIZE, sizeof(xDedupEntry));
+    if (!t->slots) return 0;
+
+    t->size = DEDUP_INITIAL_SIZE;
+
+    return 1;
+}
+
+void xdedup_free(xDedupTable *t) {
+    free(t->slots);
+    memset(t, 0, sizeof(xDedupTable));
+}
+
+// -----------------------------------------------------------------------------
+// The fragment first seen with those bytes, NULL if none was
+// -----------------------------------------------------------------------------
+xDedupEntry *xdedup_find(xDedupTable *t, const xDedupKey *key) {
+    if (!t || !t->slots) return NULL;
+
+    xDedupEntry *e = dedup_slot(t->slots, t->size, key);
+
+    return e->refs ? e : NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Remembers a fragment's bytes, an existing entry is left as it was
+// -----------------------------------------------------------------------------
+xDedupEntry *xdedup_insert(xDedupTable *t, const xDedupKey *key, uint32_t file_id, uint8_t fragment_id) {
+    if (!t || !t->slots) return NULL;
+
+    if ((uint64_t)(t->count + 1) * 100 > (uint64_t)t->size * DEDUP_MAX_LOAD_PCT && !dedup_grow(t)) return NULL;
+
+    xDedupEntry *e = dedup_slot(t->slots, t->size, key);
+    if (e->refs) return e;
+
+    e->key         = *key;
+    e->file_id     = file_id;
+    e->fragment_id = fragment_id;
+    e->refs        = 1;
+
+    t->count++;
+
+    return e;
+}
+
+// -----------------------------------------------------------------------------
+void xdedup_debug(const xDedupTable *t) {
+    if (!t) return;
+
+    printf("=== DEDUP ===\n");
+    printf("Contents: %u in %u slots\n", t->count, t->size);
+    printf("Shared: %lu fragments, %lu bytes not sent again\n", t->shared, t->shared_bytes);
+    printf("=============\n\n");
+}
@@ -0,0 +1,43 @@
+#ifndef FRAGMENT_DEDUP_H
+#define FRAGMENT_DEDUP_H
+
+#include <stdint.h>
+
+#define DEDUP_INITIAL_SIZE  ( 1024 )    // slots, power of two, grows by doubling
+#define DEDUP_MAX_LOAD_PCT  ( 70 )
+
+// what a fragment's bytes look like, their SHA-256 and length
+typedef struct xDedupKey {
+    uint8_t  digest[32];
+    uint64_t size;
+} xDedupKey;
+
+// the first fragment seen with those bytes, the one later copies point at
+typedef struct xDedupEntry {
+    xDedupKey key;
+    uint32_t file_id;
+    uint8_t  fragment_id;
+    uint32_t refs;          // fragments made of those bytes, 0 marks an empty slot
+} xDedupEntry;
+
+// open addressing, nothing is ever removed
+typedef struct xDedupTable {
+    uint32_t count;
+    uint32_t size;
+    xDedupEntry *slots;     // malloc'ed
+
+    uint64_t shared;        // fragments that were not sent again
+    uint64_t shared_bytes;
+} xDedupTable;
+
+
+int  xdedup_init(xDedupTable *t);
+void xdedup_free(xDedupTable *t);
+
+xDedupKey    xdedup_key(const void *bytes, uint64_t size);
+xDedupEntry *xdedup_find(xDedupTable *t, const xDedupKey *key);
+xDedupEntry *xdedup_insert(xDedupTable *t, const xDedupKey *key, uint32_t file_id, uint8_t fragment_id);
+
+void xdedup_debug(const xDedupTable *t);
+
+#endif // FRAGMENT_DEDUP_H
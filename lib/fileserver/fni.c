@@ -1,4 +1,5 @@
 #include "fs.h"
+#include "../defines.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,64 +7,90 @@
 int xfilenetindex_init(xFileNetworkIndex *net) {
     if (!net) return 0;
     net->file_count = 0;
-    net->files = NULL;
-    net->TAIL  = NULL;
+    net->log   = NULL;
+    net->dedup = NULL;
 
-    return 1;
+    net->table_size = FILE_SERVER_INITIAL_CAPACITY * 2;
+    net->table = calloc(net->table_size, sizeof(xFileNetworkSlot));
+
+    return net->table != NULL;
 }
 
-xFileInNetwork *xfilenetindex_new_file(uint16_t file_id, uint64_t fragment_count) {
-    xFileInNetwork *file = calloc(1, sizeof(xFileInNetwork));
+xFileInNetwork *xfilenetindex_new_file(uint32_t file_id, uint64_t fragment_count, uint8_t parity) {
+    xFileInNetwork *file = calloc(1, sizeof(xFileInNetwork) + fragment_count * sizeof(xFragmentNetworkPointer));
     if (!file) return NULL;
 
     file->file_id = file_id;
     file->total_fragments = fragment_count;
+    file->parity = parity;
+
+    return file;
+}
+
+static void fni_table_put(xFileNetworkSlot *table, uint32_t size, xFileInNetwork *file) {
+    uint32_t mask = size - 1;
 
-    if (fragment_count > 0) {
-        file->fragments = calloc(fragment_count, sizeof(xFragmentNetworkPointer));
-        if (!file->fragments) {
-            free(file);
-            return NULL;
+    for (uint32_t i = file->file_id & mask; ; i = (i + 1) & mask) {
+        if (table[i].file_id == 0) {
+            table[i].file_id = file->file_id;
+            table[i].file    = file;
+            return;
         }
     }
+}
 
-    file->next = NULL;
-    return file;
+// -----------------------------------------------------------------------------
+// Doubles the table and puts every entry back
+// -----------------------------------------------------------------------------
+static int fni_rehash(xFileNetworkIndex *net, uint32_t size) {
+    xFileNetworkSlot *table = calloc(size, sizeof(xFileNetworkSlot));
+    if (!table) return 0;
+
+    for (uint32_t i = 0; i < net->table_size; i++) {
+        if (net->table[i].file_id != 0) fni_table_put(table, size, net->table[i].file);
+    }
+
+    free(net->table);
+
+    net->table      = table;
+    net->table_size = size;
+
+    return 1;
 }
 
-void xfilenetindex_add_file(xFileNetworkIndex *net, xFileInNetwork *file) {
-    if (!net || !file) return;
+int xfilenetindex_add_file(xFileNetworkIndex *net, xFileInNetwork *file) {
+    if (!net || !file || file->file_id == 0) return 0;
 
-    if (!net->files) {
-        net->files = file;
-        net->TAIL = file;
-    } else {
-        net->TAIL->next = file;
-        net->TAIL = file;
+    if ((uint64_t)(net->file_count + 1) * 100 > (uint64_t)net->table_size * FILE_SERVER_MAX_LOAD_PCT) {
+        if (!fni_rehash(net, net->table_size * 2)) return 0;
     }
 
+    fni_table_put(net->table, net->table_size, file);
     net->file_count++;
+
+    return 1;
 }
 
-/**
- *  Finds the file based on its id
- * ------------------------------------------------------------ 
- *  Note:   Since ids are incremental, this could use BS.
- *          The list will always be ordered. 
- */
-xFileInNetwork *xfilenetindex_find_file(xFileNetworkIndex *net, uint16_t file_id) {
-    if (!net) return NULL;
-
-    xFileInNetwork *curr = net->files;
-    while (curr)
-    {
-        if (curr->file_id == file_id)
-            return curr;
-        curr = curr->next;
+// -----------------------------------------------------------------------------
+// Finds the file based on its id, a probe stops at the first empty slot
+// -----------------------------------------------------------------------------
+xFileInNetwork *xfilenetindex_find_file(xFileNetworkIndex *net, uint32_t file_id) {
+    if (!net || !net->table || file_id == 0) return NULL;
+
+    uint32_t mask = net->table_size - 1;
+
+    for (uint32_t i = file_id & mask; net->table[i].file_id != 0; i = (i + 1) & mask) {
+        if (net->table[i].file_id == file_id) return net->table[i].file;
     }
+
     return NULL;
 }
 
+// pointers per fragment, the parity of a coded file stands in for copies
+int xfilenetindex_replicas(const xFileInNetwork *file) {
+    return file->parity ? 1 : REDUNDANCY;
+}
+
 void xfilenetindex_debug(const xFileNetworkIndex *net) {
     if (!net)
     {
@@ -74,35 +101,32 @@ void xfilenetindex_debug(const xFileNetworkIndex *net) {
     printf("\n=== FILE INDEX Debug ===\n");
     printf("Total files: %u\n\n", net->file_count);
 
-    if (!net->files)
+    if (net->file_count == 0)
     {
         printf("  [xfilenetindex] No files registered.\n\n");
         return;
     }
 
-    const xFileInNetwork *file = net->files;
-    uint16_t index = 0;
+    uint32_t index = 0;
+
+    for (uint32_t slot = 0; slot < net->table_size; slot++) {
+        const xFileInNetwork *file = net->table[slot].file;
+        if (net->table[slot].file_id == 0) continue;
 
-    while (file != NULL) {
         printf("I: %p\n", file);
         printf("File #%u: ID: %u\n", index++, file->file_id);
         printf("  Total fragments: %llu\n",
                (unsigned long long)file->total_fragments);
 
-        if (!file->fragments) {
-            printf("    [no fragments allocated]\n");
-        } else {
-            for (uint64_t f = 0; f < file->total_fragments; f++) {
-                const xFragmentNetworkPointer *frag = &file->fragments[f];
-                printf("    Fragment #%3llu | fragment_id: %5u | node_id: %10llu\n",
-                       (unsigned long long)f,
-                       frag->fragment,
-                       (unsigned long long)frag->node_id);
-            }
+        for (uint64_t f = 0; f < file->total_fragments; f++) {
+            const xFragmentNetworkPointer *frag = &file->fragments[f];
+            printf("    Fragment #%3llu | fragment_id: %5u | node_id: %10llu\n",
+                   (unsigned long long)f,
+                   frag->fragment,
+                   (unsigned long long)frag->node_id);
         }
 
         printf("\n");
-        file = file->next;
     }
 }
 
@@ -1,17 +1,87 @@
 #include "fs.h"
+#include "../defines.h"
 
+#include <time.h>
 
 
+
+// -----------------------------------------------------------------------------
+// Hashing, ids are sequential so they get mixed before masking
+// -----------------------------------------------------------------------------
+static uint32_t fs_hash_id(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x7feb352d;
+    id ^= id >> 15;
+    id *= 0x846ca68b;
+    id ^= id >> 16;
+    return id;
+}
+
+// FNV-1a over the fixed size name field
+static uint32_t fs_hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < 200 && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void fs_table_put(uint32_t *table, uint32_t size, uint32_t hash, uint32_t pos) {
+    uint32_t mask = size - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        if (table[i] == 0) {
+            table[i] = pos + 1;
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Doubles both tables and puts every file back
+// -----------------------------------------------------------------------------
+static int fs_rehash(xFileServer *fs, uint32_t size) {
+    uint32_t *by_id   = calloc(size, sizeof(uint32_t));
+    uint32_t *by_name = calloc(size, sizeof(uint32_t));
+
+    if (!by_id || !by_name) {
+        free(by_id);
+        free(by_name);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < fs->file_count; i++) {
+        fs_table_put(by_id, size, fs_hash_id(fs->files[i]->file_id), i);
+        fs_table_put(by_name, size, fs_hash_name(fs->files[i]->file_name), i);
+    }
+
+    free(fs->by_id);
+    free(fs->by_name);
+
+    fs->by_id      = by_id;
+    fs->by_name    = by_name;
+    fs->table_size = size;
+
+    return 1;
+}
+
 // -----------------------------------------------------------------------------
 // Initialize the index
 // -----------------------------------------------------------------------------
 int xfileserver_init(xFileServer *fs) {
   if ( fs == NULL ) return 0;
 
-  fs->file_count = 0;
-  fs->files = malloc( sizeof(xFileContainer) * FILE_SERVER_MAX_FILES );
+  memset(fs, 0, sizeof(xFileServer));
+
+  fs->capacity = FILE_SERVER_INITIAL_CAPACITY;
+  fs->files = malloc( sizeof(xFileContainer *) * fs->capacity );
 
-  return 1;
+  if ( fs->files == NULL ) return 0;
+
+  return fs_rehash(fs, FILE_SERVER_INITIAL_CAPACITY * 2);
 }
 
 // -----------------------------------------------------------------------------
@@ -20,33 +90,322 @@ int xfileserver_init(xFileServer *fs) {
 xFileContainer *xfileserver_add_file(
     xFileServer *index,
     const char *file_name,
-    uint16_t file_id,
+    uint32_t file_id,
     uint64_t total_size,
-    uint8_t fragment_count_total
+    uint8_t fragment_count_total,
+    uint8_t parity
 ) {
     if (!index || !index->files) return NULL;
 
-    xFileContainer *file = &index->files[index->file_count++];
+    if (index->file_count == index->capacity) {
+        xFileContainer **files = realloc(index->files, sizeof(xFileContainer *) * index->capacity * 2);
+        if (!files) return NULL;
+
+        index->files = files;
+        index->capacity *= 2;
+    }
+
+    if ((uint64_t)(index->file_count + 1) * 100 > (uint64_t)index->table_size * FILE_SERVER_MAX_LOAD_PCT) {
+        if (!fs_rehash(index, index->table_size * 2)) return NULL;
+    }
 
-    memset(file, 0, sizeof(xFileContainer));
+    xFileContainer *file = calloc(1, sizeof(xFileContainer));
+    if (!file) return NULL;
 
     strncpy(file->file_name, file_name, sizeof(file->file_name) - 1);
 
     file->file_id               = file_id;
     file->size                  = total_size;
     file->fragment_count_total  = fragment_count_total;
+    file->parity                = parity;
+
+    // fragments start at 1
+    file->slot_of = xslab_calloc(fragment_count_total + 1, sizeof(uint8_t));
+    if (!file->slot_of) {
+        free(file);
+        return NULL;
+    }
 
-    // guarantee they do not get mistaken by fragment 
-    file->fragments[0].fragment_id = 0;
-    file->fragments[1].fragment_id = 0;
+    uint32_t pos = index->file_count++;
+    if (file_id > index->last_id) index->last_id = file_id;
+    index->files[pos] = file;
+
+    fs_table_put(index->by_id, index->table_size, fs_hash_id(file_id), pos);
+    fs_table_put(index->by_name, index->table_size, fs_hash_name(file->file_name), pos);
     
     return file;
 }
 
+// mapped records are the store's, or the spill tier's on a node without one
+static xFileStore *fs_tier(xFileServer *fs) {
+    return fs->store ? fs->store : fs->spill;
+}
+
+// -----------------------------------------------------------------------------
+// Puts `f` (bytes slab or mapped) in its slot, dropping an older copy.
+// `stored_size` bytes are kept, `fragment_size` is what they unpack to.
+// -----------------------------------------------------------------------------
+static eFileAddFragStatus fs_place(xFileServer *fs, xFileContainer *file, const xFileFragment *f) {
+    xFileFragment *frag = xfileserver_get_fragment(file, f->fragment_id);
+
+    // a fragment stored again replaces the copy we had
+    if (frag != NULL) {
+        fs->stored -= frag->stored_size;
+
+        if (frag->record) {
+            xfilestore_drop(fs_tier(fs), frag->record);
+        }
+        else {
+            if (frag->spill) xfilestore_drop(fs->spill, frag->spill);
+            if (frag->fragment_bytes != f->fragment_bytes) xslab_free(frag->fragment_bytes);
+
+            fs->resident -= frag->stored_size;
+        }
+    }
+    else {
+        if (file->held == file->capacity) {
+            int capacity = file->capacity ? file->capacity * 2 : 2;
+            if (capacity > file->fragment_count_total) capacity = file->fragment_count_total;
+
+            xFileFragment *grown = xslab_alloc(sizeof(xFileFragment) * capacity);
+            if (!grown) return FRAG_ERR_INVALID_BYTES;
+
+            memcpy(grown, file->fragments, sizeof(xFileFragment) * file->held);
+            xslab_free(file->fragments);
+
+            file->fragments = grown;
+            file->capacity  = capacity;
+        }
+
+        frag = &file->fragments[file->held++];
+        file->slot_of[f->fragment_id] = file->held;
+    }
+
+    *frag = *f;
+    frag->spill      = 0;
+    frag->referenced = 1;
+
+    fs->stored   += frag->stored_size;
+    fs->bytes_in += frag->stored_size;
+
+    if (!frag->record) {
+        fs->resident += frag->stored_size;
+        xfileserver_budget(fs, frag);
+    }
+
+    return FRAG_OK;
+}
+
 // -----------------------------------------------------------------------------
-// Add a fragment to a file
+// Add a fragment to a file, taking ownership of `data` (must be xslab_alloc'ed).
+// The caller must not free it after FRAG_OK. With a store, or when it gets
+// packed, `data` is freed right away, look the fragment up for its bytes.
+// `crc` is the CRC32C of `data`, worked out while it came in.
+// -----------------------------------------------------------------------------
+eFileAddFragStatus xfileserver_adopt_fragment(
+    xFileServer *fs,
+    xFileContainer *file,
+    uint8_t fragment_id,
+    void *data,
+    uint64_t size,
+    uint32_t crc
+) {
+    if (!file) return FRAG_ERR_INVALID_FILE;
+    if (!data && size > 0) return FRAG_ERR_INVALID_BYTES;
+    if (fragment_id == 0 || fragment_id > file->fragment_count_total) return FRAG_ERR_INVALID_INDEX;
+
+    xFileFragment f = {
+        .fragment_id    = fragment_id,
+        .fragment_bytes = data,
+        .fragment_size  = size,
+        .stored_size    = size,
+        .codec          = LZ_CODEC_NONE,
+        .crc            = crc,
+        .checked        = 1,
+    };
+
+    // left raw when the samples say it would hardly shrink
+    if (FRAGMENT_COMPRESSION == COMPRESSION_AT_REST) {
+        size_t packed_size = 0;
+        char *packed = xlz_pack(data, size, &packed_size);
+
+        if (packed) {
+            f.fragment_bytes = packed;
+            f.stored_size    = packed_size;
+            f.codec          = LZ_CODEC_LZ;
+        }
+    }
+
+    char *bytes = f.fragment_bytes;
+    eFileAddFragStatus st;
+
+    if (!fs->store) {
+        st = fs_place(fs, file, &f);
+
+        if (bytes != data) {
+            if (st == FRAG_OK) xslab_free(data);
+            else xslab_free(bytes);
+        }
+
+        return st;
+    }
+
+    f.record = xfilestore_put(
+        fs->store, file->file_id, file->file_name, file->size, file->fragment_count_total,
+        file->parity, fragment_id, f.codec, crc, bytes, f.stored_size, &f.fragment_bytes
+    );
+
+    if (bytes != data) xslab_free(bytes);
+
+    if (!f.record) return FRAG_ERR_INVALID_BYTES;
+
+    st = fs_place(fs, file, &f);
+
+    if (st == FRAG_OK) xslab_free(data);
+    else xfilestore_drop(fs->store, f.record);
+
+    return st;
+}
+
+// -----------------------------------------------------------------------------
+// Keeps `src`'s fragment under `file` as well, the bytes are not copied.
+// A slab block gets one more owner, a stored one a record of its own.
+// -----------------------------------------------------------------------------
+eFileAddFragStatus xfileserver_share_fragment(
+    xFileServer *fs,
+    xFileContainer *file,
+    uint8_t fragment_id,
+    const xFileContainer *src,
+    uint8_t src_fragment_id
+) {
+    if (!file) return FRAG_ERR_INVALID_FILE;
+    if (fragment_id == 0 || fragment_id > file->fragment_count_total) return FRAG_ERR_INVALID_INDEX;
+
+    xFileFragment *from = xfileserver_get_fragment(src, src_fragment_id);
+    if (!from) return FRAG_ERR_INVALID_BYTES;
+
+    // placing may grow `file->fragments`, which `from` could be in
+    xFileFragment f = *from;
+    f.fragment_id = fragment_id;
+
+    xFileFragment *had = xfileserver_get_fragment(file, fragment_id);
+    if (had && had->fragment_bytes == f.fragment_bytes) return FRAG_OK;
+
+    if (!from->record) {
+        if (!xslab_retain(f.fragment_bytes)) return FRAG_ERR_INVALID_BYTES;
+
+        eFileAddFragStatus st = fs_place(fs, file, &f);
+        if (st != FRAG_OK) xslab_free(f.fragment_bytes);
+
+        return st;
+    }
+
+    f.record = xfilestore_link(
+        fs_tier(fs), from->record, file->file_id, file->file_name,
+        file->size, file->fragment_count_total, file->parity, fragment_id
+    );
+
+    if (!f.record) return FRAG_ERR_INVALID_BYTES;
+
+    eFileAddFragStatus st = fs_place(fs, file, &f);
+    if (st != FRAG_OK) xfilestore_drop(fs_tier(fs), f.record);
+
+    return st;
+}
+
+// -----------------------------------------------------------------------------
+// Rebuilds the containers from the store's records, their bytes stay mapped
+// -----------------------------------------------------------------------------
+uint32_t xfileserver_restore(xFileServer *fs) {
+    if (!fs || !fs->store) return 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    xFileStore *st = fs->store;
+    uint32_t restored = 0;
+
+    for (uint32_t i = 0; i < st->table->count; i++) {
+        const xStoreRecord *r = st->records + i;
+
+        if (r->state != STORE_RECORD_LIVE) continue;
+
+        xFileContainer *file = xfileserver_find_file(fs, r->file_id);
+
+        if (!file) file = xfileserver_add_file(fs, r->file_name, r->file_id, r->file_size, r->fragment_count, r->parity);
+
+        if (!file || r->fragment_id == 0 || r->fragment_id > file->fragment_count_total) {
+            printf("[STORE] : RECORD %u DOES NOT FIT FILE #%u.\n", i, r->file_id);
+            continue;
+        }
+
+        char *bytes = xfilestore_bytes(st, r);
+
+        xFileFragment f = {
+            .fragment_id    = r->fragment_id,
+            .fragment_bytes = bytes,
+            .fragment_size  = r->codec == LZ_CODEC_NONE ? r->size : xlz_logical(bytes, r->size),
+            .stored_size    = r->size,
+            .codec          = r->codec,
+            .crc            = r->crc,
+            .checked        = r->checked,
+            .record         = i + 1,
+        };
+
+        if (fs_place(fs, file, &f) == FRAG_OK) restored++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("[STORE] : %u FRAGMENTS OF %u FILES BACK IN %.2fms.\n", restored, fs->file_count, ms);
+
+    return restored;
+}
+
+// -----------------------------------------------------------------------------
+// A fragment kept here, NULL if it lives elsewhere
+// -----------------------------------------------------------------------------
+xFileFragment *xfileserver_get_fragment( const xFileContainer *file, uint8_t fragment_id ) {
+    if (!file || fragment_id == 0 || fragment_id > file->fragment_count_total) return NULL;
+
+    uint8_t slot = file->slot_of[fragment_id];
+
+    return slot ? &file->fragments[slot - 1] : NULL;
+}
+
+// -----------------------------------------------------------------------------
+// The fragment as the file has it. Packed ones are unpacked into a slab
+// block left in `unpacked` for the caller to free, NULL if that failed.
+// -----------------------------------------------------------------------------
+const char *xfileserver_fragment_bytes( const xFileFragment *frag, char **unpacked ) {
+    *unpacked = NULL;
+
+    if (frag->codec == LZ_CODEC_NONE) return frag->fragment_bytes;
+
+    char *out = xslab_alloc(frag->fragment_size);
+    if (!out) return NULL;
+
+    if (!xlz_unpack(frag->fragment_bytes, frag->stored_size, out, frag->fragment_size)) {
+        printf("[xfileserver] FRAGMENT #%u DOES NOT UNPACK.\n", frag->fragment_id);
+        xslab_free(out);
+        return NULL;
+    }
+
+    *unpacked = out;
+    return out;
+}
+
+// how the file is cut, see erasure.h. A replicated one has no parity
+void xfileserver_shape( const xFileContainer *file, xErasureShape *s ) {
+    xerasure_shape(s, file->size, file->fragment_count_total - file->parity, file->parity);
+}
+
+// -----------------------------------------------------------------------------
+// Add a fragment to a file (copies `data`)
 // -----------------------------------------------------------------------------
 eFileAddFragStatus xfileserver_add_fragment(
+    xFileServer *fs,
     xFileContainer *file,
     uint8_t fragment_id,
     const void *data,
@@ -54,53 +413,46 @@ eFileAddFragStatus xfileserver_add_fragment(
 ) {
     if (!file) return FRAG_ERR_INVALID_FILE;
 
-    int idx = file->fragments[0].fragment_id == 0
-        ? 0
-        : 1;
-
-    xFileFragment *frag = &file->fragments[idx];
-    
-    frag->fragment_id = fragment_id;
-    frag->fragment_bytes = malloc(size);
-
-    if (!frag->fragment_bytes) return FRAG_ERR_INVALID_BYTES;
+    char *bytes = xslab_alloc(size);
+    if (!bytes) return FRAG_ERR_INVALID_BYTES;
 
-    memcpy(frag->fragment_bytes, data, size);
+    memcpy(bytes, data, size);
 
-    frag->fragment_size = size;
+    eFileAddFragStatus st = xfileserver_adopt_fragment(fs, file, fragment_id, bytes, size, xcrc32c(0, data, size));
+    if (st != FRAG_OK) xslab_free(bytes);
 
-    return FRAG_OK;
+    return st;
 }
 
 // -----------------------------------------------------------------------------
-// 
+// Lookups, a probe stops at the first empty slot
 // -----------------------------------------------------------------------------
 xFileContainer *xfileserver_find_file( xFileServer *idx, uint64_t id ) {
+    if (!idx || !idx->by_id) return NULL;
 
-    xFileContainer *f = NULL;
+    uint32_t mask = idx->table_size - 1;
 
-    for (int i = 0; i < idx->file_count; i++) {
-        f = idx->files + i;
-        if ( f->file_id == id ) break;
-        f = NULL;
+    for (uint32_t i = fs_hash_id((uint32_t)id) & mask; idx->by_id[i] != 0; i = (i + 1) & mask) {
+        xFileContainer *f = idx->files[idx->by_id[i] - 1];
+        if ( f->file_id == id ) return f;
     }
 
-    return f;
+    return NULL;
 }
 
 xFileContainer *xfileserver_find_file_by_name( xFileServer *idx, char *name ) {
-
-    xFileContainer *f = NULL;
+    if (!idx || !idx->by_name) return NULL;
 
     name[199] = '\0'; // make sure last character is 
 
-    for (int i = 0; i < idx->file_count; i++) {
-        f = idx->files + i;
-        if ( strcmp( f->file_name, name ) == 0 ) break;
-        f = NULL;
+    uint32_t mask = idx->table_size - 1;
+
+    for (uint32_t i = fs_hash_name(name) & mask; idx->by_name[i] != 0; i = (i + 1) & mask) {
+        xFileContainer *f = idx->files[idx->by_name[i] - 1];
+        if ( strcmp( f->file_name, name ) == 0 ) return f;
     }
 
-    return f;
+    return NULL;
 }
 
 
@@ -110,11 +462,14 @@ xFileContainer *xfileserver_find_file_by_name( xFileServer *idx, char *name ) {
 void xfileserver_free_file(xFileContainer *file) {
     if (!file) return;
 
-    for (uint8_t i = 0; i < file->fragment_count_total; i++) {
-        free(file->fragments[i].fragment_bytes);
+    // mapped ones go with the store
+    for (uint8_t i = 0; i < file->held; i++) {
+        if (!file->fragments[i].record) xslab_free(file->fragments[i].fragment_bytes);
     }
 
-    memset(file, 0, sizeof(xFileContainer));
+    xslab_free(file->fragments);
+    xslab_free(file->slot_of);
+    free(file);
 }
 
 // -----------------------------------------------------------------------------
@@ -123,11 +478,13 @@ void xfileserver_free_file(xFileContainer *file) {
 void xfileserver_free_fs(xFileServer *fs) {
     if (!fs) return;
 
-    for (uint16_t i = 0; i < fs->file_count; i++) {
-        xfileserver_free_file(&fs->files[i]);
+    for (uint32_t i = 0; i < fs->file_count; i++) {
+        xfileserver_free_file(fs->files[i]);
     }
 
     free(fs->files);
+    free(fs->by_id);
+    free(fs->by_name);
     free(fs);
 }
 
@@ -142,10 +499,13 @@ void xfileserver_debug(const xFileServer *fs) {
     }
 
     printf("\n=== FILE STORAGE Debug ===\n");
-    printf("Total files: %u\n\n", fs->file_count);
+    printf("Total files: %u\n", fs->file_count);
+    printf("In memory: %lu bytes", fs->resident);
+    if (fs->spill) printf(" of %lu | Spilled %lu times, promoted %lu", fs->budget, fs->spills, fs->promotions);
+    printf("\n\n");
 
-    for (uint16_t i = 0; i < fs->file_count; i++) {
-        const xFileContainer *file = &fs->files[i];
+    for (uint32_t i = 0; i < fs->file_count; i++) {
+        const xFileContainer *file = fs->files[i];
         printf("File #%u: '%s'\n", i, file->file_name);
         printf("  ID: %u | Total size: %llu bytes | Fragments: %u\n",
                file->file_id,
@@ -155,19 +515,21 @@ void xfileserver_debug(const xFileServer *fs) {
         // fragments start at 1
         for (uint8_t f = 1; f <= file->fragment_count_total; f++) {
     
-            const xFileFragment *frag = NULL;
-            int i = 0;
-            for(; i < 2; i++){
-                if ( file->fragments[i].fragment_id == f ) {
-                    frag = file->fragments+i;
-                }
-            }
-   
+            const xFileFragment *frag = xfileserver_get_fragment(file, f);
+
             if ( frag == NULL ) {
                 printf("    Fragment #%3u | [fragment elsewhere]\n", f);
                 continue;
             }
 
+            if ( frag->codec != LZ_CODEC_NONE ) {
+                printf("    Fragment #%3u | size: %8llu bytes \t| packed: %llu bytes\n",
+                       frag->fragment_id,
+                       (unsigned long long)frag->fragment_size,
+                       (unsigned long long)frag->stored_size);
+                continue;
+            }
+
             printf("    Fragment #%3u | size: %8llu bytes \t| preview: \"",
                    frag->fragment_id,
                    (unsigned long long)frag->fragment_size);
@@ -183,4 +545,6 @@ void xfileserver_debug(const xFileServer *fs) {
 
         printf("\n");
     }
+
+    xslab_debug();
 }
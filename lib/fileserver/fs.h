@@ -1,12 +1,20 @@
 #ifndef FILE_SERVER_H
 #define FILE_SERVER_H
 
-#define FILE_SERVER_MAX_FILES     ( 100 )
+#define FILE_SERVER_INITIAL_CAPACITY  ( 64 )  // grows by doubling
+#define FILE_SERVER_MAX_LOAD_PCT      ( 70 )  // hash tables grow past that
 
 #define __FILE_FRAGMENT_ID_TYPE__ uint8_t // no need for more than 256 fragments for a single file
 
 
 #include <stdint.h>
+#include "../memory/slab.h"
+#include "../codec/lz.h"
+#include "../codec/crc32c.h"
+#include "../codec/erasure.h"
+#include "store.h"
+#include "wal.h"
+#include "dedup.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -21,45 +29,92 @@ static int FILE_SERVER_ID = 0;
 typedef struct xFileFragment {
   __FILE_FRAGMENT_ID_TYPE__ fragment_id; // 1, 2, 3... ,
   char *fragment_bytes;
-  uint64_t fragment_size;
+  uint64_t fragment_size;     // logical, what the file gets
+  uint64_t stored_size;       // what fragment_bytes holds, smaller when packed
+  uint8_t  codec;             // LZ_CODEC_*
+  uint8_t  checked;           // `crc` is known, fragments stored before it was kept have none
+  uint32_t crc;               // CRC32C of the logical bytes
+  uint32_t record;            // store (or spill tier) record + 1, 0 while the bytes are a slab block
+  uint32_t spill;             // spill tier record + 1 still holding a promoted fragment's copy
+  uint8_t  referenced;        // read since the clock hand went by, see tier.c
 } xFileFragment;
 
+// only the fragments kept on this node are listed, `slot_of` maps a
+// fragment id to its position in `fragments` (+1, 0 when not held)
 typedef struct xFileContainer {
   char file_name[200];
-  uint16_t file_id;
+  uint32_t file_id;
   uint64_t size; 
   uint8_t fragment_count_total;
+  uint8_t parity;             // erasure coded parity fragments among them, 0 when replicated
 
-  xFileFragment fragments[2]; // this should prolly use REDUNDANCY
+  uint8_t held;
+  uint8_t capacity;
+  xFileFragment *fragments;   // slab, `held` long
+  uint8_t *slot_of;           // slab, fragment_count_total + 1 long
 } xFileContainer;
 
+// containers never move once added, callers keep pointers to them.
+// lookups go through two open addressing tables holding positions
+// in `files` (+1, 0 is an empty slot), one by id and one by name.
 typedef struct xFileServer{
-  uint16_t file_count;
-  xFileContainer *files;
+  uint32_t file_count;
+  uint32_t capacity;
+  xFileContainer **files;   // malloc'ed, in insertion order
+  uint32_t last_id;         // highest id seen, new files go after it
+
+  uint32_t table_size;      // power of two
+  uint32_t *by_id;          // malloc'ed
+  uint32_t *by_name;        // malloc'ed
+
+  xFileStore *store;        // NULL keeps fragments in RAM only
+  xFileStore *spill;        // cold fragments past `budget` without a store, see tier.c
+
+  uint64_t budget;          // fragment bytes kept in RAM, 0 is no limit
+  uint64_t resident;        // fragment bytes in RAM now
+  uint32_t hand_file;       // clock hand over the kept fragments
+  uint8_t  hand_slot;
+  uint64_t spills;
+  uint64_t promotions;
+
+  uint64_t stored;          // fragment bytes kept, every tier
+  uint64_t bytes_in;        // fragment bytes ever kept, for the load report
+  uint64_t bytes_out;       // and ever sent
 } xFileServer;
 
 // ------------------------------------------------------------ 
 typedef struct xFragmentNetworkPointer {
   uint16_t fragment;
+  uint8_t  shared;        // the holder got it as a copy of identical bytes it had
   uint64_t size;
   uint64_t node_id;       
 } xFragmentNetworkPointer;
 
-// linked list like
+// one allocation, the pointers right after the entry
 typedef struct xFileInNetwork{
-    uint16_t file_id;
+    uint32_t file_id;
     uint64_t total_fragments; // this includes redundancy
-    xFragmentNetworkPointer *fragments;
-
-    struct xFileInNetwork *next;
+    uint8_t parity;           // erasure coded, one pointer per fragment then
+    xFragmentNetworkPointer fragments[];
 } xFileInNetwork;
 
+// the id sits in the slot so a probe never leaves the table
+typedef struct xFileNetworkSlot {
+    uint32_t file_id;         // 0 is an empty slot
+    xFileInNetwork *file;
+} xFileNetworkSlot;
+
+// entries never move once added, callers keep pointers to them.
+// ids are handed out in order and index an open addressing table
+// by their low bits, consecutive files land in consecutive slots.
 typedef struct xFileNetworkIndex {
-    uint16_t file_id;
-    uint16_t file_count;
+    uint32_t file_count;
 
-    xFileInNetwork *files;
-    xFileInNetwork *TAIL;
+    uint32_t table_size;    // power of two
+    xFileNetworkSlot *table;// malloc'ed
+
+    xIndexLog *log;         // NULL while placements are not persisted
+    xDedupTable *dedup;     // NULL unless FRAGMENT_DEDUP
 } xFileNetworkIndex;
 // ------------------------------------------------------------ 
 
@@ -80,20 +135,50 @@ int xfileserver_init(xFileServer *fs);
 xFileContainer *xfileserver_add_file(
     xFileServer *index,
     const char *file_name,
-    uint16_t file_id,
+    uint32_t file_id,
     uint64_t total_size,
-    uint8_t fragment_count_total
+    uint8_t fragment_count_total,
+    uint8_t parity
 );
 
 
 
 eFileAddFragStatus xfileserver_add_fragment(
+    xFileServer *fs,
     xFileContainer *file,
     uint8_t fragment_id,
     const void *data,
     uint64_t size
 );
 
+eFileAddFragStatus xfileserver_adopt_fragment(
+    xFileServer *fs,
+    xFileContainer *file,
+    uint8_t fragment_id,
+    void *data,
+    uint64_t size,
+    uint32_t crc
+);
+
+eFileAddFragStatus xfileserver_share_fragment(
+    xFileServer *fs,
+    xFileContainer *file,
+    uint8_t fragment_id,
+    const xFileContainer *src,
+    uint8_t src_fragment_id
+);
+
+xFileFragment *xfileserver_get_fragment( const xFileContainer *file, uint8_t fragment_id );
+const char *xfileserver_fragment_bytes( const xFileFragment *frag, char **unpacked );
+void xfileserver_shape( const xFileContainer *file, xErasureShape *s );
+
+uint32_t xfileserver_restore(xFileServer *fs);
+
+int  xfileserver_open_spill(xFileServer *fs, xFileStore *st, const char *dir, uint64_t node_id, uint64_t budget);
+void xfileserver_budget(xFileServer *fs, const xFileFragment *keep);
+xFileFragment *xfileserver_touch(xFileServer *fs, const xFileContainer *file, uint8_t fragment_id);
+uint64_t xfileserver_free_bytes(const xFileServer *fs);
+
 void xfileserver_free_file(xFileContainer *file);
 void xfileserver_free_fs(xFileServer *fs);
 
@@ -108,11 +193,19 @@ void xfileserver_debug(const xFileServer *fs);
 
 
 int xfilenetindex_init(xFileNetworkIndex *net);
-xFileInNetwork *xfilenetindex_new_file(uint16_t file_id, uint64_t fragment_count);
-void xfilenetindex_add_file(xFileNetworkIndex *net, xFileInNetwork *file);
-xFileInNetwork *xfilenetindex_find_file(xFileNetworkIndex *net, uint16_t file_id);
+xFileInNetwork *xfilenetindex_new_file(uint32_t file_id, uint64_t fragment_count, uint8_t parity);
+int  xfilenetindex_add_file(xFileNetworkIndex *net, xFileInNetwork *file);
+xFileInNetwork *xfilenetindex_find_file(xFileNetworkIndex *net, uint32_t file_id);
+int xfilenetindex_replicas(const xFileInNetwork *file);
 void xfilenetindex_debug(const xFileNetworkIndex *net);
 
+int  xindexlog_open(xIndexLog *log, const char *dir, xFileServer *fs, xFileNetworkIndex *net);
+void xindexlog_record(xFileNetworkIndex *net, xFileServer *fs, const xFileInNetwork *f);
+size_t xindexlog_entry(const xFileContainer *fc, const xFileInNetwork *f, xIndexLogEntry *e);
+xFileInNetwork *xindexlog_apply(xFileServer *fs, xFileNetworkIndex *net, const xIndexLogEntry *e, const xFragmentNetworkPointer *ptrs);
+int  xindexlog_snapshot(xIndexLog *log, xFileServer *fs, xFileNetworkIndex *net);
+void xindexlog_close(xIndexLog *log);
+
 
 
 #endif // FILE_SERVER_H
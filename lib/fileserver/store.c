@@ -0,0 +1,372 @@
+#include "store.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ *  Memory mapped fragment store
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Fragment bytes are appended to segment files that stay
+ *      mapped, the file server points straight into them. A
+ *      table file, also mapped, holds one fixed size record per
+ *      fragment. Bytes are written before their record and a
+ *      record before the count covers it, so a restarted node
+ *      only trusts what was completely written.
+ *
+ *      Identical fragments (see FRAGMENT_DEDUP) are linked, their
+ *      records point at the same bytes.
+ *
+ *      Writes live in the page cache, they survive the process
+ *      but not necessarily the host going down.
+ *
+ *      Layout under <data dir>/node-<id>/:
+ *          table           header + records
+ *          seg-00000 ...   fragment bytes
+ */
+
+static uint64_t store_align(uint64_t n) {
+    return (n + STORE_ALIGN - 1) & ~(uint64_t)(STORE_ALIGN - 1);
+}
+
+static size_t store_table_bytes(uint32_t capacity) {
+    return sizeof(xStoreTableHeader) + (size_t)capacity * sizeof(xStoreRecord);
+}
+
+// -----------------------------------------------------------------------------
+// Maps the table at `capacity` records, growing the file if needed
+// -----------------------------------------------------------------------------
+static int store_map_table(xFileStore *st, uint32_t capacity) {
+    size_t bytes = store_table_bytes(capacity);
+
+    if (ftruncate(st->table_fd, bytes) < 0) {
+        perror("[STORE] table");
+        return 0;
+    }
+
+    if (st->table) munmap(st->table, store_table_bytes(st->table->capacity));
+
+    void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, st->table_fd, 0);
+    if (m == MAP_FAILED) {
+        perror("[STORE] mmap table");
+        st->table = NULL;
+        return 0;
+    }
+
+    st->table   = m;
+    st->records = (xStoreRecord *)(st->table + 1);
+
+    st->table->capacity = capacity;
+
+    return 1;
+}
+
+static int store_map_segment(xFileStore *st, int fd, uint64_t size) {
+    xStoreSegment *segs = realloc(st->segments, sizeof(xStoreSegment) * (st->segment_count + 1));
+    if (!segs) return 0;
+
+    st->segments = segs;
+
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        perror("[STORE] mmap segment");
+        return 0;
+    }
+
+    xStoreSegment *s = st->segments + st->segment_count++;
+    s->fd   = fd;
+    s->base = m;
+    s->size = size;
+    s->used = 0;
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// A new segment, sparse until written
+// -----------------------------------------------------------------------------
+static xStoreSegment *store_new_segment(xFileStore *st, uint64_t at_least) {
+    if (st->segment_count >= UINT16_MAX) return NULL;
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/seg-%05u", st->dir, st->segment_count);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("[STORE] segment");
+        return NULL;
+    }
+
+    uint64_t size = at_least > STORE_SEGMENT_SIZE ? store_align(at_least) : STORE_SEGMENT_SIZE;
+
+    if (ftruncate(fd, size) < 0 || !store_map_segment(st, fd, size)) {
+        close(fd);
+        return NULL;
+    }
+
+    return st->segments + st->segment_count - 1;
+}
+
+// -----------------------------------------------------------------------------
+// Opens (or creates) this node's store and maps everything in it
+// -----------------------------------------------------------------------------
+int xfilestore_open(xFileStore *st, const char *dir, uint64_t node_id) {
+    memset(st, 0, sizeof(xFileStore));
+    st->table_fd = -1;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("[STORE] data dir");
+        return 0;
+    }
+
+    snprintf(st->dir, sizeof(st->dir), "%s/node-%lu", dir, node_id);
+
+    if (mkdir(st->dir, 0755) < 0 && errno != EEXIST) {
+        perror("[STORE] node dir");
+        return 0;
+    }
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/table", st->dir);
+
+    st->table_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (st->table_fd < 0) {
+        perror("[STORE] table");
+        return 0;
+    }
+
+    struct stat sb;
+    if (fstat(st->table_fd, &sb) < 0) return 0;
+
+    bool fresh = (size_t)sb.st_size < sizeof(xStoreTableHeader);
+
+    if (fresh) {
+        if (!store_map_table(st, STORE_TABLE_INITIAL)) return 0;
+
+        st->table->magic   = STORE_MAGIC;
+        st->table->version = STORE_VERSION;
+        st->table->count   = 0;
+    }
+    else {
+        xStoreTableHeader h;
+        if (pread(st->table_fd, &h, sizeof(h), 0) != sizeof(h)) return 0;
+
+        if (h.magic != STORE_MAGIC || h.version != STORE_VERSION || (size_t)sb.st_size < store_table_bytes(h.capacity)) {
+            printf("[STORE] : %s IS NOT A STORE TABLE.\n", path);
+            return 0;
+        }
+
+        if (!store_map_table(st, h.capacity)) return 0;
+    }
+
+    // every segment there is, in order
+    for (;;) {
+        snprintf(path, sizeof(path), "%s/seg-%05u", st->dir, st->segment_count);
+
+        int fd = open(path, O_RDWR);
+        if (fd < 0) break;
+
+        if (fstat(fd, &sb) < 0 || !store_map_segment(st, fd, sb.st_size)) {
+            close(fd);
+            break;
+        }
+    }
+
+    // appends go after the last byte any record points to
+    for (uint32_t i = 0; i < st->table->count; i++) {
+        xStoreRecord *r = st->records + i;
+
+        if (r->state == STORE_RECORD_FREE) continue;
+
+        if (r->segment >= st->segment_count || r->offset + r->size > st->segments[r->segment].size) {
+            printf("[STORE] : RECORD %u POINTS OUTSIDE THE SEGMENTS, DROPPED.\n", i);
+            r->state = STORE_RECORD_DEAD;
+            continue;
+        }
+
+        xStoreSegment *s = st->segments + r->segment;
+        uint64_t end = store_align(r->offset + r->size);
+        if (end > s->used) s->used = end;
+    }
+
+    printf("[STORE] : %s HAS %u RECORDS IN %u SEGMENTS.\n", st->dir, st->table->count, st->segment_count);
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+void xfilestore_close(xFileStore *st) {
+    if (!st) return;
+
+    for (uint32_t i = 0; i < st->segment_count; i++) {
+        munmap(st->segments[i].base, st->segments[i].size);
+        close(st->segments[i].fd);
+    }
+    free(st->segments);
+
+    if (st->table) munmap(st->table, store_table_bytes(st->table->capacity));
+    if (st->table_fd >= 0) close(st->table_fd);
+
+    memset(st, 0, sizeof(xFileStore));
+    st->table_fd = -1;
+}
+
+// -----------------------------------------------------------------------------
+// A live record for bytes already in a segment, returns it + 1 (0 if full)
+// -----------------------------------------------------------------------------
+static uint32_t store_add_record(
+    xFileStore *st,
+    uint16_t segment,
+    uint64_t offset,
+    uint64_t size,
+    uint32_t file_id,
+    const char *file_name,
+    uint64_t file_size,
+    uint8_t fragment_count,
+    uint8_t parity,
+    uint8_t fragment_id,
+    uint8_t codec,
+    uint32_t crc
+) {
+    if (st->table->count == st->table->capacity && !store_map_table(st, st->table->capacity * 2)) return 0;
+
+    uint32_t idx = st->table->count;
+    xStoreRecord *r = st->records + idx;
+
+    memset(r, 0, sizeof(xStoreRecord));
+    r->file_id        = file_id;
+    r->segment        = segment;
+    r->fragment_id    = fragment_id;
+    r->fragment_count = fragment_count;
+    r->parity         = parity;
+    r->codec          = codec;
+    r->checked        = 1;
+    r->crc            = crc;
+    r->offset         = offset;
+    r->size           = size;
+    r->file_size      = file_size;
+    strncpy(r->file_name, file_name, sizeof(r->file_name) - 1);
+
+    r->state = STORE_RECORD_LIVE;
+    st->table->count++;
+
+    return idx + 1;
+}
+
+// -----------------------------------------------------------------------------
+// Copies a fragment in. `out` gets the mapped copy.
+// Returns the record + 1, 0 if it could not be stored.
+// -----------------------------------------------------------------------------
+uint32_t xfilestore_put(
+    xFileStore *st,
+    uint32_t file_id,
+    const char *file_name,
+    uint64_t file_size,
+    uint8_t fragment_count,
+    uint8_t parity,
+    uint8_t fragment_id,
+    uint8_t codec,
+    uint32_t crc,
+    const void *bytes,
+    uint64_t size,
+    char **out
+) {
+    if (!st || !st->table) return 0;
+
+    // room for the record first, the bytes would be lost otherwise
+    if (st->table->count == st->table->capacity && !store_map_table(st, st->table->capacity * 2)) return 0;
+
+    xStoreSegment *s = st->segment_count > 0 ? st->segments + st->segment_count - 1 : NULL;
+
+    if (s == NULL || s->used + size > s->size) {
+        s = store_new_segment(st, size);
+        if (s == NULL) return 0;
+    }
+
+    uint64_t offset = s->used;
+
+    memcpy(s->base + offset, bytes, size);
+    s->used = store_align(offset + size);
+
+    *out = s->base + offset;
+
+    return store_add_record(
+        st, (uint16_t)(s - st->segments), offset, size,
+        file_id, file_name, file_size, fragment_count, parity, fragment_id, codec, crc
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Another fragment made of `record`'s bytes, nothing is copied.
+// Returns the new record + 1, 0 if it could not be added.
+// -----------------------------------------------------------------------------
+uint32_t xfilestore_link(
+    xFileStore *st,
+    uint32_t record,
+    uint32_t file_id,
+    const char *file_name,
+    uint64_t file_size,
+    uint8_t fragment_count,
+    uint8_t parity,
+    uint8_t fragment_id
+) {
+    if (!st || !st->table || record == 0 || record > st->table->count) return 0;
+
+    // the table may move while growing
+    xStoreRecord from = st->records[record - 1];
+
+    if (from.state != STORE_RECORD_LIVE) return 0;
+
+    uint32_t linked = store_add_record(
+        st, from.segment, from.offset, from.size,
+        file_id, file_name, file_size, fragment_count, parity, fragment_id, from.codec, from.crc
+    );
+
+    if (linked) st->records[linked - 1].checked = from.checked;
+
+    return linked;
+}
+
+void xfilestore_drop(xFileStore *st, uint32_t record) {
+    if (!st || record == 0 || record > st->table->count) return;
+
+    st->records[record - 1].state = STORE_RECORD_DEAD;
+}
+
+// -----------------------------------------------------------------------------
+// Forgets every record, the segments are written over from the start
+// -----------------------------------------------------------------------------
+void xfilestore_clear(xFileStore *st) {
+    if (!st || !st->table) return;
+
+    st->table->count = 0;
+
+    for (uint32_t i = 0; i < st->segment_count; i++) st->segments[i].used = 0;
+}
+
+// -----------------------------------------------------------------------------
+// Unmaps a record's whole pages from this process, they stay in the file
+// (and the page cache, where the kernel can drop them once written back)
+// -----------------------------------------------------------------------------
+void xfilestore_release(const xFileStore *st, uint32_t record) {
+    if (!st || record == 0 || record > st->table->count) return;
+
+    const xStoreRecord *r = st->records + record - 1;
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    uint64_t from = (r->offset + page - 1) & ~(page - 1);
+    uint64_t to   = (r->offset + r->size) & ~(page - 1);
+
+    if (from < to) madvise(st->segments[r->segment].base + from, to - from, MADV_DONTNEED);
+}
+
+char *xfilestore_bytes(const xFileStore *st, const xStoreRecord *r) {
+    return st->segments[r->segment].base + r->offset;
+}
@@ -0,0 +1,97 @@
+#ifndef FILE_STORE_H
+#define FILE_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STORE_SEGMENT_SIZE  ( 64 * 1024 * 1024 )  // fragments are appended, a bigger one gets a segment of its own
+#define STORE_TABLE_INITIAL ( 1024 )              // records, grows by doubling
+#define STORE_ALIGN         ( 64 )
+
+#define STORE_MAGIC         ( 0x524f5453 )        // "STOR"
+#define STORE_VERSION       ( 1 )
+
+#define STORE_RECORD_FREE   ( 0 )
+#define STORE_RECORD_LIVE   ( 1 )
+#define STORE_RECORD_DEAD   ( 2 )                 // replaced, its bytes are not reclaimed (other records may share them)
+
+// one per stored fragment, enough to rebuild the container around it
+typedef struct xStoreRecord {
+    uint32_t file_id;
+    uint16_t segment;
+    uint8_t  fragment_id;
+    uint8_t  fragment_count;
+    uint8_t  state;
+    uint8_t  codec;         // LZ_CODEC_*, packed bytes know their logical size
+    uint8_t  checked;       // `crc` is set
+    uint8_t  parity;        // of the file, see ERASURE_CODING
+    uint32_t crc;           // CRC32C of the logical bytes
+
+    uint64_t offset;
+    uint64_t size;          // as stored
+    uint64_t file_size;
+
+    char file_name[200];
+} xStoreRecord;
+
+typedef struct xStoreTableHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;         // records in use, they are never moved
+    uint32_t capacity;
+} xStoreTableHeader;
+
+typedef struct xStoreSegment {
+    int fd;
+    char *base;             // mmap'ed
+    uint64_t size;
+    uint64_t used;
+} xStoreSegment;
+
+typedef struct xFileStore {
+    char dir[256];
+
+    int table_fd;
+    xStoreTableHeader *table;   // mmap'ed, the records follow it
+    xStoreRecord *records;
+
+    xStoreSegment *segments;    // malloc'ed
+    uint32_t segment_count;
+} xFileStore;
+
+
+int  xfilestore_open(xFileStore *st, const char *dir, uint64_t node_id);
+void xfilestore_close(xFileStore *st);
+
+uint32_t xfilestore_put(
+    xFileStore *st,
+    uint32_t file_id,
+    const char *file_name,
+    uint64_t file_size,
+    uint8_t fragment_count,
+    uint8_t parity,
+    uint8_t fragment_id,
+    uint8_t codec,
+    uint32_t crc,
+    const void *bytes,
+    uint64_t size,
+    char **out
+);
+
+uint32_t xfilestore_link(
+    xFileStore *st,
+    uint32_t record,
+    uint32_t file_id,
+    const char *file_name,
+    uint64_t file_size,
+    uint8_t fragment_count,
+    uint8_t parity,
+    uint8_t fragment_id
+);
+
+void  xfilestore_drop(xFileStore *st, uint32_t record);
+void  xfilestore_clear(xFileStore *st);
+void  xfilestore_release(const xFileStore *st, uint32_t record);
+char *xfilestore_bytes(const xFileStore *st, const xStoreRecord *r);
+
+#endif // FILE_STORE_H
@@ -0,0 +1,178 @@
+#include "fs.h"
+#include "../defines.h"
+
+#include <stdio.h>
+#include <sys/statvfs.h>
+#include <sys/sysinfo.h>
+
+/**
+ *  Memory budget and spill tier
+ * ------------------------------------------------------------
+ *  Notes:
+ *      A node without a data dir keeps its fragments as slab
+ *      blocks. Past its budget the coldest ones are written to a
+ *      spill tier, a store of its own wiped on every boot, and
+ *      their pages are let go of. Reading one brings it back.
+ *
+ *      Coldest is a clock: a read sets the fragment's referenced
+ *      bit, the hand clears it going by and spills the first one
+ *      it finds unset. Fragments read lately get a second chance,
+ *      close enough to least recently read at O(1) per spill.
+ *
+ *      A promoted fragment keeps its spilled copy, spilling it
+ *      again writes nothing. Replaced bytes in the tier are not
+ *      reclaimed, same as the store.
+ *
+ *      With a data dir every fragment lives in the mapped store
+ *      already and the kernel pages it in and out, no budget.
+ */
+
+// -----------------------------------------------------------------------------
+// Spill tier under `dir`, only opened when there is a budget to keep
+// -----------------------------------------------------------------------------
+int xfileserver_open_spill(xFileServer *fs, xFileStore *st, const char *dir, uint64_t node_id, uint64_t budget) {
+    fs->budget = budget;
+
+    if (budget == 0 || fs->store) return 1;
+
+    if (!xfilestore_open(st, dir, node_id)) return 0;
+
+    // whatever a previous run spilled is gone with it
+    xfilestore_clear(st);
+    fs->spill = st;
+
+    printf("[TIER] : %lu BYTES OF FRAGMENTS IN MEMORY, THE REST SPILLS TO %s.\n", budget, st->dir);
+
+    return 1;
+}
+
+static int tier_spill(xFileServer *fs, const xFileContainer *fc, xFileFragment *frag) {
+    uint32_t record = frag->spill;
+    char *mapped = NULL;
+
+    if (record == 0) {
+        record = xfilestore_put(
+            fs->spill, fc->file_id, fc->file_name, fc->size, fc->fragment_count_total,
+            fc->parity, frag->fragment_id, frag->codec, frag->crc,
+            frag->fragment_bytes, frag->stored_size, &mapped
+        );
+
+        if (record == 0) return 0;
+
+        fs->spill->records[record - 1].checked = frag->checked;
+    }
+    else {
+        mapped = xfilestore_bytes(fs->spill, fs->spill->records + record - 1);
+    }
+
+    xslab_free(frag->fragment_bytes);
+    xfilestore_release(fs->spill, record);
+
+    frag->fragment_bytes = mapped;
+    frag->record         = record;
+    frag->spill          = 0;
+
+    fs->resident -= frag->stored_size;
+    fs->spills++;
+
+    printf("[TIER] : FRAG #%u OF FILE #%u SPILLED (%lu BYTES).\n", frag->fragment_id, fc->file_id, frag->stored_size);
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Spills until the budget holds, `keep` is about to be used and stays
+// -----------------------------------------------------------------------------
+void xfileserver_budget(xFileServer *fs, const xFileFragment *keep) {
+    if (!fs->spill || fs->resident <= fs->budget) return;
+
+    // the first lap may only clear bits, the second one spills
+    int laps = 0;
+
+    while (fs->resident > fs->budget && laps < 3) {
+        if (fs->hand_file >= fs->file_count) {
+            fs->hand_file = 0;
+            fs->hand_slot = 0;
+            laps++;
+            continue;
+        }
+
+        xFileContainer *fc = fs->files[fs->hand_file];
+
+        if (fs->hand_slot >= fc->held) {
+            fs->hand_file++;
+            fs->hand_slot = 0;
+            continue;
+        }
+
+        xFileFragment *frag = fc->fragments + fs->hand_slot++;
+
+        if (frag->record || frag == keep) continue;
+
+        if (frag->referenced) {
+            frag->referenced = 0;
+            continue;
+        }
+
+        if (!tier_spill(fs, fc, frag)) {
+            printf("[TIER] : SPILL TIER IS FULL, %lu BYTES OVER BUDGET.\n", fs->resident - fs->budget);
+            return;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// A fragment about to be read, a spilled one comes back into memory
+// -----------------------------------------------------------------------------
+xFileFragment *xfileserver_touch(xFileServer *fs, const xFileContainer *file, uint8_t fragment_id) {
+    xFileFragment *frag = xfileserver_get_fragment(file, fragment_id);
+    if (!frag) return NULL;
+
+    frag->referenced = 1;
+
+    if (!fs->spill || !frag->record) return frag;
+
+    // read where it is if there is no memory for it
+    char *bytes = xslab_alloc(frag->stored_size);
+    if (!bytes) return frag;
+
+    memcpy(bytes, frag->fragment_bytes, frag->stored_size);
+    xfilestore_release(fs->spill, frag->record);
+
+    frag->spill          = frag->record;
+    frag->record         = 0;
+    frag->fragment_bytes = bytes;
+
+    fs->resident += frag->stored_size;
+    fs->promotions++;
+
+    printf("[TIER] : FRAG #%u OF FILE #%u BACK IN MEMORY.\n", fragment_id, file->file_id);
+
+    xfileserver_budget(fs, frag);
+
+    return frag;
+}
+
+// -----------------------------------------------------------------------------
+// Bytes this node can still take: the store's disk, or the memory left
+// (the budget's, or the host's without one) plus the spill tier's disk
+// -----------------------------------------------------------------------------
+uint64_t xfileserver_free_bytes(const xFileServer *fs) {
+    struct statvfs v;
+
+    if (fs->store) return statvfs(fs->store->dir, &v) == 0 ? (uint64_t)v.f_bavail * v.f_frsize : 0;
+
+    uint64_t room = 0;
+
+    if (fs->budget) {
+        room = fs->budget > fs->resident ? fs->budget - fs->resident : 0;
+    }
+    else {
+        struct sysinfo si;
+        if (sysinfo(&si) == 0) room = (uint64_t)si.freeram * si.mem_unit;
+    }
+
+    if (fs->spill && statvfs(fs->spill->dir, &v) == 0) room += (uint64_t)v.f_bavail * v.f_frsize;
+
+    return room;
+}
@@ -0,0 +1,263 @@
+#include "fs.h"
+#include "../defines.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ *  Write ahead log of the index's placement decisions
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Every time a file's entry changes (placed, or merged from
+ *      a report) the whole entry is appended to index.log. Every
+ *      INDEX_LOG_SNAPSHOT_EVERY records the entries are written
+ *      to index.snap instead and the log starts over.
+ *
+ *      An entry sets the file, it does not patch it, so replaying
+ *      the log over a snapshot that already has some of it is
+ *      harmless. A torn or corrupt record ends the replay, the log
+ *      is cut right before it.
+ *
+ *      Appends are not synced, they survive the process. A
+ *      snapshot is synced before it replaces the old one.
+ */
+
+// FNV-1a over the entry and then its pointers
+static uint32_t log_check(const void *a, size_t an, const void *b, size_t bn) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < an; i++) { h ^= ((const uint8_t *)a)[i]; h *= 16777619u; }
+    for (size_t i = 0; i < bn; i++) { h ^= ((const uint8_t *)b)[i]; h *= 16777619u; }
+
+    return h;
+}
+
+// -----------------------------------------------------------------------------
+// Describes `f` the way it is logged, returns the size of its pointers
+// -----------------------------------------------------------------------------
+size_t xindexlog_entry(const xFileContainer *fc, const xFileInNetwork *f, xIndexLogEntry *e) {
+    memset(e, 0, sizeof(xIndexLogEntry));
+
+    e->file_id         = f->file_id;
+    e->total_fragments = f->total_fragments;
+    e->parity          = f->parity;
+
+    if (fc) {
+        e->frag_count = fc->fragment_count_total;
+        e->file_size  = fc->size;
+        memcpy(e->file_name, fc->file_name, sizeof(e->file_name));
+    }
+
+    return f->total_fragments * sizeof(xFragmentNetworkPointer);
+}
+
+// -----------------------------------------------------------------------------
+// One record, a single writev so appends never interleave
+// -----------------------------------------------------------------------------
+static int log_write(int fd, const xFileContainer *fc, const xFileInNetwork *f) {
+    xIndexLogEntry e;
+    size_t ptrs = xindexlog_entry(fc, f, &e);
+
+    xIndexLogRecord r;
+    r.size  = sizeof(e) + ptrs;
+    r.check = log_check(&e, sizeof(e), f->fragments, ptrs);
+
+    struct iovec iov[3] = {
+        { &r, sizeof(r) },
+        { &e, sizeof(e) },
+        { (void *)f->fragments, ptrs },
+    };
+
+    return writev(fd, iov, 3) == (ssize_t)(sizeof(r) + r.size);
+}
+
+static int log_write_header(int fd) {
+    xIndexLogHeader h = { INDEX_LOG_MAGIC, INDEX_LOG_VERSION };
+
+    return write(fd, &h, sizeof(h)) == sizeof(h);
+}
+
+// -----------------------------------------------------------------------------
+// Sets the file an entry describes, returns it (NULL if it could not)
+// -----------------------------------------------------------------------------
+xFileInNetwork *xindexlog_apply(xFileServer *fs, xFileNetworkIndex *net, const xIndexLogEntry *e, const xFragmentNetworkPointer *ptrs) {
+    if (!xfileserver_find_file(fs, e->file_id)) {
+        xfileserver_add_file(fs, e->file_name, e->file_id, e->file_size, e->frag_count, e->parity);
+    }
+
+    xFileInNetwork *f = xfilenetindex_find_file(net, e->file_id);
+
+    if (!f) {
+        f = xfilenetindex_new_file(e->file_id, e->total_fragments, e->parity);
+        if (!f) return NULL;
+
+        xfilenetindex_add_file(net, f);
+    }
+
+    if (f->total_fragments != e->total_fragments) {
+        printf("[INDEX LOG] : FILE #%u CHANGED SHAPE, KEEPING WHAT WE HAVE.\n", e->file_id);
+        return f;
+    }
+
+    memcpy(f->fragments, ptrs, e->total_fragments * sizeof(xFragmentNetworkPointer));
+
+    return f;
+}
+
+// -----------------------------------------------------------------------------
+// Applies every good record of `path`. Returns how many,
+// `end` gets the offset right after the last good one.
+// -----------------------------------------------------------------------------
+static uint32_t log_replay(const char *path, xFileServer *fs, xFileNetworkIndex *net, off_t *end) {
+    *end = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    xIndexLogHeader h;
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || h.magic != INDEX_LOG_MAGIC || h.version != INDEX_LOG_VERSION) {
+        close(fd);
+        return 0;
+    }
+
+    *end = sizeof(h);
+
+    char *body = xslab_alloc(INDEX_LOG_MAX_RECORD);
+    uint32_t applied = 0;
+
+    while (body) {
+        xIndexLogRecord r;
+        if (read(fd, &r, sizeof(r)) != sizeof(r)) break;
+
+        if (r.size < sizeof(xIndexLogEntry) || r.size > INDEX_LOG_MAX_RECORD) break;
+        if (read(fd, body, r.size) != (ssize_t)r.size) break;
+
+        xIndexLogEntry *e = (xIndexLogEntry *)body;
+        size_t ptrs = r.size - sizeof(xIndexLogEntry);
+
+        if (ptrs != e->total_fragments * sizeof(xFragmentNetworkPointer)) break;
+        if (log_check(e, sizeof(xIndexLogEntry), body + sizeof(xIndexLogEntry), ptrs) != r.check) break;
+
+        xindexlog_apply(fs, net, e, (const xFragmentNetworkPointer *)(body + sizeof(xIndexLogEntry)));
+
+        *end += sizeof(r) + r.size;
+        applied++;
+    }
+
+    xslab_free(body);
+    close(fd);
+
+    return applied;
+}
+
+// -----------------------------------------------------------------------------
+// Writes every entry to a fresh snapshot, then empties the log
+// -----------------------------------------------------------------------------
+int xindexlog_snapshot(xIndexLog *log, xFileServer *fs, xFileNetworkIndex *net) {
+    char tmp[300], path[300];
+    snprintf(tmp, sizeof(tmp), "%s/index.snap.tmp", log->dir);
+    snprintf(path, sizeof(path), "%s/index.snap", log->dir);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("[INDEX LOG] snapshot");
+        return 0;
+    }
+
+    int ok = log_write_header(fd);
+    uint32_t files = 0;
+
+    for (uint32_t i = 0; ok && i < net->table_size; i++) {
+        const xFileInNetwork *f = net->table[i].file;
+        if (net->table[i].file_id == 0) continue;
+
+        ok = log_write(fd, xfileserver_find_file(fs, f->file_id), f);
+        files++;
+    }
+
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp, path) < 0) {
+        perror("[INDEX LOG] snapshot");
+        unlink(tmp);
+        return 0;
+    }
+
+    // everything logged so far is in the snapshot now
+    if (ftruncate(log->fd, 0) < 0 || !log_write_header(log->fd)) {
+        perror("[INDEX LOG] truncate");
+    }
+
+    log->appended = 0;
+
+    printf("[INDEX LOG] : SNAPSHOT OF %u FILES.\n", files);
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Loads the snapshot and the log found in `dir`, then keeps logging there
+// -----------------------------------------------------------------------------
+int xindexlog_open(xIndexLog *log, const char *dir, xFileServer *fs, xFileNetworkIndex *net) {
+    memset(log, 0, sizeof(xIndexLog));
+    log->fd = -1;
+
+    strncpy(log->dir, dir, sizeof(log->dir) - 1);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    char path[300];
+    off_t end;
+
+    snprintf(path, sizeof(path), "%s/index.snap", log->dir);
+    uint32_t snapped = log_replay(path, fs, net, &end);
+
+    snprintf(path, sizeof(path), "%s/index.log", log->dir);
+    uint32_t replayed = log_replay(path, fs, net, &end);
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log->fd < 0) {
+        perror("[INDEX LOG] open");
+        return 0;
+    }
+
+    // cut a torn tail off, or start a new log
+    if (ftruncate(log->fd, end) < 0) perror("[INDEX LOG] truncate");
+    if (end == 0 && !log_write_header(log->fd)) return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("[INDEX LOG] : %u FROM SNAPSHOT, %u REPLAYED, %u FILES KNOWN IN %.2fms.\n", snapped, replayed, net->file_count, ms);
+
+    if (replayed > 0) xindexlog_snapshot(log, fs, net);
+
+    return 1;
+}
+
+// -----------------------------------------------------------------------------
+// Logs `f` as it is now, no-op while the index is not persisted
+// -----------------------------------------------------------------------------
+void xindexlog_record(xFileNetworkIndex *net, xFileServer *fs, const xFileInNetwork *f) {
+    xIndexLog *log = net->log;
+
+    if (!log || !f) return;
+
+    if (!log_write(log->fd, xfileserver_find_file(fs, f->file_id), f)) {
+        perror("[INDEX LOG] append");
+        return;
+    }
+
+    if (++log->appended >= INDEX_LOG_SNAPSHOT_EVERY) xindexlog_snapshot(log, fs, net);
+}
+
+void xindexlog_close(xIndexLog *log) {
+    if (log->fd >= 0) close(log->fd);
+    log->fd = -1;
+}
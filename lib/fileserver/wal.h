@@ -0,0 +1,41 @@
+#ifndef INDEX_LOG_H
+#define INDEX_LOG_H
+
+#include <stdint.h>
+
+#define INDEX_LOG_MAGIC     ( 0x58444e49 )  // "INDX"
+#define INDEX_LOG_VERSION   ( 1 )
+
+// an entry and its pointers, at most (needs fs.h)
+#define INDEX_LOG_MAX_RECORD (sizeof(xIndexLogEntry) + 256 * REDUNDANCY * sizeof(xFragmentNetworkPointer))
+
+// a file's whole entry, replaying one sets it, so replays can overlap
+typedef struct xIndexLogEntry {
+    uint32_t file_id;
+    uint8_t  frag_count;
+    uint8_t  parity;
+    uint8_t  _pad[2];
+    uint64_t file_size;
+    uint64_t total_fragments;   // pointers that follow, redundancy included
+
+    char file_name[200];
+} xIndexLogEntry;
+
+// before every entry, `check` covers the entry and its pointers
+typedef struct xIndexLogRecord {
+    uint32_t size;
+    uint32_t check;
+} xIndexLogRecord;
+
+typedef struct xIndexLogHeader {
+    uint32_t magic;
+    uint32_t version;
+} xIndexLogHeader;
+
+typedef struct xIndexLog {
+    char dir[256];
+    int fd;                     // the log, O_APPEND
+    uint32_t appended;          // records since the last snapshot
+} xIndexLog;
+
+#endif // INDEX_LOG_H
@@ -0,0 +1,299 @@
+#include "statemachine.h"
+#include "../tcplib.h"
+
+#include <errno.h>
+
+/**
+ *  Chain replication, holder side
+ * ------------------------------------------------------------
+ *  Notes:
+ *      The index sends a fragment once, to the head of its chain,
+ *      and every holder passes it on to its peer_f. Bytes go out
+ *      while they are still coming in if the pooled connection is
+ *      already there, the rest is finished from IDLE. Nothing here
+ *      blocks on downstream, two holders may well be forwarding
+ *      to each other at the same time.
+ *
+ *      Our FRAG_STORED only goes upstream once downstream answered,
+ *      counting every replica from here to the tail. One job per
+ *      downstream node at a time, their replies would mix. A
+ *      downstream that got other bytes than ours (its checksum
+ *      differs) does not count.
+ */
+
+// no older job still talking to the same node
+static bool chain_first_for(xChainQueue *q, int job)
+{
+  for (int i = 0; i < job; i++) {
+    if (q->jobs[i].active && q->jobs[i].next == q->jobs[job].next) return false;
+  }
+  return true;
+}
+
+// the job is over, so is its hold on the bytes
+static void chain_release(xChainForward *j)
+{
+  if (j->held) xslab_free((char *)j->bytes);
+
+  j->held   = false;
+  j->bytes  = NULL;
+  j->active = false;
+}
+
+static void chain_finish(Server *sv, xChainForward *j, uint8_t downstream)
+{
+  xPacket p = xpacket_fragment_stored(sv, j->fragc.file_id, j->fragc.frag_id, 1 + downstream, j->crc);
+  server_send_to_socket(sv, &p, j->upstream_fd);
+
+  if (j->fd >= 0) server_loop_want_write(sv, j->fd, false);
+
+  printf("[CHAIN] : FRAG #%lu OF FILE #%lu KEPT BY %d NODES FROM HERE.\n", j->fragc.frag_id, j->fragc.file_id, 1 + downstream);
+
+  chain_release(j);
+}
+
+// downstream is half way through a stream, only a new connection fixes it
+static void chain_break(Server *sv, xChainForward *j)
+{
+  if (j->fd >= 0) {
+    server_loop_want_write(sv, j->fd, false);
+    server_pool_fail(sv, j->fd);
+  }
+
+  j->fd = -1;
+  j->broken = true;
+}
+
+static bool chain_announce(Server *sv, xChainForward *j)
+{
+  xPacket pkt = xpacket_send_fragment(sv, &j->fragc);
+
+  if (server_send_to_socket(sv, &pkt, j->fd) <= 0) return false;
+
+  j->announced = true;
+  return true;
+}
+
+// as much as downstream takes right now
+static int chain_write(Server *sv, xChainForward *j)
+{
+  while (j->sent < j->received) {
+    size_t n = j->received - j->sent;
+    if (n > sv->send_chunk) n = sv->send_chunk;
+
+    int w = tcp_send_u(j->fd, j->bytes + j->sent, n);
+
+    if (w < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+
+      perror("[CHAIN] send");
+      return -1;
+    }
+
+    j->sent += w;
+  }
+
+  return 1;
+}
+
+/**
+ *  Sets up forwarding of an incoming STORE_FRAGMENT.
+ * ------------------------------------------------------------
+ *  Returns the job, or -1 if this node is the tail (or the
+ *  index asked for a hop that is not our peer_f anymore).
+ */
+int xprocedure_chain_begin( Server *sv, xChainQueue *q, xRequestFragmentCreation *fragc, int upstream_fd )
+{
+  if (fragc->chain_len == 0) return -1;
+
+  if (fragc->chain_next != 0 && fragc->chain_next != sv->peer_f.node_id) {
+    printf("[CHAIN] : NEXT HOP #%lu IS NOT MY PEER_F #%lu, NOT FORWARDING.\n", fragc->chain_next, sv->peer_f.node_id);
+    return -1;
+  }
+
+  if (q->count == q->capacity) {
+    int cap = q->capacity ? q->capacity * 2 : 8;
+
+    xChainForward *n = realloc(q->jobs, cap * sizeof(xChainForward));
+    if (!n) return -1;
+
+    q->jobs = n;
+    q->capacity = cap;
+  }
+
+  int job = q->count++;
+  xChainForward *j = q->jobs + job;
+
+  memset(j, 0, sizeof(xChainForward));
+
+  j->active      = true;
+  j->upstream_fd = upstream_fd;
+  j->next        = sv->peer_f.node_id;
+  j->fd          = -1;
+
+  j->fragc = *fragc;
+  j->fragc.chain_len--;
+  j->fragc.chain_next = 0; // beyond the next hop it's whatever their peer_f is
+
+  // cut through only over a connection we already have, dialing
+  // now could wait on a node that is busy forwarding to us
+  if (chain_first_for(q, job)) {
+    j->fd = server_pool_peek(sv, j->next);
+
+    if (j->fd >= 0 && !chain_announce(sv, j)) chain_break(sv, j);
+  }
+
+  printf("[CHAIN] : WILL FORWARD FRAG #%lu TO NODE #%lu%s.\n", j->fragc.frag_id, j->next, j->announced ? " WHILE RECEIVING" : "");
+
+  return job;
+}
+
+void xprocedure_chain_attach( xChainQueue *q, int job, const char *bytes )
+{
+  if (job < 0 || job >= q->count) return;
+
+  q->jobs[job].bytes = bytes;
+}
+
+// forwards `bytes` whatever the file server keeps them as (a store copy,
+// packed), they stay alive until the job is over
+void xprocedure_chain_hold( xChainQueue *q, int job, char *bytes )
+{
+  if (job < 0 || job >= q->count || !xslab_retain(bytes)) return;
+
+  q->jobs[job].bytes = bytes;
+  q->jobs[job].held  = true;
+}
+
+// called as raw bytes land, forwards what it can without waiting
+void xprocedure_chain_pump( Server *sv, xChainQueue *q, int job, size_t received )
+{
+  if (job < 0 || job >= q->count) return;
+
+  xChainForward *j = q->jobs + job;
+  j->received = received;
+
+  if (!j->announced || j->broken || j->fd < 0) return;
+
+  if (chain_write(sv, j) < 0) chain_break(sv, j);
+}
+
+// our own copy is in (or failed to be), the rest happens from IDLE
+void xprocedure_chain_stored( Server *sv, xChainQueue *q, int job, bool ok, uint32_t crc )
+{
+  if (job < 0 || job >= q->count) return;
+
+  xChainForward *j = q->jobs + job;
+
+  if (!ok) {
+    if (j->announced) chain_break(sv, j);
+    server_send_not_ok(sv, j->upstream_fd);
+    chain_release(j);
+    return;
+  }
+
+  j->stored   = true;
+  j->crc      = crc;
+  j->received = j->fragc.frag_size;
+}
+
+/**
+ *  Moves every pending forward along. Never blocks on downstream.
+ * ------------------------------------------------------------
+ */
+void xprocedure_chain_run( Server *sv, xChainQueue *q )
+{
+  for (int i = 0; i < q->count; i++) {
+    xChainForward *j = q->jobs + i;
+
+    if (!j->active || !j->stored) continue;
+
+    if (j->broken) {
+      chain_finish(sv, j, 0);
+      continue;
+    }
+
+    if (!chain_first_for(q, i)) continue;
+
+    // ring was repaired since, the index placed it on someone else
+    if (j->next != sv->peer_f.node_id && !j->announced) {
+      chain_finish(sv, j, 0);
+      continue;
+    }
+
+    if (j->fd < 0) {
+      j->fd = server_pool_get(sv, j->next, &sv->peer_f.ip);
+
+      if (j->fd < 0) {
+        chain_finish(sv, j, 0);
+        continue;
+      }
+    }
+
+    if (!j->announced && !chain_announce(sv, j)) {
+      chain_break(sv, j);
+      chain_finish(sv, j, 0);
+      continue;
+    }
+
+    size_t sent = j->sent;
+
+    if (chain_write(sv, j) < 0) {
+      chain_break(sv, j);
+      chain_finish(sv, j, 0);
+      continue;
+    }
+
+    if (j->sent != sent) sv->loop.progress = true;
+
+    server_loop_want_write(sv, j->fd, j->sent < j->received);
+
+    xPacket p = {0};
+    int r;
+
+    while ((r = server_poll_frame(sv, j->fd, &p)) > 0) {
+      sv->loop.progress = true;
+
+      if (p.bytes.comm.type == TYPE_OK && !j->accepted) {
+        j->accepted = true;
+        continue;
+      }
+
+      if (p.bytes.comm.type == TYPE_FRAG_STORED && p.bytes.comm.content.fragment_stored.crc != j->crc) {
+        printf("[CHAIN] : NODE #%lu GOT FRAG #%lu CORRUPTED (CRC %08x, OURS %08x).\n", j->next, j->fragc.frag_id, p.bytes.comm.content.fragment_stored.crc, j->crc);
+        chain_finish(sv, j, 0);
+      }
+      else if (p.bytes.comm.type == TYPE_FRAG_STORED) {
+        chain_finish(sv, j, p.bytes.comm.content.fragment_stored.replicas);
+      }
+      else {
+        printf("[CHAIN] : NODE #%lu REFUSED FRAG #%lu.\n", j->next, j->fragc.frag_id);
+        chain_break(sv, j);
+        chain_finish(sv, j, 0);
+      }
+      break;
+    }
+
+    if (r < 0 && j->active) {
+      chain_break(sv, j);
+      chain_finish(sv, j, 0);
+    }
+  }
+
+  // drop finished jobs, keeping the order
+  int k = 0;
+  for (int i = 0; i < q->count; i++) {
+    if (q->jobs[i].active) q->jobs[k++] = q->jobs[i];
+  }
+  q->count = k;
+}
+
+bool xprocedure_chain_owns( xChainQueue *q, int fd )
+{
+  if (fd < 0) return false;
+
+  for (int i = 0; i < q->count; i++) {
+    if (q->jobs[i].active && q->jobs[i].fd == fd) return true;
+  }
+  return false;
+}
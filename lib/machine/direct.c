@@ -0,0 +1,175 @@
+#include "statemachine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Direct reads
+ * ------------------------------------------------------------
+ *  Notes:
+ *      A REQUEST_FILE with `direct` set only gets the file's
+ *      fragment map back: every live holder of every data
+ *      fragment, with where that fragment sits in the file. The
+ *      client then asks the holders themselves with READ_FRAGMENT
+ *      and puts the file together, nothing but metadata goes
+ *      through the entry node and the index.
+ *
+ *      Clients present themselves to holders as DIRECT_READER_ID,
+ *      those connections are kept as inbound ones and never take
+ *      the place of the holder's own client.
+ *
+ *      Holders are listed in the index's order, the client takes
+ *      the first one that answers. Bytes go out unpacked whatever
+ *      the holder keeps them as, with their CRC32C.
+ *
+ *      A file with a data fragment that has no live holder left
+ *      gets an empty map, an erasure coded one would need a
+ *      rebuild. The client asks again without `direct` then.
+ */
+
+static Address *direct_addr_of(Server *sv, node_id_t node)
+{
+  if (node == sv->me.node_id) return &sv->me.ip;
+
+  return sv->index_data->peer_ips + node - 1; // nodes start at index 1
+}
+
+// every live holder of the data fragments, NULL with *n = 0 if one has none
+static xFragmentLocation *direct_map(Server *sv, xFileInNetwork *f, const xFileContainer *fc, uint16_t *n)
+{
+  int replicas = xfilenetindex_replicas(f);
+  int data     = fc->fragment_count_total - fc->parity;
+
+  xErasureShape shape;
+  xfileserver_shape(fc, &shape);
+
+  *n = 0;
+
+  xFragmentLocation *map = xslab_calloc(data * replicas, sizeof(xFragmentLocation));
+  if (map == NULL) return NULL;
+
+  for (int frag = 1; frag <= data; frag++) {
+    uint16_t had = *n;
+
+    for (int j = 0; j < replicas; j++) {
+      const xFragmentNetworkPointer *ptr = f->fragments + (frag - 1) * replicas + j;
+
+      if (ptr->node_id == 0 || !server_is_valid_node(sv, ptr->node_id)) continue;
+
+      xFragmentLocation *l = map + (*n)++;
+
+      l->fragment = frag;
+      l->offset   = xerasure_offset(&shape, frag);
+      l->size     = xerasure_size(&shape, frag);
+      l->node_id  = ptr->node_id;
+      l->holder   = *direct_addr_of(sv, ptr->node_id);
+    }
+
+    if (*n == had) {
+      printf("[DIRECT] : NO LIVE HOLDER OF FRAG #%d OF FILE #%u.\n", frag, fc->file_id);
+      xslab_free(map);
+      *n = 0;
+      return NULL;
+    }
+  }
+
+  return map;
+}
+
+/**
+ *  Index side, answers a direct REQUEST_FILE on `fd`
+ * ------------------------------------------------------------
+ *  Returns the holders listed, 0 when the client has to ask
+ *  without `direct`.
+ */
+int xprocedure_send_fragment_map( Server *sv, xFileNetworkIndex *fnetidx, const xFileContainer *fc, int fd )
+{
+  xFileInNetwork *f = xfilenetindex_find_file(fnetidx, fc->file_id);
+
+  uint16_t n = 0;
+  xFragmentLocation *map = f ? direct_map(sv, f, fc, &n) : NULL;
+
+  xPacket res = xpacket_request_file_response(sv, fc->file_id, fc->size, fc->fragment_count_total, fc->parity);
+  res.bytes.comm.content.request_file_response.locations = n;
+
+  server_send_to_socket(sv, &res, fd);
+
+  if (n > 0) server_send_large_buffer_to(sv, fd, n * sizeof(xFragmentLocation), (char *)map);
+
+  printf("[DIRECT] : MAP OF FILE #%u, %u HOLDERS.\n", fc->file_id, n);
+
+  xslab_free(map);
+
+  return n;
+}
+
+/**
+ *  Entry node side, passes the index's answer and the map after
+ *  it on to the client
+ * ------------------------------------------------------------
+ */
+int xprocedure_relay_fragment_map( Server *sv, xPacket *res, int fd )
+{
+  uint16_t n = res->bytes.comm.content.request_file_response.locations;
+  size_t size = n * sizeof(xFragmentLocation);
+
+  char *map = xslab_alloc(size);
+
+  if (map == NULL || server_read_raw(sv, sv->index.stream_fd, map, size) != (int)size) {
+    printf("[DIRECT] : MAP ENDED EARLY.\n");
+    xslab_free(map);
+    server_send_not_ok(sv, fd);
+    return 0;
+  }
+
+  res->bytes.comm.sender_id = sv->me.node_id;
+  server_send_to_socket(sv, res, fd);
+
+  if (n > 0) server_send_large_buffer_to(sv, fd, size, map);
+
+  xslab_free(map);
+
+  return 1;
+}
+
+/**
+ *  Holder side of READ_FRAGMENT
+ * ------------------------------------------------------------
+ *  Returns 1 if the fragment went out.
+ */
+int xprocedure_read_fragment( Server *sv, xFileServer *fs, const xReadFragment *r, int fd )
+{
+  xFileContainer *fc = xfileserver_find_file(fs, r->file_id);
+  xFileFragment *frag = fc && r->frag_id <= UINT8_MAX ? xfileserver_touch(fs, fc, r->frag_id) : NULL;
+
+  char *unpacked = NULL;
+  const char *bytes = frag ? xfileserver_fragment_bytes(frag, &unpacked) : NULL;
+
+  if (bytes == NULL) {
+    printf("[DIRECT] : FRAG #%lu OF FILE #%lu IS NOT KEPT HERE.\n", r->frag_id, r->file_id);
+    server_send_not_ok(sv, fd);
+    return 0;
+  }
+
+  xPacket p = xpacket_new(sv, TYPE_DECLARE_FRAG);
+  p.bytes.comm.content.declare_fragment_transport.file_id   = fc->file_id;
+  p.bytes.comm.content.declare_fragment_transport.frag_id   = frag->fragment_id;
+  p.bytes.comm.content.declare_fragment_transport.frag_size = frag->fragment_size;
+  p.bytes.comm.content.declare_fragment_transport.file_size = fc->size;
+  p.bytes.comm.content.declare_fragment_transport.wire_size = frag->fragment_size;
+  p.bytes.comm.content.declare_fragment_transport.codec     = LZ_CODEC_NONE;
+  p.bytes.comm.content.declare_fragment_transport.checked   = frag->checked;
+  p.bytes.comm.content.declare_fragment_transport.crc       = frag->crc;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  server_send_to_socket(sv, &p, fd);
+
+  int ok = server_send_large_buffer_to(sv, fd, frag->fragment_size, (char *)bytes);
+
+  if (ok) fs->bytes_out += frag->fragment_size;
+
+  xslab_free(unpacked);
+
+  return ok;
+}
@@ -0,0 +1,476 @@
+#include "statemachine.h"
+#include "../tcplib.h"
+
+#include <errno.h>
+#include <poll.h>
+
+/**
+ *  Concurrent fanout of a new file's fragments
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Every replica target gets its own transfer, all of them
+ *      advance together as their sockets become writable, so an
+ *      upload costs the slowest node instead of the sum of all.
+ *      Transfers sharing a node (same pooled fd) go one after the
+ *      other, the holder handles them sequentially anyway.
+ *
+ *      Per transfer:
+ *          QUEUED    -> STORE_FRAGMENT sent       -> ANNOUNCED
+ *          ANNOUNCED -> holder OK                 -> STREAMING
+ *          STREAMING -> last raw byte written     -> STORING
+ *          STORING   -> holder FRAG_STORED        -> DONE
+ *
+ *      With CHAIN_REPLICATION a transfer goes only to the head of
+ *      a run of replicas where each one is the previous one's live
+ *      peer_f, the holders forward it themselves. Whatever the
+ *      chain could not keep gets sent directly afterwards.
+ *
+ *      A holder's FRAG_STORED carries the CRC32C of what it got,
+ *      one that differs from ours means the bytes were damaged on
+ *      the way. The replica does not count, and while the whole
+ *      file is at hand it is sent again once.
+ *
+ *      Bytes come either from the whole file at once or window
+ *      by window while an upload streams in. A transfer is only
+ *      announced once its first bytes are at hand, and a window
+ *      is done when every transfer it touches wrote its part.
+ *      The node relaying the upload can't take anything before
+ *      it is done, it keeps its data fragments itself as they go
+ *      through it (see ingest.c), those are no transfer here.
+ *
+ *      Parity fragments of an erasure coded file are staged,
+ *      they are only complete once the whole file went by. Every
+ *      fragment of such a file has a single holder, no chains.
+ */
+
+// one pooled fd per node, staged transfers have none yet
+static bool fanout_fd_busy(xFanoutTransfer *t, int n, int upto)
+{
+  for (int i = 0; i < upto && i < n; i++) {
+    if (t[i].node_id == t[upto].node_id && t[i].phase != FANOUT_DONE && t[i].phase != FANOUT_FAILED) return true;
+  }
+  return false;
+}
+
+static void fanout_fail_fd(Server *sv, xFanoutTransfer *t, int n, int fd)
+{
+  for (int i = 0; i < n; i++) {
+    if (t[i].fd == fd && t[i].phase != FANOUT_DONE) t[i].phase = FANOUT_FAILED;
+  }
+  if (fd >= 0) server_pool_fail(sv, fd);
+}
+
+// bytes of transfer t that lie before the end of what we hold
+static size_t fanout_limit(xFanoutTransfer *t, uint64_t end)
+{
+  if (end <= t->offset) return 0;
+
+  uint64_t held = end - t->offset;
+  return held < t->frag.size ? held : t->frag.size;
+}
+
+// reply frames for ANNOUNCED / STORING transfers
+static void fanout_read_reply(Server *sv, xFanoutTransfer *t, int n, int i)
+{
+  xPacket p = {0};
+  int r = server_poll_frame(sv, t[i].fd, &p);
+
+  if (r == 0) return;
+
+  if (r > 0 && t[i].phase == FANOUT_ANNOUNCED && p.bytes.comm.type == TYPE_OK) {
+    t[i].phase = FANOUT_STREAMING;
+    return;
+  }
+
+  if (r > 0 && t[i].phase == FANOUT_STORING && p.bytes.comm.type == TYPE_FRAG_STORED && p.bytes.comm.content.fragment_stored.crc != t[i].crc) {
+    printf("[FANOUT] : NODE #%lu GOT FRAGMENT #%d CORRUPTED (CRC %08x, OURS %08x).\n", t[i].node_id, t[i].frag.fragment, p.bytes.comm.content.fragment_stored.crc, t[i].crc);
+
+    t[i].corrupt = true;
+    t[i].phase   = FANOUT_DONE;
+    return;
+  }
+
+  if (r > 0 && t[i].phase == FANOUT_STORING && p.bytes.comm.type == TYPE_FRAG_STORED) {
+    uint8_t kept = p.bytes.comm.content.fragment_stored.replicas;
+
+    t[i].stored = kept > t[i].chain_len + 1 ? t[i].chain_len + 1 : kept;
+    t[i].phase  = FANOUT_DONE;
+    return;
+  }
+
+  printf("[FANOUT] : NODE #%lu REFUSED FRAGMENT #%d.\n", t[i].node_id, t[i].frag.fragment);
+  fanout_fail_fd(sv, t, n, t[i].fd);
+}
+
+static xFanoutTransfer *fanout_add(Server *sv, xFanout *fo, xFragmentNetworkPointer *frag, int ptr_index)
+{
+  xFanoutTransfer *x = fo->t + fo->n++;
+
+  memset(x, 0, sizeof(xFanoutTransfer));
+
+  x->node_id   = frag->node_id;
+  x->frag      = *frag;
+  x->ptr_index = ptr_index;
+  x->offset    = xerasure_offset(&fo->shape, frag->fragment);
+  x->phase     = FANOUT_QUEUED;
+  x->chain[0]  = frag->node_id;
+  x->fd        = -1;
+
+  // worked out of the file, whole or one window after the other
+  if (frag->fragment > fo->shape.data) {
+    x->staged = fo->buffer ? xerasure_parity(&fo->shape, frag->fragment, fo->buffer) : xslab_calloc(1, frag->size);
+    if (x->staged == NULL) x->phase = FANOUT_FAILED;
+    return x;
+  }
+
+  Address *a = sv->index_data->peer_ips + frag->node_id - 1; // nodes start at index 1
+  x->fd = server_pool_get(sv, frag->node_id, a);
+
+  if (x->fd < 0) {
+    printf("[FANOUT] : NODE #%lu IS UNREACHABLE.\n", frag->node_id);
+    x->phase = FANOUT_FAILED;
+  }
+
+  return x;
+}
+
+// counts what a finished transfer got kept, sends the rest directly
+static void fanout_settle(Server *sv, xFanout *fo, int i)
+{
+  xFanoutTransfer *t = fo->t + i;
+  int stored = t->phase == FANOUT_DONE ? t->stored : 0;
+
+  t->settled = true;
+  fo->confirmed += stored;
+
+  xslab_free(t->staged);
+  t->staged = NULL;
+
+  // a dead head takes no retry, its followers do. a damaged copy
+  // is replaced by sending it again
+  int from = stored > 0 ? stored : t->corrupt && !t->resent ? 0 : 1;
+
+  for (int k = from; k <= t->chain_len; k++) {
+    xFragmentNetworkPointer frag = t->frag;
+    frag.node_id = t->chain[k];
+
+    // a streamed upload let go of those bytes already
+    if (fo->buffer == NULL) {
+      printf("[FANOUT] : CHAIN LOST FRAG #%d BEFORE NODE #%lu, BYTES ARE GONE.\n", frag.fragment, frag.node_id);
+      continue;
+    }
+
+    printf("[FANOUT] : CHAIN LOST FRAG #%d BEFORE NODE #%lu, SENDING IT DIRECTLY.\n", frag.fragment, frag.node_id);
+
+    xFanoutTransfer *x = fanout_add(sv, fo, &frag, fo->t[i].ptr_index + k);
+    x->resent = k == 0;
+    t = fo->t + i;
+  }
+}
+
+static void fanout_write(Server *sv, xFanout *fo, int i, const char *window, uint64_t base, uint64_t end)
+{
+  xFanoutTransfer *t = fo->t + i;
+
+  size_t left = fanout_limit(t, end) - t->sent;
+  if (left > sv->send_chunk) left = sv->send_chunk;
+
+  int w = tcp_send_u(t->fd, window + (t->offset + t->sent - base), left);
+
+  if (w < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+
+    perror("[FANOUT] send");
+    fanout_fail_fd(sv, fo->t, fo->n, t->fd);
+    return;
+  }
+
+  t->crc = xcrc32c(t->crc, window + (t->offset + t->sent - base), w);
+  t->sent += w;
+
+  if (t->sent == t->frag.size) t->phase = FANOUT_STORING;
+}
+
+// transfer still needs something from the bytes we hold
+static bool fanout_wants(xFanoutTransfer *t, uint64_t end, bool finish)
+{
+  if (t->phase == FANOUT_DONE || t->phase == FANOUT_FAILED) return false;
+  if (finish) return true;
+  if (t->staged) return false;
+
+  return t->phase != FANOUT_STORING && t->sent < fanout_limit(t, end);
+}
+
+/**
+ *  Moves every transfer forward with the bytes of [base, base+len)
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Returns once all of them wrote their part of the window,
+ *      or, with `finish`, once every transfer is DONE or FAILED.
+ */
+static void fanout_run(Server *sv, xFanout *fo, const char *window, uint64_t base, size_t len, bool finish)
+{
+  uint64_t end = base + len;
+
+  struct pollfd *pfds = calloc(fo->capacity, sizeof(struct pollfd));
+  int *owner = calloc(fo->capacity, sizeof(int));
+
+  fo->stalled_since = current_millis();
+
+  while (pfds && owner) {
+    int active = 0;
+    int npfd = 0;
+    bool buffered = false;
+
+    for (int i = 0; i < fo->n; i++) {
+      xFanoutTransfer *t = fo->t + i;
+
+      if (t->phase == FANOUT_DONE || t->phase == FANOUT_FAILED) {
+        if (!t->settled) fanout_settle(sv, fo, i);
+        continue;
+      }
+
+      if (fanout_wants(t, end, finish)) active++;
+
+      // staged ones only go out once the whole file went by
+      if (t->staged && !finish) continue;
+
+      if (fanout_fd_busy(fo->t, fo->n, i)) continue;
+
+      if (t->fd < 0) {
+        Address *a = sv->index_data->peer_ips + t->node_id - 1;
+        t->fd = server_pool_get(sv, t->node_id, a);
+
+        if (t->fd < 0) {
+          printf("[FANOUT] : NODE #%lu IS UNREACHABLE.\n", t->node_id);
+          t->phase = FANOUT_FAILED;
+          continue;
+        }
+      }
+
+      // nothing to send yet, the holder would block on us
+      if (t->phase == FANOUT_QUEUED && !t->staged && t->frag.size > 0 && fanout_limit(t, end) == 0) continue;
+
+      if (t->phase == FANOUT_QUEUED) {
+        xRequestFragmentCreation fragcreation = {0};
+        xreqfragcreation_new(&fragcreation, fo->fc, &t->frag, t->ptr_index);
+
+        fragcreation.chain_len  = t->chain_len;
+        fragcreation.chain_next = t->chain_len > 0 ? t->chain[1] : 0;
+
+        xPacket pkt = xpacket_send_fragment(sv, &fragcreation);
+
+        if (server_send_to_socket(sv, &pkt, t->fd) <= 0) {
+          fanout_fail_fd(sv, fo->t, fo->n, t->fd);
+          continue;
+        }
+
+        t->phase = FANOUT_ANNOUNCED;
+      }
+
+      // empty fragments have nothing to stream
+      if (t->phase == FANOUT_STREAMING && t->sent == t->frag.size) t->phase = FANOUT_STORING;
+
+      if (t->phase == FANOUT_STREAMING && !t->staged && t->sent >= fanout_limit(t, end)) continue;
+
+      if (t->phase != FANOUT_STREAMING && server_has_frame(sv, t->fd)) buffered = true;
+
+      pfds[npfd].fd     = t->fd;
+      pfds[npfd].events = t->phase == FANOUT_STREAMING ? POLLOUT : POLLIN;
+      owner[npfd++]     = i;
+    }
+
+    if (active == 0) break;
+
+    if (current_millis() - fo->stalled_since > FANOUT_STALL_TIMEOUT_MS) {
+      printf("[FANOUT] : GIVING UP ON %d STALLED TRANSFERS.\n", active);
+      for (int i = 0; i < fo->n; i++) {
+        if (fanout_wants(fo->t + i, end, finish)) fanout_fail_fd(sv, fo->t, fo->n, fo->t[i].fd);
+      }
+      continue;
+    }
+
+    int r = poll(pfds, npfd, buffered ? 0 : 100);
+    if (r < 0 && errno != EINTR) {
+      perror("[FANOUT] poll");
+      break;
+    }
+
+    for (int k = 0; k < npfd; k++) {
+      int i = owner[k];
+      xFanoutTransfer *t = fo->t + i;
+      eFanoutPhase before = t->phase;
+      size_t sent = t->sent;
+
+      if (t->phase == FANOUT_FAILED) continue;
+
+      if (t->phase == FANOUT_STREAMING) {
+        if (pfds[k].revents & (POLLERR | POLLHUP)) fanout_fail_fd(sv, fo->t, fo->n, t->fd);
+        else if (pfds[k].revents & POLLOUT && t->staged) fanout_write(sv, fo, i, t->staged, t->offset, t->offset + t->frag.size);
+        else if (pfds[k].revents & POLLOUT) fanout_write(sv, fo, i, window, base, end);
+      }
+      else if (pfds[k].revents || server_has_frame(sv, t->fd)) {
+        fanout_read_reply(sv, fo->t, fo->n, i);
+      }
+
+      if (t->phase != before || t->sent != sent) fo->stalled_since = current_millis();
+    }
+  }
+
+  free(pfds);
+  free(owner);
+}
+
+/**
+ *  Sets up one transfer per remote replica chain of `f`.
+ * ------------------------------------------------------------
+ *  Notes:
+ *      `buffer` is the whole file, or NULL when the bytes are
+ *      handed over later through xprocedure_fanout_window.
+ *      Replicas on this node count as confirmed, the caller
+ *      keeps those. Data fragments of `deferred` are left to
+ *      the caller as well.
+ */
+xFanout *xprocedure_fanout_begin( Server *sv, xFileContainer *fc, xFileInNetwork *f, const char *buffer, node_id_t deferred )
+{
+  xFanout *fo = calloc(1, sizeof(xFanout));
+  if (fo == NULL) return NULL;
+
+  fo->fc        = fc;
+  fo->f         = f;
+  fo->buffer    = buffer;
+  fo->deferred  = deferred;
+  xfileserver_shape(fc, &fo->shape);
+
+  int replicas = xfilenetindex_replicas(f);
+
+  // worst case every chain breaks right after its head
+  fo->capacity = 2 * f->total_fragments;
+  fo->t = calloc(fo->capacity, sizeof(xFanoutTransfer));
+
+  if (fo->t == NULL) {
+    free(fo);
+    return NULL;
+  }
+
+  xFanoutTransfer *head = NULL;
+
+  for (int i = 0; i < (int)f->total_fragments; i++) {
+    xFragmentNetworkPointer frag = f->fragments[i];
+
+    // empty, or its holder kept identical bytes it had
+    if (frag.node_id == 0 || frag.shared) continue;
+
+    // the relay keeps its own data fragments, the caller checks them
+    if (frag.node_id == fo->deferred && fo->buffer == NULL && frag.fragment <= fo->shape.data) {
+      head = NULL;
+      continue;
+    }
+
+    fo->expected++;
+
+    // a replica slot starts a new fragment's run
+    bool first = i % replicas == 0;
+
+    // kept locally by the caller, also breaks the chain
+    if (frag.node_id == sv->me.node_id) {
+      fo->confirmed++;
+      head = NULL;
+      continue;
+    }
+
+    // holders only forward to their peer_f, placement skips full
+    // nodes so the next replica is not always that one
+    node_id_t tail = head != NULL ? head->chain[head->chain_len] : 0;
+
+    if (CHAIN_REPLICATION && head != NULL && !first && frag.node_id == server_next_valid_node(sv, tail)) {
+      head->chain[++head->chain_len] = frag.node_id;
+      continue;
+    }
+
+    head = fanout_add(sv, fo, &frag, i);
+
+    if (head->phase == FANOUT_FAILED) head = NULL;
+  }
+
+  return fo;
+}
+
+// bytes [base, base+len) of the file, written out before returning
+void xprocedure_fanout_window( Server *sv, xFanout *fo, const char *window, uint64_t base, size_t len )
+{
+  if (fo == NULL) return;
+
+  for (int i = 0; i < fo->n; i++) {
+    xFanoutTransfer *t = fo->t + i;
+    if (t->staged == NULL) continue;
+
+    if (t->frag.fragment > fo->shape.data) {
+      xerasure_absorb(&fo->shape, t->frag.fragment, t->staged, window, base, len);
+      continue;
+    }
+
+    uint64_t from = base > t->offset ? base : t->offset;
+    uint64_t to   = base + len < t->offset + t->frag.size ? base + len : t->offset + t->frag.size;
+
+    if (from < to) memcpy(t->staged + (from - t->offset), window + (from - base), to - from);
+  }
+
+  fanout_run(sv, fo, window, base, len, false);
+}
+
+/**
+ *  Waits every holder out and frees `fo`.
+ * ------------------------------------------------------------
+ *  Returns the number of replicas confirmed by their holders;
+ *  `expected` gets the number that should have been.
+ */
+int xprocedure_fanout_end( Server *sv, xFanout *fo, int *expected )
+{
+  if (fo == NULL) {
+    *expected = 1;
+    return 0;
+  }
+
+  // everything was handed over, a streamed upload has no bytes left
+  fanout_run(sv, fo, fo->buffer, 0, fo->buffer ? fo->fc->size : 0, true);
+
+  int confirmed = fo->confirmed;
+  *expected = fo->expected;
+
+  printf("[FANOUT] : %d OF %d REPLICAS CONFIRMED.\n", confirmed, *expected);
+
+  for (int i = 0; i < fo->n; i++) xslab_free(fo->t[i].staged);
+
+  free(fo->t);
+  free(fo);
+
+  return confirmed;
+}
+
+// the upload broke off, holders waiting for bytes get hung up on
+void xprocedure_fanout_abort( Server *sv, xFanout *fo )
+{
+  if (fo == NULL) return;
+
+  for (int i = 0; i < fo->n; i++) {
+    if (fo->t[i].phase != FANOUT_DONE && fo->t[i].phase != FANOUT_FAILED) fanout_fail_fd(sv, fo->t, fo->n, fo->t[i].fd);
+    xslab_free(fo->t[i].staged);
+  }
+
+  free(fo->t);
+  free(fo);
+}
+
+/**
+ *  Streams every remote replica of `f` out of `buffer` at once.
+ * ------------------------------------------------------------
+ *  Returns the number of replicas confirmed by their holders;
+ *  `expected` gets the number that should have been.
+ */
+int xprocedure_fanout( Server *sv, xFileContainer *fc, xFileInNetwork *f, char *buffer, int *expected )
+{
+  xFanout *fo = xprocedure_fanout_begin(sv, fc, f, buffer, 0);
+
+  return xprocedure_fanout_end(sv, fo, expected);
+}
@@ -0,0 +1,544 @@
+#include "statemachine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Parallel gathering of a requested file's fragments
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Holders dial in on their own, each one announces its
+ *      fragment with DECLARE_FRAG and streams it right after our
+ *      OK. Every announced fragment gets a stream that is read
+ *      without blocking whenever its fd is ready, so a GET takes
+ *      as long as the slowest holder instead of the sum of all.
+ *
+ *      Fragments sent packed are read into a buffer of their own
+ *      and unpacked into their slot once complete.
+ *
+ *      A fragment whose CRC32C differs from the one its holder
+ *      declared (or that won't unpack) is refused and its slot
+ *      opened again, so is a local copy that fails its own. The index hears of it with REFETCH_FRAGMENT
+ *      and has another holder send its copy, or a coded file a
+ *      parity fragment to rebuild it from. After REDUNDANCY asks
+ *      per fragment of the file the GET stops asking, the stall
+ *      timeout ends it.
+ *      One flagged `repair` is a scrub repair, it goes to
+ *      xprocedure_receive_repair as it would from IDLE. Any other
+ *      declared for another file is late for its own GET, refused.
+ *
+ *      Fragments land in their own slot. With GET_STREAMING the
+ *      client gets every slot as soon as all the ones before it
+ *      went out, only out of order fragments are kept around.
+ *
+ *      An erasure coded file is complete once its data fragments
+ *      are. The index asks for parity ones in place of those whose
+ *      holder is gone, any k of them rebuild the rest right here.
+ *      Fragments that went out are kept until the end for that.
+ *
+ *      Frames that are not part of the GET are parked and read
+ *      from IDLE afterwards, nothing is answered out of turn.
+ *
+ *      A GET no fragment moved for GATHER_STALL_TIMEOUT_MS (a
+ *      holder died halfway, nobody is left to send one) is given
+ *      up, the client is dropped and the node goes back to IDLE.
+ */
+
+static void gather_drop(Server *sv, int i)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  rf->streams[i] = rf->streams[--rf->n_streams];
+}
+
+static int gather_find(Server *sv, int fd)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  for (int i = 0; i < rf->n_streams; i++) {
+    if (rf->streams[i].fd == fd) return i;
+  }
+  return -1;
+}
+
+static void gather_shape(struct StateRequestedFile *rf, xErasureShape *s)
+{
+  xerasure_shape(s, rf->file_size, rf->fragment_count - rf->parity, rf->parity);
+}
+
+// data fragments are file_size / k long, the last one and parity take the rest
+static size_t gather_frag_size(struct StateRequestedFile *rf, int frag_id)
+{
+  xErasureShape s;
+  gather_shape(rf, &s);
+
+  return xerasure_size(&s, frag_id);
+}
+
+static bool gather_data_ready(struct StateRequestedFile *rf)
+{
+  for (int i = 0; i < rf->fragment_count - rf->parity; i++) {
+    if (!rf->slots[i].ready) return false;
+  }
+  return true;
+}
+
+static void gather_slot_ready(Server *sv, int frag_id)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+  xGatherSlot *slot = rf->slots + frag_id - 1;
+
+  slot->ready = true;
+  rf->fragment_found++;
+  rf->moved_at = current_millis();
+
+#if LOG_BUFFERS
+  printf("------------------------------------------------------------\n");
+  printf(" FRAG #%d:\n %.*s \n", frag_id, (int)slot->size, slot->bytes);
+  printf("------------------------------------------------------------\n");
+#endif
+}
+
+// stream i won't fill its slot, someone else may still deliver it
+static void gather_lose(Server *sv, int i)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+  xGatherStream *s = rf->streams + i;
+  xGatherSlot *slot = rf->slots + s->frag_id - 1;
+
+  xslab_free(s->packed);
+  s->packed = NULL;
+
+  xslab_free(slot->bytes);
+  memset(slot, 0, sizeof(xGatherSlot));
+}
+
+// the copy `holder` had is damaged, the index has someone else send one
+static void gather_refetch(Server *sv, int frag_id, node_id_t holder)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  if (rf->refetched >= rf->fragment_count * REDUNDANCY) {
+    printf("[GATHER] : ASKED FOR %d COPIES ALREADY, FRAG #%d IS NOT ASKED AGAIN.\n", rf->refetched, frag_id);
+    return;
+  }
+
+  xPacket p = xpacket_new(sv, TYPE_REFETCH_FRAGMENT);
+  p.bytes.comm.content.refetch_fragment.file_id = rf->file_id;
+  p.bytes.comm.content.refetch_fragment.frag_id = frag_id;
+  p.bytes.comm.content.refetch_fragment.holder  = holder;
+  p.bytes.comm.content.refetch_fragment.attempt = rf->refetched++;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  printf("[GATHER] : ASKING THE INDEX FOR ANOTHER COPY OF FRAG #%d.\n", frag_id);
+
+  server_send_to_index(sv, &p);
+}
+
+// moves stream i forward, true if it is gone afterwards
+static bool gather_drain(Server *sv, int i)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+  xGatherStream *s = rf->streams + i;
+
+  int r = server_read_raw_u(sv, s->fd, s->dst + s->received, s->size - s->received);
+
+  if (r < 0) {
+    printf("[GATHER] : FRAG #%d LOST AT %zu OF %zu BYTES.\n", s->frag_id, s->received, s->size);
+
+    gather_lose(sv, i);
+    server_close_socket(sv, s->fd);
+    gather_drop(sv, i);
+    return true;
+  }
+
+  if (!s->packed) s->crc = xcrc32c(s->crc, s->dst + s->received, r);
+
+  s->received += r;
+  if (r > 0) rf->moved_at = current_millis();
+
+  if (s->received < s->size) return false;
+
+  xGatherSlot *slot = rf->slots + s->frag_id - 1;
+
+  // packed on the wire, the slot gets it unpacked
+  if (s->packed) {
+    int ok = xlz_unpack(s->packed, s->size, slot->bytes, slot->size);
+
+    if (!ok) {
+      printf("[GATHER] : FRAG #%d DOES NOT UNPACK.\n", s->frag_id);
+
+      gather_refetch(sv, s->frag_id, s->holder);
+      gather_lose(sv, i);
+      server_send_not_ok(sv, s->fd);
+      gather_drop(sv, i);
+      return true;
+    }
+
+    xslab_free(s->packed);
+    s->packed = NULL;
+
+    s->crc = xcrc32c(0, slot->bytes, slot->size);
+  }
+
+  if (s->checked && s->crc != s->expect) {
+    printf("[GATHER] : FRAG #%d IS CORRUPTED (CRC %08x, DECLARED %08x).\n", s->frag_id, s->crc, s->expect);
+
+    gather_refetch(sv, s->frag_id, s->holder);
+    gather_lose(sv, i);
+    server_send_not_ok(sv, s->fd);
+    gather_drop(sv, i);
+    return true;
+  }
+
+  printf("[GATHER] : FRAG #%d COMPLETE (%zu BYTES).\n", s->frag_id, s->size);
+
+  server_send_ok(sv, s->fd);
+  gather_slot_ready(sv, s->frag_id);
+
+  gather_drop(sv, i);
+  return true;
+}
+
+static void gather_use_local(Server *sv, xFileServer *fs, int c, xPacket *p)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  server_send_ok(sv, c);
+
+  printf("USING MY LOCAL COPY \n");
+
+  xFileContainer *fc = xfileserver_find_file(fs, rf->file_id);
+  if (fc == NULL) return;
+
+  xFileFragment *fp = xfileserver_touch(fs, fc, p->bytes.comm.content.declare_fragment_use_local.frag_id);
+  if (fp == NULL) return;
+
+  printf("FRAG #%d \t SIZE:  %ld \n", fp->fragment_id, fp->fragment_size);
+
+  if (fp->fragment_id < 1 || fp->fragment_id > rf->fragment_count) return;
+
+  xGatherSlot *slot = rf->slots + fp->fragment_id - 1;
+  if (slot->bytes != NULL) return;
+
+  // read in place, the file server keeps it alive. Packed ones get a copy
+  char *unpacked = NULL;
+  const char *bytes = xfileserver_fragment_bytes(fp, &unpacked);
+  if (bytes == NULL) return;
+
+  // nobody checked it on the way in, the scrubber may not have yet
+  if (fp->checked && xcrc32c(0, bytes, fp->fragment_size) != fp->crc) {
+    printf("[GATHER] : MY COPY OF FRAG #%d IS CORRUPTED.\n", fp->fragment_id);
+
+    xslab_free(unpacked);
+    gather_refetch(sv, fp->fragment_id, sv->me.node_id);
+    return;
+  }
+
+  // a slab block could be spilled before it goes out, hold on to it
+  if (unpacked == NULL && !fp->record) xslab_retain((char *)bytes);
+
+  slot->bytes = (char *)bytes;
+  slot->size  = fp->fragment_size;
+  slot->owned = unpacked != NULL || !fp->record;
+
+  gather_slot_ready(sv, fp->fragment_id);
+}
+
+static void gather_declare(Server *sv, int c, xPacket *p)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  int frag_size = p->bytes.comm.content.declare_fragment_transport.frag_size;
+  int frag_id = p->bytes.comm.content.declare_fragment_transport.frag_id;
+  size_t wire_size = p->bytes.comm.content.declare_fragment_transport.wire_size;
+  bool packed = p->bytes.comm.content.declare_fragment_transport.codec != LZ_CODEC_NONE;
+  printf("FRAG #%d \t SIZE:  %d (%zu ON THE WIRE)\n", frag_id, frag_size, wire_size);
+
+  if (frag_id < 1 || frag_id > rf->fragment_count || (size_t)frag_size != gather_frag_size(rf, frag_id) || (packed && wire_size > (size_t)frag_size)) {
+    printf("FRAGMENT DOES NOT FIT THE FILE.\n");
+    server_close_socket(sv, c);
+    return;
+  }
+
+  xGatherSlot *slot = rf->slots + frag_id - 1;
+
+  if (slot->bytes != NULL || rf->n_streams >= rf->fragment_count) {
+    printf("[GATHER] : ALREADY HAVE FRAG #%d, REFUSING IT.\n", frag_id);
+    server_send_not_ok(sv, c);
+    return;
+  }
+
+  slot->bytes = xslab_alloc(frag_size);
+  slot->size  = frag_size;
+  slot->owned = true;
+
+  char *wire = packed ? xslab_alloc(wire_size) : slot->bytes;
+
+  if (slot->bytes == NULL || wire == NULL) {
+    if (wire != slot->bytes) xslab_free(wire);
+    xslab_free(slot->bytes);
+    memset(slot, 0, sizeof(xGatherSlot));
+
+    server_send_not_ok(sv, c);
+    return;
+  }
+
+  server_send_ok(sv, c);
+  rf->moved_at = current_millis();
+
+  xGatherStream *s = rf->streams + rf->n_streams++;
+  s->fd       = c;
+  s->frag_id  = frag_id;
+  s->holder   = p->bytes.comm.sender_id;
+  s->dst      = wire;
+  s->size     = packed ? wire_size : (size_t)frag_size;
+  s->received = 0;
+  s->packed   = packed ? wire : NULL;
+  s->checked  = p->bytes.comm.content.declare_fragment_transport.checked;
+  s->expect   = p->bytes.comm.content.declare_fragment_transport.crc;
+  s->crc      = 0;
+
+  // the reader may already hold the first bytes
+  gather_drain(sv, rf->n_streams - 1);
+}
+
+/**
+ *  Fills the missing data slots of a coded file out of what came
+ *  in, once that is at least k fragments.
+ * ------------------------------------------------------------
+ */
+static void gather_rebuild(Server *sv)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  if (rf->parity == 0) return;
+
+  xErasureShape s;
+  gather_shape(rf, &s);
+
+  int ready = 0, missing = 0;
+
+  for (int i = 0; i < rf->fragment_count; i++) {
+    if (rf->slots[i].ready) ready++;
+    else if (i < s.data && rf->slots[i].bytes != NULL) return; // still coming
+    else if (i < s.data) missing++;
+  }
+
+  if (missing == 0 || ready < s.data) return;
+
+  const char **frags = calloc(rf->fragment_count, sizeof(char *));
+  char **out = calloc(s.data, sizeof(char *));
+  bool ok = frags && out;
+
+  for (int i = 0; ok && i < rf->fragment_count; i++) {
+    if (rf->slots[i].ready) frags[i] = rf->slots[i].bytes;
+    else if (i < s.data && (out[i] = xslab_alloc(s.shard)) == NULL) ok = false;
+  }
+
+  ok = ok && xerasure_rebuild(&s, frags, out);
+
+  for (int i = 0; out && i < s.data; i++) {
+    if (out[i] == NULL) continue;
+
+    if (!ok) {
+      xslab_free(out[i]);
+      continue;
+    }
+
+    xGatherSlot *slot = rf->slots + i;
+
+    slot->bytes = out[i];
+    slot->size  = xerasure_size(&s, i + 1);
+    slot->owned = true;
+
+    gather_slot_ready(sv, i + 1);
+  }
+
+  if (ok) printf("[GATHER] : REBUILT %d DATA FRAGMENTS OUT OF PARITY.\n", missing);
+  else printf("[GATHER] : COULD NOT REBUILD THE MISSING FRAGMENTS.\n");
+
+  free(frags);
+  free(out);
+}
+
+// lets go of what a coded file kept around, once it is all out
+static void gather_release(Server *sv)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  for (int i = 0; i < rf->fragment_count; i++) {
+    xGatherSlot *slot = rf->slots + i;
+
+    if (slot->owned) xslab_free(slot->bytes);
+    memset(slot, 0, sizeof(xGatherSlot));
+  }
+}
+
+/**
+ *  Sets a frame that is not part of the GET aside for IDLE,
+ *  answering it now would put a reply where none is expected.
+ * ------------------------------------------------------------
+ *  A load report is all there is, the fd is still read for
+ *  declares. Anything else may have raw bytes behind it or wait
+ *  for an answer, its fd is left alone until the end.
+ */
+static void gather_park(Server *sv, int c, const xPacket *p)
+{
+  bool hold = p->bytes.comm.type != TYPE_REPORT_LOAD;
+
+  printf("[GATHER] : TYPE %d ON FD=%d WAITS FOR THE GET TO END.\n", p->bytes.comm.type, c);
+
+  server_park_frame(sv, c, hold);
+}
+
+// nothing moved for too long, drops the holders left and the client
+static void gather_give_up(Server *sv)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  printf("[GATHER] : FILE #%d STALLED WITH %d OF %d FRAGMENTS, GIVING UP.\n", rf->file_id, rf->fragment_found, rf->fragment_count - rf->parity);
+
+  // half read streams would desync their connections
+  while (rf->n_streams > 0) {
+    gather_lose(sv, 0);
+    server_close_socket(sv, rf->streams[0].fd);
+    gather_drop(sv, 0);
+  }
+
+  gather_release(sv);
+
+  if (rf->from_fd < 0) return;
+
+  if (rf->from_fd == sv->client_fd) sv->client_fd = 0;
+  if (rf->from_fd == sv->upload_ack_fd) sv->upload_ack_fd = -1;
+  server_close_socket(sv, rf->from_fd);
+  rf->from_fd = -1;
+}
+
+// hands the client every fragment that is next in line
+static void gather_flush(Server *sv)
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  while (rf->next_out < rf->fragment_count - rf->parity && rf->slots[rf->next_out].ready) {
+    xGatherSlot *slot = rf->slots + rf->next_out++;
+
+    // a client that went away still lets the holders finish
+    if (rf->from_fd >= 0 && server_send_large_buffer_to(sv, rf->from_fd, slot->size, slot->bytes) <= 0 && slot->size > 0) {
+      printf("[GATHER] : CLIENT FD=%d WENT AWAY.\n", rf->from_fd);
+      rf->from_fd = -1;
+    }
+
+    // a coded file may still need it to rebuild a later one
+    if (rf->parity) continue;
+
+    if (slot->owned) xslab_free(slot->bytes);
+    slot->bytes = NULL;
+  }
+}
+
+/**
+ *  One gather step: accepts holders, takes their announcements,
+ *  reads whatever every open stream has and passes on what the
+ *  client can have so far.
+ * ------------------------------------------------------------
+ *  Returns 1 once the whole file went out, or it was given up.
+ */
+int xprocedure_gather( Server *sv, xFileServer *fs )
+{
+  struct StateRequestedFile *rf = &sv->machine_state.StateRequestedFile;
+
+  // holders dial through their pools, keep those connections
+  if (server_loop_ready(sv, sv->listener_fd)) {
+    server_accept_presented(sv);
+  }
+
+  if (!rf->client_ok && server_loop_ready(sv, rf->from_fd)) {
+    xPacket p = {0};
+    int r = server_poll_frame(sv, rf->from_fd, &p);
+
+    if (r > 0 && p.bytes.comm.type == TYPE_OK) {
+      printf("CLIENT IS READY TO READ.\n");
+      rf->client_ok = true;
+    }
+  }
+
+  for (int i = 0; i < rf->n_streams; i++) {
+    if (!server_loop_ready(sv, rf->streams[i].fd)) continue;
+    if (gather_drain(sv, i)) i--;
+  }
+
+  int c;
+  while ((c = server_loop_next_ready(sv, LOOP_INBOUND)) >= 0) {
+    // a stream that finished above may have left its fd ready
+    if (gather_find(sv, c) >= 0) continue;
+
+    xPacket p = {0};
+    int r = server_peek_frame(sv, c, &p);
+
+    if (r < 0) {
+      printf("prolly closed by peer.\n");
+      server_close_socket(sv, c);
+      continue;
+    }
+
+    if (r == 0) continue;
+
+    printf("RECEIVED PACKET OF TYPE %d \n", p.bytes.comm.type);
+
+    // not ours, IDLE gets it once the file went out
+    if (p.bytes.comm.type != TYPE_DECLARE_USE_LOCAL && p.bytes.comm.type != TYPE_DECLARE_FRAG) {
+      gather_park(sv, c, &p);
+      continue;
+    }
+
+    server_poll_frame(sv, c, &p);
+
+    if (p.bytes.comm.type == TYPE_DECLARE_USE_LOCAL) {
+      gather_use_local(sv, fs, c, &p);
+    }
+    else if (p.bytes.comm.content.declare_fragment_transport.repair) {
+      // a scrub repair, nothing to do with this GET
+      xDeclareFragmentTransport d = p.bytes.comm.content.declare_fragment_transport;
+      xprocedure_receive_repair(sv, fs, c, &d);
+    }
+    else if (p.bytes.comm.content.declare_fragment_transport.file_id == (uint64_t)rf->file_id) {
+      gather_declare(sv, c, &p);
+    }
+    else {
+      printf("[GATHER] : FRAG OF FILE #%lu IS NOT PART OF THIS GET, REFUSING IT.\n", p.bytes.comm.content.declare_fragment_transport.file_id);
+      server_send_not_ok(sv, c);
+    }
+  }
+
+  gather_rebuild(sv);
+
+  bool complete = gather_data_ready(rf);
+
+  if (!complete && current_millis() - rf->moved_at > GATHER_STALL_TIMEOUT_MS) {
+    gather_give_up(sv);
+    server_release_parked(sv);
+    return 1;
+  }
+
+  if (!complete && !GET_STREAMING) return 0;
+
+  if (complete && !rf->client_ok) {
+    printf("WAITING OK TO START \n");
+    if (!server_wait_ok(sv, rf->from_fd)) rf->from_fd = -1;
+    rf->client_ok = true;
+  }
+
+  if (rf->client_ok) gather_flush(sv);
+
+  bool done = complete && rf->next_out == rf->fragment_count - rf->parity;
+
+  if (done) {
+    gather_release(sv);
+    server_release_parked(sv);
+  }
+
+  return done;
+}
@@ -0,0 +1,549 @@
+#include "statemachine.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Streaming ingest of a new file on the index
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Placement only needs the file size, so it is decided as
+ *      soon as CREATE_FILE shows up. The raw bytes are then read
+ *      one window at a time and every window goes straight out
+ *      to the fragments it belongs to, so an upload costs about
+ *      INGEST_WINDOW_SIZE of memory here instead of the file.
+ *      Replicas kept on this node are storage, those are filled
+ *      in place and adopted by the file server once complete.
+ *
+ *      An entry node relaying the upload can't take fragments
+ *      from us while it streams, so it keeps its own data ones
+ *      as they go through it (KEEP_FRAGMENTS) and confirms them
+ *      with a FRAG_STORED each after the last byte. We only sum
+ *      those up to check its copies. Its parity is staged here.
+ *
+ *      With ERASURE_CODING big files are cut in k data and
+ *      ERASURE_PARITY parity fragments, one per live node. Parity
+ *      is built up window by window like the rest, see erasure.c.
+ *
+ *      Holders are picked by rendezvous hashing: every live node
+ *      gets a score out of (file, fragment, node) and the highest
+ *      one holds the fragment. Files spread evenly whatever their
+ *      id, and a node leaving or joining only changes the choice
+ *      for the fragments it wins or loses, about 1/N of them. The
+ *      other replicas are the live nodes after it on the ring, a
+ *      chain can pass the bytes along (see chain.c).
+ *
+ *      Scores are weighted by the nodes' load reports (see
+ *      server_node_weight), w / -log(hash) wins a node w times its
+ *      share. Full or busy nodes get fewer new fragments, nodes
+ *      without room none as long as others have some.
+ */
+
+// rendezvous hash, splitmix64 over the three of them
+static uint64_t place_hash( uint32_t file_id, uint32_t frag, node_id_t node )
+{
+  uint64_t x = ((uint64_t)file_id << 32 | frag) ^ (node * 0x9e3779b97f4a7c15ull);
+
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+
+  return x ^ (x >> 31);
+}
+
+// -log2 of the hash as a fraction of 2^64, without libm: the leading
+// zeros, plus a quadratic fit of log2 over the rest in [1, 2). Close
+// enough, weights 1 : 0.5 : 0.25 still win 1 : 0.5 : 0.25 as often
+static double place_neglog2( uint64_t h )
+{
+  h |= 1;
+
+  int lz = __builtin_clzll(h);
+  double t = (double)(h << lz >> 11) / (double)(1ull << 52) - 1.0;
+
+  double l = lz + 1 - t * (1.3465 - 0.3465 * t);
+
+  return l > 1e-12 ? l : 1e-12;
+}
+
+// live node with the highest weight and room for `size`, any live one
+// if none has room. `taken` (ring long, may be NULL) are left out
+static node_id_t place_winner( Server *sv, uint32_t file_id, uint32_t frag, uint64_t size, const bool *taken )
+{
+  node_id_t ring = sv->net_size + sv->death_count; // original count
+
+  for (int pass = 0; pass < 2; pass++) {
+    node_id_t best = 0;
+    double best_score = 0;
+
+    for (node_id_t nid = 1; nid <= ring; nid++) {
+      if (!server_is_valid_node(sv, nid) || (taken && taken[nid - 1])) continue;
+      if (pass == 0 && !server_node_has_room(sv, nid, size)) continue;
+
+      // a node reporting no weight at all still beats nothing
+      double w = server_node_weight(sv, nid);
+      double score = (w > 1e-6 ? w : 1e-6) / place_neglog2(place_hash(file_id, frag, nid));
+
+      if (best == 0 || score > best_score) {
+        best = nid;
+        best_score = score;
+      }
+    }
+
+    if (best != 0) return best;
+  }
+
+  return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Where fragment `frag` of a file would start its chain now, 0 if nobody is
+// alive. Load reports move it, an old file's first holder may be elsewhere
+// -----------------------------------------------------------------------------
+node_id_t xprocedure_place_winner( Server *sv, uint32_t file_id, uint32_t frag, uint64_t size )
+{
+  return place_winner(sv, file_id, frag, size, NULL);
+}
+
+// every fragment on a node of its own, each one's winner among those left
+static void place_coded( Server *sv, xFileInNetwork *f, const xErasureShape *s )
+{
+  node_id_t ring = sv->net_size + sv->death_count; // original count
+
+  bool *taken = calloc(ring, sizeof(bool));
+  if (taken == NULL) return;
+
+  for (int i = 0; i < (int)f->total_fragments; i++) {
+    node_id_t nid = place_winner(sv, f->file_id, i + 1, s->shard, taken);
+    if (nid == 0) break;
+
+    taken[nid - 1] = true;
+
+    printf("\t%s Fragment #%d into node %ld\n", i < s->data ? "Data" : "Parity", i + 1, nid);
+
+    f->fragments[i].fragment = i + 1;
+    f->fragments[i].size     = xerasure_size(s, i + 1);
+    f->fragments[i].node_id  = nid;
+  }
+
+  free(taken);
+}
+
+// live nodes with room for `size` more bytes
+static int place_count_room( Server *sv, uint64_t size )
+{
+  node_id_t ring = sv->net_size + sv->death_count; // original count
+  int n = 0;
+
+  for (node_id_t nid = 1; nid <= ring; nid++) {
+    if (server_is_valid_node(sv, nid) && server_node_has_room(sv, nid, size)) n++;
+  }
+
+  return n;
+}
+
+/**
+ *  Registers a `sz` bytes file and picks the holders of each of
+ *  its fragments: REDUNDANCY ring-consecutive live nodes, or a
+ *  node of its own for every fragment of an erasure coded one.
+ * ------------------------------------------------------------
+ *  Returns the index entry, `out` gets the local container.
+ */
+xFileInNetwork *xprocedure_place_file( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const char *name, uint64_t sz, xFileContainer **out )
+{
+  int fragcount = sv->net_size;
+  int parity = 0;
+
+  if ( sz <= sv->net_size || sz <= MINIMAL_SIZE_FOR_SPLIT ) {
+    printf("FILE TOO SMALL TO SPLIT.\n");
+    fragcount = 1;
+  }
+  // every fragment needs a node of its own, and at least as many data as parity
+  else if ( ERASURE_CODING && sz >= ERASURE_MIN_SIZE && sv->net_size >= 2 * ERASURE_PARITY && sv->net_size <= ERASURE_MAX_FRAGMENTS ) {
+    parity = ERASURE_PARITY;
+
+    // full nodes are left out while enough others remain
+    int room = place_count_room(sv, sz / (fragcount - parity) + 1);
+    if (room >= 2 * parity && room < fragcount) {
+      printf("%d NODES HAVE NO ROOM, CODING OVER %d.\n", fragcount - room, room);
+      fragcount = room;
+    }
+  }
+
+  int id = fs->last_id+1;
+  *out = xfileserver_add_file(fs, name, id, sz, fragcount, parity);
+
+  printf("INDEXING FILE...\n");
+  xFileInNetwork *f = xfilenetindex_new_file(id, parity ? fragcount : fragcount * REDUNDANCY, parity);
+
+  if (parity) {
+    xErasureShape shape;
+    xfileserver_shape(*out, &shape);
+
+    printf("ERASURE CODED, %d DATA + %d PARITY FRAGMENTS.\n", shape.data, shape.parity);
+    place_coded(sv, f, &shape);
+
+    xfilenetindex_add_file(fnetidx, f);
+    xprocedure_index_changed(sv, fs, fnetidx, f);
+
+    return f;
+  }
+
+  int fragsz = sz / fragcount;
+  int remain = sz % fragcount;
+
+  for ( int i = 0; i < fragcount; i++ ) {
+    int fragmentsz = (i+1) == fragcount
+      ? fragsz + remain
+      : fragsz;
+
+    // the chain starts at the winner, the ring walk below goes on from it
+    int node = place_winner(sv, id, i + 1, fragmentsz, NULL) - 1;
+
+    printf("Fragment #%d size %d\n", i, fragmentsz);
+
+    int j = 0;
+
+    // nodes with room first, full ones only when nobody else is left
+    for (int pass = 0; pass < 2 && j < REDUNDANCY; pass++) {
+      int tries = 0;
+      while (j < REDUNDANCY && tries < (int)sv->index_data->known_peers+1) {
+        node_id_t nid = (node + tries++) % (sv->net_size + sv->death_count); // original count
+        nid += 1;
+
+        printf("\tTrying Fragment #%d into node %ld\n", i, nid);
+        if (!server_is_valid_node(sv, nid)) continue;
+
+        bool room = server_node_has_room(sv, nid, fragmentsz);
+        if (pass == 0 ? !room : room) continue;
+
+        printf("\tFragment #%d into node %ld\n", i, nid);
+        f->fragments[i * REDUNDANCY + j].fragment = i + 1;
+        f->fragments[i * REDUNDANCY + j].size = fragmentsz;
+        f->fragments[i * REDUNDANCY + j].node_id = nid;
+
+        j++;
+      }
+    }
+
+    printf("- DONE\n");
+  }
+
+  /**
+   * Adds to the index, will be used later to fan out
+   * segments
+   */
+  xfilenetindex_add_file(fnetidx, f);
+  xprocedure_index_changed(sv, fs, fnetidx, f);
+
+  return f;
+}
+
+// copies the part of a window that falls into a local fragment, windows
+// come in order so its checksum grows with it. no `frag`, just the sum
+static void ingest_keep(char *frag, uint32_t *crc, uint64_t frag_off, uint64_t frag_size, const char *window, uint64_t base, size_t len)
+{
+  uint64_t from = base > frag_off ? base : frag_off;
+  uint64_t to   = base + len < frag_off + frag_size ? base + len : frag_off + frag_size;
+
+  if (from >= to) return;
+
+  if (frag) memcpy(frag + (from - frag_off), window + (from - base), to - from);
+
+  *crc = xcrc32c(*crc, window + (from - base), to - from);
+}
+
+// tells the relay which data fragments are its own, returns how many
+static int ingest_tell_relay(Server *sv, xFileContainer *file, xFileInNetwork *f, const xErasureShape *shape, node_id_t relay, int fd, xKeptFragment **out)
+{
+  xKeptFragment *k = calloc(f->total_fragments + 1, sizeof(xKeptFragment));
+  uint16_t n = 0;
+
+  for (int i = 0; k && i < (int)f->total_fragments; i++) {
+    xFragmentNetworkPointer frag = f->fragments[i];
+
+    // parity needs every window, the fanout stages it
+    if (frag.node_id != relay || frag.fragment > shape->data) continue;
+
+    bool listed = false;
+    for (int j = 0; j < n; j++) listed |= k[j].fragment == frag.fragment;
+    if (listed) continue;
+
+    k[n].fragment = frag.fragment;
+    k[n].offset   = xerasure_offset(shape, frag.fragment);
+    k[n].size     = frag.size;
+    n++;
+  }
+
+  xPacket p = xpacket_new(sv, TYPE_KEEP_FRAGMENTS);
+  p.bytes.comm.content.keep_fragments.file_id              = file->file_id;
+  p.bytes.comm.content.keep_fragments.file_size            = file->size;
+  p.bytes.comm.content.keep_fragments.fragment_count_total = file->fragment_count_total;
+  p.bytes.comm.content.keep_fragments.parity               = file->parity;
+  p.bytes.comm.content.keep_fragments.count                = n;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  server_send_to_socket(sv, &p, fd);
+
+  if (n > 0) server_send_large_buffer_to(sv, fd, n * sizeof(xKeptFragment), (char *)k);
+
+  *out = k;
+  return n;
+}
+
+// the relay's FRAG_STORED for each of its own, returns how many match what went by
+static int ingest_relay_stored(Server *sv, int fd, const xKeptFragment *k, const uint32_t *crc, int n)
+{
+  uint64_t deadline = current_millis() + FANOUT_STALL_TIMEOUT_MS;
+  int ok = 0;
+
+  for (int got = 0; got < n; ) {
+    xPacket p = {0};
+    int r = server_peek_frame(sv, fd, &p);
+
+    if (r < 0) break;
+
+    if (r == 0) {
+      uint64_t now = current_millis();
+      if (now >= deadline) break;
+
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      poll(&pfd, 1, (int)(deadline - now));
+      continue;
+    }
+
+    // not ours, IDLE gets it
+    if (p.bytes.comm.type != TYPE_FRAG_STORED) break;
+
+    server_poll_frame(sv, fd, &p);
+    got++;
+
+    xFragmentStored s = p.bytes.comm.content.fragment_stored;
+
+    for (int j = 0; j < n; j++) {
+      if (k[j].fragment != s.frag_id) continue;
+
+      if (s.replicas > 0 && s.crc == crc[j]) ok++;
+      else printf("[INGEST] : RELAY LOST FRAGMENT #%u (CRC %08x, OURS %08x).\n", k[j].fragment, s.crc, crc[j]);
+      break;
+    }
+  }
+
+  if (ok < n) printf("[INGEST] : RELAY KEPT %d OF ITS %d FRAGMENTS.\n", ok, n);
+
+  return ok;
+}
+
+/**
+ *  Reads a CREATE_FILE's raw bytes from `client_fd` and places
+ *  them while they arrive. `relayed_by` is the entry node that
+ *  forwards them, 0 if the client talks to us directly.
+ * ------------------------------------------------------------
+ *  Returns 1 if every replica was confirmed.
+ */
+int xprocedure_ingest( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const char *name, uint64_t sz, int client_fd, node_id_t relayed_by )
+{
+  printf("INGESTING A %ldbyte FILE named %s... \n", sz, name);
+
+  xFileContainer *file = NULL;
+  xFileInNetwork *f = xprocedure_place_file(sv, fs, fnetidx, name, sz, &file);
+
+  int fragcount = file->fragment_count_total;
+
+  xErasureShape shape;
+  xfileserver_shape(file, &shape);
+
+  // fragments this node keeps, by fragment id - 1
+  char **local = calloc(fragcount, sizeof(char *));
+  uint64_t *local_size = calloc(fragcount, sizeof(uint64_t));
+  uint32_t *local_crc  = calloc(fragcount, sizeof(uint32_t));
+
+  for (int i = 0; local && local_size && local_crc && i < (int)f->total_fragments; i++) {
+    xFragmentNetworkPointer frag = f->fragments[i];
+
+    if (frag.node_id != sv->me.node_id || local[frag.fragment - 1] != NULL) continue;
+
+    printf("OHH FRAG #%d IS MINE... SIZE=%ld\n", frag.fragment, frag.size);
+
+    // parity is summed up into it
+    local[frag.fragment - 1] = frag.fragment > shape.data ? xslab_calloc(1, frag.size) : xslab_alloc(frag.size);
+    local_size[frag.fragment - 1] = frag.size;
+  }
+
+  // the relay keeps its own, we only check them. clients send their own id
+  bool relayed = relayed_by > 0 && relayed_by <= sv->net_size + sv->death_count;
+
+  xKeptFragment *relay = NULL;
+  int n_relay = relayed ? ingest_tell_relay(sv, file, f, &shape, relayed_by, client_fd, &relay) : 0;
+  uint32_t *relay_crc = calloc(n_relay + 1, sizeof(uint32_t));
+
+  size_t cap = sz < INGEST_WINDOW_SIZE ? sz : INGEST_WINDOW_SIZE;
+  char *window = xslab_alloc(cap);
+
+  xFanout *fo = xprocedure_fanout_begin(sv, file, f, NULL, relayed ? relayed_by : 0);
+
+  uint64_t populated = 0;
+
+  while (window && local && local_size && local_crc && populated < sz) {
+    size_t want = sz - populated < cap ? sz - populated : cap;
+
+    int r = server_read_raw(sv, client_fd, window, want);
+    if (r <= 0) {
+      printf("RAW STREAM ENDED EARLY.\n");
+      break;
+    }
+
+    for (int k = 0; k < fragcount; k++) {
+      if (local[k] == NULL) continue;
+
+      if (k < shape.data) ingest_keep(local[k], local_crc + k, xerasure_offset(&shape, k + 1), local_size[k], window, populated, r);
+      else xerasure_absorb(&shape, k + 1, local[k], window, populated, r);
+    }
+
+    for (int j = 0; relay_crc && j < n_relay; j++) {
+      ingest_keep(NULL, relay_crc + j, relay[j].offset, relay[j].size, window, populated, r);
+    }
+
+    xprocedure_fanout_window(sv, fo, window, populated, r);
+
+    populated += r;
+  }
+
+  printf("RAW : %.2f%% bytes.\n", (100 * (float)populated / (float)sz));
+
+  xslab_free(window);
+
+  bool complete = populated == sz;
+  int ok = 0;
+
+  for (int k = 0; local && local_size && local_crc && k < fragcount; k++) {
+    if (local[k] == NULL) continue;
+
+    // parity is only known once every window went in
+    if (complete && k >= shape.data) local_crc[k] = xcrc32c(0, local[k], local_size[k]);
+
+    if (!complete || xfileserver_adopt_fragment(fs, file, k + 1, local[k], local_size[k], local_crc[k]) != FRAG_OK) {
+      xslab_free(local[k]);
+    }
+  }
+
+  if (complete) {
+    int relay_ok = n_relay > 0 && relay_crc ? ingest_relay_stored(sv, client_fd, relay, relay_crc, n_relay) : 0;
+
+    int expected = 0;
+    int confirmed = xprocedure_fanout_end(sv, fo, &expected) + relay_ok;
+    expected += n_relay;
+
+    if (confirmed != expected) printf("ONLY %d OF %d REPLICAS STORED.\n", confirmed, expected);
+
+    ok = confirmed == expected;
+  }
+  else {
+    xprocedure_fanout_abort(sv, fo);
+  }
+
+  free(local);
+  free(local_size);
+  free(local_crc);
+  free(relay);
+  free(relay_crc);
+
+  xfileserver_debug(fs);
+
+  return ok;
+}
+
+/**
+ *  Relay side of KEEP_FRAGMENTS, right after CREATE_FILE was
+ *  passed on to the index
+ * ------------------------------------------------------------
+ *  Notes:
+ *      The ack of an earlier upload may still be on its way,
+ *      that one goes to its client first.
+ */
+void xprocedure_relay_keep_begin( Server *sv, xFileServer *fs, const xRequestFileCreation *fc, xRelayKeep *k )
+{
+  memset(k, 0, sizeof(xRelayKeep));
+
+  int fd = sv->index.stream_fd;
+  xPacket p = server_wait_from_socket(sv, fd);
+
+  while (p.size > 0 && (p.bytes.comm.type == TYPE_OK || p.bytes.comm.type == TYPE_NOT_OK)) {
+    printf("UPLOAD ACK FROM INDEX: %d\n", p.bytes.comm.type);
+
+    if (sv->upload_ack_fd >= 0) server_send_to_socket(sv, &p, sv->upload_ack_fd);
+    sv->upload_ack_fd = -1;
+
+    p = server_wait_from_socket(sv, fd);
+  }
+
+  if (p.size <= 0 || p.bytes.comm.type != TYPE_KEEP_FRAGMENTS) {
+    printf("[INGEST] : INDEX DID NOT SAY WHAT TO KEEP.\n");
+    return;
+  }
+
+  xKeepFragments kf = p.bytes.comm.content.keep_fragments;
+  if (kf.count == 0) return;
+
+  size_t size = kf.count * sizeof(xKeptFragment);
+
+  k->frags = malloc(size);
+  k->bytes = calloc(kf.count, sizeof(char *));
+  k->crc   = calloc(kf.count, sizeof(uint32_t));
+
+  if (k->frags == NULL || server_read_raw(sv, fd, k->frags, size) != (int)size || k->bytes == NULL || k->crc == NULL) {
+    printf("[INGEST] : KEEP LIST ENDED EARLY.\n");
+    xprocedure_relay_keep_end(sv, fs, k, false);
+    return;
+  }
+
+  k->file = xfileserver_find_file(fs, kf.file_id);
+  if (k->file == NULL) k->file = xfileserver_add_file(fs, fc->name, kf.file_id, kf.file_size, kf.fragment_count_total, kf.parity);
+
+  k->count = kf.count;
+
+  for (int j = 0; j < k->count; j++) {
+    printf("OHH FRAG #%d IS MINE... SIZE=%lu\n", k->frags[j].fragment, k->frags[j].size);
+    k->bytes[j] = xslab_alloc(k->frags[j].size);
+  }
+}
+
+// copies what falls into our fragments out of a window being relayed
+void xprocedure_relay_keep_window( xRelayKeep *k, const char *window, uint64_t base, size_t len )
+{
+  for (int j = 0; j < k->count; j++) {
+    if (k->bytes[j] == NULL) continue;
+
+    ingest_keep(k->bytes[j], k->crc + j, k->frags[j].offset, k->frags[j].size, window, base, len);
+  }
+}
+
+/**
+ *  Stores what was kept and, if the whole upload went by,
+ *  confirms each fragment to the index
+ * ------------------------------------------------------------
+ */
+void xprocedure_relay_keep_end( Server *sv, xFileServer *fs, xRelayKeep *k, bool complete )
+{
+  for (int j = 0; j < k->count; j++) {
+    xKeptFragment *kf = k->frags + j;
+
+    bool kept = complete && k->file && k->bytes[j]
+      && xfileserver_adopt_fragment(fs, k->file, kf->fragment, k->bytes[j], kf->size, k->crc[j]) == FRAG_OK;
+
+    if (!kept) xslab_free(k->bytes[j]);
+
+    // the index waits for these right after the last raw byte
+    if (complete) {
+      xPacket p = xpacket_fragment_stored(sv, k->file ? k->file->file_id : 0, kf->fragment, kept ? 1 : 0, k->crc[j]);
+      server_send_to_index(sv, &p);
+    }
+  }
+
+  free(k->frags);
+  free(k->bytes);
+  free(k->crc);
+
+  memset(k, 0, sizeof(xRelayKeep));
+}
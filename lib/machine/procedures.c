@@ -8,14 +8,9 @@ void xprocedure_check_peer_b(Server *sv, xFileInNetwork *fni)
   xPacket p = { 0 };
 
   // printf("CHECKING PEER B \n"); 
-  int n = tcp_recv_u( sv->peer_b.stream_fd, p.bytes.raw, 4096);
-  if ( n <= 0 ) return;
+  if ( server_poll_frame( sv, sv->peer_b.stream_fd, &p ) <= 0 ) return;
 
-  // since i openly am not abstracting this packet read
-  // i must do this stuff
-  p.size = n;
-
-  printf("RECEIVED PACKET FROM PEER B | SIZE = %d \n", n); 
+  printf("RECEIVED PACKET FROM PEER B | SIZE = %d \n", p.size); 
 
   switch( p.bytes.comm.type )
     {
@@ -29,6 +24,8 @@ void xprocedure_check_peer_b(Server *sv, xFileInNetwork *fni)
       sv->net_size--;
       sv->death_count++;
 
+      server_pool_drop(sv, dead_id);
+
       /**
        * 
        */
@@ -51,9 +48,10 @@ void xprocedure_check_peer_b(Server *sv, xFileInNetwork *fni)
 
       /**
        *  INDEX MUST DELETE MAPPED FILE FRAGMENTS.
+       *  (its standby too, it keeps the same table)
        * ------------------------------------------------------------
        */
-      if ( server_is_index(sv) )
+      if ( sv->index_data != NULL )
       {
         printf("I MUST UPDATE MY INTERNAL INDEX STUFF \n");
         
@@ -64,13 +62,20 @@ void xprocedure_check_peer_b(Server *sv, xFileInNetwork *fni)
         int i = p.bytes.comm.content.peer_died.peer_id - 1;
         memset(&sv->index_data->peer_ips[i], 0, sizeof(Address));
       }
-      else {
-        if (dead_id == sv->index.node_id)
-        {
-          printf("OMG! THE INDEX DIED...\n");
-          server_set_state(sv, SERVER_BEGIN_OPERATION);
-        }
+
+      xprocedure_standby_forget(sv, dead_id);
+
+      if ( dead_id == sv->index.node_id && ! server_index_failover(sv, dead_id) )
+      {
+        printf("OMG! THE INDEX DIED...\n");
+        server_set_state(sv, SERVER_BEGIN_OPERATION);
       }
+      break;
+    }
+
+    case TYPE_PRESENT_STANDBY: {
+      xprocedure_standby_announced(sv, &p);
+      break;
     }
   }
 }
@@ -79,25 +84,41 @@ void server_healthcheck( Server *sv )
 {
   if ( server_is_peerb_connected( sv ) ) {
     char buf;
-    size_t n = tcp_peek_u( sv->peer_b.stream_fd , buf, 1); // peeking zero bytes
+    int n = tcp_peek_u( sv->peer_b.stream_fd , &buf, 1); // peeking zero bytes
 
     if (n == 0) {
       printf("[HEALTHCHECK] : PEER IS DEAD. RIP. \n");
 
       sv->peer_b.status.open = false;
 
+      // a closed socket stays readable forever, the loop must forget it
+      server_loop_unwatch(sv, sv->peer_b.stream_fd);
+      tcp_close(sv->peer_b.stream_fd);
+      sv->peer_b.stream_fd = -1;
+
+      server_pool_drop(sv, sv->peer_b.node_id);
+
       sv->net_size--;
       sv->death_count++;
 
       xprocedure_peer_died_notify(sv);
 
-      if (server_is_index(sv))
+      if (sv->index_data != NULL)
       {
         printf("I MUST UPDATE MY INTERNAL INDEX STUFF \n");
 
         int i = sv->peer_b.node_id - 1;
         memset(&sv->index_data->peer_ips[i], 0, sizeof(Address));
       }
+
+      xprocedure_standby_forget(sv, sv->peer_b.node_id);
+
+      // nobody took over from the index, see SERVER_WAITING_NEW_PEER
+      if (sv->peer_b.node_id == sv->index.node_id && !server_index_failover(sv, sv->peer_b.node_id))
+      {
+        sv->index.node_id = 0;
+      }
+
       server_set_state(sv, SERVER_WAITING_NEW_PEER);
     } else if (n < 0) {
         // fuck it then
@@ -115,15 +136,15 @@ void server_healthcheck( Server *sv )
  */
 node_id_t xprocedure_wait_identification(Server *sv, int client) 
 {
-  node_id_t N = server_wait_client_presentation(&sv, client);
+  node_id_t N = server_wait_client_presentation(sv, client);
 
   if (!N) {
     tcp_close(client);
     return 0;
   }
 
-  xPacket pkt_ok = xpacket_ok(&sv);
-  size_t sent = server_send_to_socket(&sv, &pkt_ok, client);
+  xPacket pkt_ok = xpacket_ok(sv);
+  size_t sent = server_send_to_socket(sv, &pkt_ok, client);
 
   if ( sent <= 0 ) 
   {
@@ -135,20 +156,13 @@ node_id_t xprocedure_wait_identification(Server *sv, int client)
 }
 
 
-int xprocedure_send_request_fragment( Server *sv, Address *to , int file_id, int fragment_id, Address *deliver_to )
+int xprocedure_send_request_fragment( Server *sv, node_id_t holder, Address *to , int file_id, int fragment_id, node_id_t deliver_node, Address *deliver_to, bool repair )
 {
   printf("CONNECTING TO :%d\n", to->port);
 
-  int fd = server_dial(sv, to);
-  if (fd <= 0)
+  int fd = server_pool_get(sv, holder, to);
+  if (fd < 0)
   {
-    return fd;
-  }
-
-  xPacket presentation = xpacket_presentation(sv);
-  server_send_to_socket(sv, &presentation, fd);
-  if ( ! server_wait_ok( sv, fd ) ) {
-    printf("FRAGMENT REFUSED.\n");
     return -1;
   }
 
@@ -160,6 +174,8 @@ int xprocedure_send_request_fragment( Server *sv, Address *to , int file_id, int
   pkt.bytes.comm.content.deliver_fragment_to.file_id  = file_id;
   pkt.bytes.comm.content.deliver_fragment_to.frag_id  = fragment_id;
   pkt.bytes.comm.content.deliver_fragment_to.to       = *deliver_to;
+  pkt.bytes.comm.content.deliver_fragment_to.to_node  = deliver_node;
+  pkt.bytes.comm.content.deliver_fragment_to.repair   = repair;
   pkt.size = sizeof(pkt.bytes.comm) + sizeof(pkt.size);
 
   printf("SENDING FRAG DELIVER REQUEST.\n");
@@ -167,45 +183,34 @@ int xprocedure_send_request_fragment( Server *sv, Address *to , int file_id, int
 
   if ( ! server_wait_ok( sv, fd ) ) {
     printf("FRAGMENT REFUSED.\n");
+    server_pool_fail(sv, fd);
     return -2;
   }
 
-  server_close_socket( sv, fd );
   return 1;
 }
 
 
-int xprocedure_send_use_local( Server *sv, int fragment_id, Address *deliver_to ) 
+int xprocedure_send_use_local( Server *sv, int fragment_id, node_id_t deliver_node, Address *deliver_to ) 
 {
   xPacket p = xpacket_new(sv, TYPE_DECLARE_USE_LOCAL);
 
   p.bytes.comm.content.declare_fragment_use_local.frag_id = fragment_id;
   p.size = sizeof(p.bytes.comm);
 
-  int c = server_dial(sv, deliver_to);
-  if (c <= 0)
+  int c = server_pool_get(sv, deliver_node, deliver_to);
+  if (c < 0)
     return -1 ;
 
-  xPacket presentation = xpacket_presentation(sv);
-
-  server_send_to_socket(sv, &presentation, c);
-
-  if (!server_wait_ok(sv, c))
-  {
-    printf("PRESENTATION REFUSED.\n");
-    return -2;
-  }
-
   server_send_to_socket(sv, &p, c);
 
   if (!server_wait_ok(sv, c))
   {
     printf("FRAGMENT REFUSED.\n");
+    server_pool_fail(sv, c);
     return -3;
   }
 
-  server_close_socket( sv, c );
-
   return 1;
 }
 
@@ -215,46 +220,50 @@ int xprocedure_send_use_local( Server *sv, int fragment_id, Address *deliver_to
  * 
  * 
  */
-int xprocedure_send_fragment( Server *sv, xFileServer *fs, int file_id, int fragment_id, Address *deliver_to ) 
+int xprocedure_send_fragment( Server *sv, xFileServer *fs, int file_id, int fragment_id, node_id_t deliver_node, Address *deliver_to, bool repair ) 
 {
 
   printf("CONNECTING TO :%d\n", deliver_to->port);
 
-  int fd = server_dial( sv, deliver_to );
-
-  if (fd <= 0)
-  {
-    return 0;
-  }
-
   xFileContainer *fc = xfileserver_find_file(fs, file_id);
   if (fc == NULL)
   {
     return -1;
   }
 
-  xFileFragment *fragments = fc->fragments;
-  xFileFragment *fragment = NULL;
+  // a spilled one comes back into memory
+  xFileFragment *fragment = xfileserver_touch(fs, fc, fragment_id);
 
-  for (int i = 0; i < REDUNDANCY; i++)
+  if (fragment == NULL)
   {
-    if (fragments[i].fragment_id == fragment_id)
-    {
-      fragment = fragments + i;
-      break;
-    }
+    return -2;
   }
 
-  if (fragment == NULL)
+  // packed at rest goes as it is, COMPRESSION_WIRE packs it just for the trip
+  const char *bytes = fragment->fragment_bytes;
+  uint64_t wire     = fragment->stored_size;
+  uint8_t codec     = fragment->codec;
+  char *packed      = NULL;
+
+  if ( codec == LZ_CODEC_NONE && FRAGMENT_COMPRESSION == COMPRESSION_WIRE )
   {
-    return -2;
+    size_t packed_size = 0;
+    packed = xlz_pack(bytes, fragment->fragment_size, &packed_size);
+
+    if (packed)
+    {
+      bytes = packed;
+      wire  = packed_size;
+      codec = LZ_CODEC_LZ;
+    }
   }
 
-  xPacket presentation = xpacket_presentation(sv);
-  server_send_to_socket(sv, &presentation, fd);
-  if ( ! server_wait_ok( sv, fd ) ) {
-    printf("FRAGMENT REFUSED.\n");
-    return -3;
+  int fd = server_pool_get( sv, deliver_node, deliver_to );
+
+  if (fd < 0)
+  {
+    xslab_free(packed);
+    return 0;
   }
   
   xPacket p = {0};
@@ -264,24 +273,42 @@ int xprocedure_send_fragment( Server *sv, xFileServer *fs, int file_id, int frag
   p.bytes.comm.content.declare_fragment_transport.frag_id   = fragment_id;
   p.bytes.comm.content.declare_fragment_transport.frag_size = fragment->fragment_size;
   p.bytes.comm.content.declare_fragment_transport.file_size = fc->size;
+  p.bytes.comm.content.declare_fragment_transport.wire_size = wire;
+  p.bytes.comm.content.declare_fragment_transport.codec     = codec;
+  p.bytes.comm.content.declare_fragment_transport.checked   = fragment->checked;
+  p.bytes.comm.content.declare_fragment_transport.crc       = fragment->crc;
+  p.bytes.comm.content.declare_fragment_transport.repair    = repair;
   p.size = sizeof(p.bytes.comm) + sizeof(p.size);
 
-  printf("SENDING FRAG DECLARATION\n");
+  printf("SENDING FRAG DECLARATION (%lu OF %lu BYTES ON THE WIRE)\n", wire, fragment->fragment_size);
   server_send_to_socket(sv, &p, fd);
 
   if ( ! server_wait_ok( sv, fd ) ) {
     printf("FRAGMENT REFUSED.\n");
+    server_pool_fail(sv, fd);
+    xslab_free(packed);
     return -4;
   }
 
-  int r = server_send_large_buffer_to( sv, fd, fragment->fragment_size, fragment->fragment_bytes);
+  // we wait for its OK anyway, the ACKs come before it
+  if ( ! server_send_large_buffer_pinned( sv, fd, wire, (char *)bytes) ) {
+    printf("FRAGMENT RAW NOT SENT.\n");
+    xslab_free(packed);
+    return -5;
+  }
 
-  if ( ! server_wait_ok( sv, fd ) ) {
+  xPacket ack = server_wait_from_socket( sv, fd );
+  xslab_free(packed);
+
+  if ( ack.bytes.comm.type != TYPE_OK ) {
     printf("FRAGMENT RAW REFUSED.\n");
+
+    // a NOT_OK (bad checksum) comes after every byte was read, the connection is still good
+    if ( ack.bytes.comm.type != TYPE_NOT_OK ) server_pool_fail(sv, fd);
     return -5;
   }
 
-  server_close_socket( sv, fd );
+  fs->bytes_out += wire;
 
   return 1;
 }
@@ -299,8 +326,6 @@ int xprocedure_peer_died_notify( Server *sv )
 
   xprocedure_peer_died_forward(sv, &p);
 
-  sv->net_size--;
-
 }
 
 int xprocedure_peer_died_forward( Server *sv, xPacket *p )
@@ -322,81 +347,162 @@ int xprocedure_index_died_notify( Server *sv )
 }
 
 
-int xprocedure_save_file_to_index( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xReportFileKnowledge *r, int c)
+/**
+ *  Describes a file and every fragment of it this node keeps,
+ *  the list goes out as raw bytes right after the report.
+ * ------------------------------------------------------------
+ *  Returns the slab allocated list, `out->frag_held` long.
+ */
+xFragmentNetworkPointer *xprocedure_file_report( Server *sv, const xFileContainer *fc, xReportFileKnowledge *out )
 {
-  printf("INIT PROC \n" );
-  int fragments_redundancy = r->frag_count * REDUNDANCY;
+  memset(out, 0, sizeof(xReportFileKnowledge));
 
-  // xfilenetindex_debug(fnetidx);
-  // xfileserver_debug(fs);
+  out->file_id    = fc->file_id;
+  out->file_size  = fc->size;
+  out->frag_count = fc->fragment_count_total;
+  out->parity     = fc->parity;
+  memcpy(out->file_name, fc->file_name, sizeof(fc->file_name));
+
+  xFragmentNetworkPointer *held = xslab_calloc(fc->held, sizeof(xFragmentNetworkPointer));
+  if (held == NULL) return NULL;
+
+  out->frag_held = fc->held;
+
+  for (int i = 0; i < fc->held; i++)
+  {
+    held[i].fragment = fc->fragments[i].fragment_id;
+    held[i].size     = fc->fragments[i].fragment_size;
+    held[i].node_id  = sv->me.node_id;
+  }
+
+  return held;
+}
+
+// how far after the fragment's first choice node a holder sits
+static node_id_t ring_distance( node_id_t ring, node_id_t first, const xFragmentNetworkPointer *p )
+{
+  return (p->node_id + ring - first) % ring;
+}
+
+/**
+ *  Merges a node's report into the index. Each fragment owns
+ *  REDUNDANCY slots, kept in the ring order placement uses so
+ *  the first one is whom a GET asks. An erasure coded file has
+ *  a single one per fragment.
+ * ------------------------------------------------------------
+ */
+int xprocedure_save_file_to_index( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xReportFileKnowledge *r, const xFragmentNetworkPointer *held, int c)
+{
+  printf("INIT PROC \n" );
 
   xFileInNetwork *fni = xfilenetindex_find_file(fnetidx, r->file_id);
   xFileContainer *fc = xfileserver_find_file(fs, r->file_id);
   if (fni == NULL) // if file is not created yet
   {
     printf("SETTING INDEX\n");
-    fni = xfilenetindex_new_file(r->file_id, r->frag_count * REDUNDANCY);
+    fni = xfilenetindex_new_file(r->file_id, r->frag_count * (r->parity ? 1 : REDUNDANCY), r->parity);
     xfilenetindex_add_file(fnetidx, fni);
   }
   if (fc == NULL) // if file is not created yet
   {
     printf("SETTING FILE CONTAINER\n");
-    fc = xfileserver_add_file(fs, r->file_name, r->file_id, r->file_size, r->frag_count);
+    fc = xfileserver_add_file(fs, r->file_name, r->file_id, r->file_size, r->frag_count, r->parity);
   }
 
-  int frags[2] = {0, 0};
+  int replicas = xfilenetindex_replicas(fni);
+
+  node_id_t ring = sv->net_size + sv->death_count; // original count
 
-  for (int i = 0; i < 2; i++)
+  for (int i = 0; i < r->frag_held; i++)
   {
-    printf("  Fragment %d:\n", i);
-    printf("    fragment: %u\n", r->fragments[i].fragment);
-    printf("    size: %llu\n", (unsigned long long)r->fragments[i].size);
-    printf("    node_id: %llu\n", (unsigned long long)r->fragments[i].node_id);
-    frags[i] = r->fragments[i].fragment;
-  }
+    xFragmentNetworkPointer in = held[i];
 
-  int diff = frags[1] - frags[0];
+    printf("  FRAG #%u | SIZE %lu | NODE %lu\n", in.fragment, in.size, in.node_id);
 
-  printf("DIFF BETWEEN FRAGS: %d\n", diff);
- 
-  // if ony onde fragment, than there will be no redundancy per node, only in the next neighbour
-  if ( r->frag_count == 1 ) {
-    printf("HALDLING 1 FRAG FILE.\n");
-    if ( fni->fragments[0].fragment != 0 )
+    if (in.fragment < 1 || in.fragment > r->frag_count || (uint64_t)(in.fragment * replicas) > fni->total_fragments) 
     {
-      if ( fni->fragments[0].node_id < r->fragments[0].node_id )
-      {
-        fni->fragments[1] = r->fragments[0];
-      }
-      else {
-        fni->fragments[1] = fni->fragments[0];
-        fni->fragments[0] = r->fragments[0];
-      }
+      printf("FRAGMENT DOES NOT FIT THE FILE.\n");
+      continue;
+    }
+
+    xFragmentNetworkPointer *slots = fni->fragments + (in.fragment - 1) * replicas;
+
+    // same holder reporting again, or the first empty slot
+    int at = 0;
+    while (at < replicas && slots[at].fragment != 0 && slots[at].node_id != in.node_id) at++;
+
+    if (at == replicas)
+    {
+      printf("FRAG #%u ALREADY HAS %d HOLDERS.\n", in.fragment, replicas);
+      continue;
     }
-    else {
-      fni->fragments[0] = r->fragments[0];
+
+    slots[at] = in;
+
+    // placement's winner heads the chain, the other replicas follow it on the ring
+    node_id_t first = at > 0 ? xprocedure_place_winner(sv, r->file_id, in.fragment, in.size) : 0;
+
+    for (; at > 0 && ring_distance(ring, first, slots + at) < ring_distance(ring, first, slots + at - 1); at--)
+    {
+      xFragmentNetworkPointer tmp = slots[at - 1];
+      slots[at - 1] = slots[at];
+      slots[at] = tmp;
     }
   }
-  else if ( diff > 1 ) // iff diff between frag ids is negative, thes isthe borders
-  {
-    fni->fragments[0] = r->fragments[0];
-    fni->fragments[r->frag_count * REDUNDANCY - 1] = r->fragments[1];
+
+  xprocedure_index_changed(sv, fs, fnetidx, fni);
+
+  return 1;
+}
+
+
+/**
+ *  Tells the index how full and how busy this node is, every
+ *  LOAD_REPORT_INTERVAL_MS. The index keeps its own.
+ * ------------------------------------------------------------
+ */
+void xprocedure_report_load( Server *sv, xFileServer *fs, const xChainQueue *chain, xLoadReporter *rep )
+{
+  uint64_t now = current_millis();
+
+  // the first one only sets where throughput counts from
+  if (rep->last_ms == 0) {
+    rep->last_ms   = now;
+    rep->bytes_in  = fs->bytes_in;
+    rep->bytes_out = fs->bytes_out;
   }
-  else
-  {
-    if ( r->frag_count == 2 && fni->fragments[0].fragment == 0 ) {
-      fni->fragments[0] = r->fragments[0];
-      fni->fragments[r->frag_count * REDUNDANCY - 1] = r->fragments[1];
-    }
-    else {
-      size_t place = (frags[1] - 1) * REDUNDANCY;
 
-      printf("Writing to fragments[%zu] and fragments[%zu]\n",
-             place, place - 1);
+  if (now - rep->last_ms < LOAD_REPORT_INTERVAL_MS) return;
 
-      fni->fragments[place - 1] = r->fragments[0];
-      fni->fragments[place] = r->fragments[1];
-    }
+  uint64_t moved = (fs->bytes_in - rep->bytes_in) + (fs->bytes_out - rep->bytes_out);
+
+  xReportLoad r = {
+    .free_bytes    = xfileserver_free_bytes(fs),
+    .stored        = fs->stored,
+    .resident      = fs->resident,
+    .budget        = fs->budget,
+    .bytes_per_sec = moved * 1000 / (now - rep->last_ms),
+  };
+
+  for (int i = 0; i < chain->count; i++) {
+    if (chain->jobs[i].active) r.inflight++;
   }
 
-}
\ No newline at end of file
+  rep->last_ms   = now;
+  rep->bytes_in  = fs->bytes_in;
+  rep->bytes_out = fs->bytes_out;
+
+  if (server_is_index(sv))
+  {
+    server_index_save_load(sv, sv->me.node_id, &r);
+    return;
+  }
+
+  // no waiting on a dial from IDLE, the next one comes soon enough
+  if (!server_try_index(sv)) return;
+
+  // fire and forget
+  xPacket p = xpacket_report_load(sv, &r);
+
+  server_send_to_index(sv, &p);
+}
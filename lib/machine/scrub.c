@@ -0,0 +1,296 @@
+#include "statemachine.h"
+#include "../defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Background checksum scrubbing and repair
+ * ------------------------------------------------------------
+ *  Notes:
+ *      From IDLE every node walks the fragments it keeps, one
+ *      after the other, and checks them against the CRC32C taken
+ *      when they came in. The walk earns SCRUB_BYTES_PER_SEC of
+ *      credit and spends a fragment's size on it, so it never
+ *      takes more than its share of the disk or the cpu. A new
+ *      pass waits SCRUB_PASS_INTERVAL_MS after the last one began.
+ *
+ *      A copy that fails is reported to the index with
+ *      REPAIR_FRAGMENT. The index has another holder send its
+ *      copy over (a DECLARE_FRAG flagged `repair`), the damaged
+ *      one is replaced once the new bytes check out.
+ *
+ *      Fragments stored before checksums were kept are skipped.
+ *      Erasure coded fragments have no other copy to take, they
+ *      stay damaged. A GET refuses one on its checksum and sends
+ *      the index a REFETCH_FRAGMENT, which has a parity fragment
+ *      sent in its place, the gatherer rebuilds it from that.
+ */
+
+static Address *scrub_addr_of(Server *sv, node_id_t node)
+{
+  if (node == sv->index.node_id) return &sv->index.ip;
+
+  return sv->index_data->peer_ips + node - 1; // nodes start at index 1
+}
+
+// the fragment still is what came in
+static bool scrub_verify(const xFileFragment *frag)
+{
+  char *unpacked = NULL;
+  const char *bytes = xfileserver_fragment_bytes(frag, &unpacked);
+
+  bool ok = bytes != NULL && xcrc32c(0, bytes, frag->fragment_size) == frag->crc;
+
+  xslab_free(unpacked);
+
+  return ok;
+}
+
+static void scrub_report(Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, uint32_t file_id, uint8_t frag_id)
+{
+  if (server_is_index(sv)) {
+    xprocedure_repair_fragment(sv, fs, fnetidx, file_id, frag_id, sv->me.node_id);
+    return;
+  }
+
+  // no waiting on a dial from IDLE, the next pass reports it again
+  if (!server_try_index(sv)) {
+    printf("[SCRUB] : INDEX IS NOT REACHABLE, FRAG #%d OF FILE #%u STAYS DAMAGED FOR NOW.\n", frag_id, file_id);
+    return;
+  }
+
+  // nothing comes back, the good copy just shows up
+  xPacket p = xpacket_new(sv, TYPE_REPAIR_FRAGMENT);
+  p.bytes.comm.content.repair_fragment.file_id = file_id;
+  p.bytes.comm.content.repair_fragment.frag_id = frag_id;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  server_send_to_index(sv, &p);
+}
+
+/**
+ *  Checks as many kept fragments as the rate allows right now
+ * ------------------------------------------------------------
+ */
+void xprocedure_scrub( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xScrubber *s )
+{
+  if (SCRUB_BYTES_PER_SEC == 0) return;
+
+  uint64_t now = current_millis();
+
+  if (s->last_ms == 0) s->last_ms = now;
+
+  // resting between passes
+  if (now < s->next_ms) {
+    s->last_ms = now;
+    return;
+  }
+
+  if (s->file == 0 && s->slot == 0) s->started_ms = now;
+
+  s->credit += (int64_t)(now - s->last_ms) * SCRUB_BYTES_PER_SEC / 1000;
+  s->last_ms = now;
+
+  // no bursts after a long busy stretch
+  if (s->credit > SCRUB_BYTES_PER_SEC) s->credit = SCRUB_BYTES_PER_SEC;
+
+  while (s->credit > 0) {
+    if (s->file >= fs->file_count) {
+      if (s->checked > 0) printf("[SCRUB] : PASS DONE, %lu FRAGMENTS CHECKED, %lu DAMAGED.\n", s->checked, s->damaged);
+
+      s->file    = 0;
+      s->slot    = 0;
+      s->checked = 0;
+      s->damaged = 0;
+      s->next_ms = s->started_ms + SCRUB_PASS_INTERVAL_MS;
+      return;
+    }
+
+    xFileContainer *fc = fs->files[s->file];
+
+    if (s->slot >= fc->held) {
+      s->file++;
+      s->slot = 0;
+      continue;
+    }
+
+    const xFileFragment *frag = fc->fragments + s->slot++;
+
+    if (!frag->checked) continue;
+
+    s->credit -= frag->fragment_size;
+    s->checked++;
+
+    if (scrub_verify(frag)) continue;
+
+    s->damaged++;
+
+    printf("[SCRUB] : FRAG #%d OF FILE #%u FAILED ITS CHECKSUM, ASKING FOR A GOOD COPY.\n", frag->fragment_id, fc->file_id);
+
+    scrub_report(sv, fs, fnetidx, fc->file_id, frag->fragment_id);
+  }
+}
+
+/**
+ *  Index side of a REPAIR_FRAGMENT: another holder of the
+ *  fragment sends its copy to `damaged`.
+ * ------------------------------------------------------------
+ *  Returns 1 if some holder took the job.
+ */
+int xprocedure_repair_fragment( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, uint32_t file_id, uint8_t frag_id, node_id_t damaged )
+{
+  xFileInNetwork *f = xfilenetindex_find_file(fnetidx, file_id);
+  int replicas = f ? xfilenetindex_replicas(f) : 0;
+
+  if (f == NULL || frag_id == 0 || frag_id > f->total_fragments / replicas) {
+    printf("[REPAIR] : NO FRAG #%d OF FILE #%u IN THE INDEX.\n", frag_id, file_id);
+    return 0;
+  }
+
+  for (int j = 0; j < replicas; j++) {
+    node_id_t holder = f->fragments[(frag_id - 1) * replicas + j].node_id;
+
+    if (holder == 0 || holder == damaged || !server_is_valid_node(sv, holder)) continue;
+
+    printf("[REPAIR] : NODE #%lu SENDS FRAG #%d OF FILE #%u TO NODE #%lu.\n", holder, frag_id, file_id, damaged);
+
+    int r = holder == sv->me.node_id
+      ? xprocedure_send_fragment(sv, fs, file_id, frag_id, damaged, scrub_addr_of(sv, damaged), true)
+      : xprocedure_send_request_fragment(sv, holder, scrub_addr_of(sv, holder), file_id, frag_id, damaged, scrub_addr_of(sv, damaged), true);
+
+    if (r > 0) return 1;
+  }
+
+  printf("[REPAIR] : NO OTHER HOLDER OF FRAG #%d OF FILE #%u, IT STAYS DAMAGED.\n", frag_id, file_id);
+  return 0;
+}
+
+/**
+ *  Index side of a REFETCH_FRAGMENT: the copy a GET got from
+ *  `rf->holder` is damaged, someone else sends `deliver_to` one.
+ * ------------------------------------------------------------
+ *  A replicated fragment comes from another live holder, a coded
+ *  one is replaced by a fragment past the `data` ones the GET
+ *  first asked for, parity the gatherer rebuilds it with. Every
+ *  ask of the same GET starts `rf->attempt` holders further so
+ *  two damaged copies don't bounce the job between them.
+ *
+ *  Returns 1 if some holder took the job.
+ */
+int xprocedure_refetch_fragment( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xRefetchFragment *rf, node_id_t deliver_to )
+{
+  xFileInNetwork *f = xfilenetindex_find_file(fnetidx, rf->file_id);
+  int replicas = f ? xfilenetindex_replicas(f) : 0;
+
+  if (f == NULL || rf->frag_id == 0 || rf->frag_id > (uint64_t)(f->total_fragments / replicas)) {
+    printf("[REFETCH] : NO FRAG #%lu OF FILE #%lu IN THE INDEX.\n", rf->frag_id, rf->file_id);
+    return 0;
+  }
+
+  xFragmentNetworkPointer **spare = calloc(f->total_fragments, sizeof(xFragmentNetworkPointer *));
+  if (spare == NULL) return 0;
+
+  int n = 0;
+
+  if (f->parity) {
+    // the GET took the first `data` live ones, same walk as the index's
+    int skip = f->total_fragments - f->parity;
+
+    for (uint64_t i = 0; i < f->total_fragments; i++) {
+      xFragmentNetworkPointer *frag = f->fragments + i;
+
+      if (!server_is_valid_node(sv, frag->node_id)) continue;
+      if (skip > 0) { skip--; continue; }
+      if (frag->node_id != rf->holder) spare[n++] = frag;
+    }
+  }
+  else {
+    for (int j = 0; j < replicas; j++) {
+      xFragmentNetworkPointer *frag = f->fragments + (rf->frag_id - 1) * replicas + j;
+
+      if (server_is_valid_node(sv, frag->node_id) && frag->node_id != rf->holder) spare[n++] = frag;
+    }
+  }
+
+  Address *to = scrub_addr_of(sv, deliver_to);
+  int r = 0;
+
+  for (int k = 0; k < n && r <= 0; k++) {
+    xFragmentNetworkPointer *frag = spare[(rf->attempt + k) % n];
+
+    printf("[REFETCH] : NODE #%lu SENDS FRAG #%d OF FILE #%lu TO NODE #%lu.\n", frag->node_id, frag->fragment, rf->file_id, deliver_to);
+
+    if (frag->node_id == deliver_to) r = xprocedure_send_use_local(sv, frag->fragment, deliver_to, to);
+    else if (frag->node_id == sv->me.node_id) r = xprocedure_send_fragment(sv, fs, rf->file_id, frag->fragment, deliver_to, to, false);
+    else r = xprocedure_send_request_fragment(sv, frag->node_id, scrub_addr_of(sv, frag->node_id), rf->file_id, frag->fragment, deliver_to, to, false);
+  }
+
+  if (r <= 0) printf("[REFETCH] : NOBODY ELSE CAN SEND FRAG #%lu OF FILE #%lu.\n", rf->frag_id, rf->file_id);
+
+  free(spare);
+
+  return r > 0;
+}
+
+/**
+ *  Takes a good copy announced with a `repair` DECLARE_FRAG, it
+ *  replaces the damaged one we keep.
+ * ------------------------------------------------------------
+ *  Returns 1 if the fragment was replaced.
+ */
+int xprocedure_receive_repair( Server *sv, xFileServer *fs, int fd, const xDeclareFragmentTransport *d )
+{
+  xFileContainer *fc = xfileserver_find_file(fs, d->file_id);
+  xFileFragment *had = xfileserver_get_fragment(fc, d->frag_id);
+
+  bool packed = d->codec != LZ_CODEC_NONE;
+
+  if (had == NULL || d->frag_size != had->fragment_size || (packed ? d->wire_size > d->frag_size : d->wire_size != d->frag_size)) {
+    printf("[REPAIR] : FRAG #%lu OF FILE #%lu IS NOT ONE WE KEEP.\n", d->frag_id, d->file_id);
+    server_send_not_ok(sv, fd);
+    return 0;
+  }
+
+  // what it was when it first came in, the sender's word otherwise
+  uint32_t expect = had->checked ? had->crc : d->crc;
+  bool check      = had->checked || d->checked;
+
+  char *wire  = xslab_alloc(d->wire_size);
+  char *bytes = packed ? xslab_alloc(d->frag_size) : wire;
+
+  if (wire == NULL || bytes == NULL) {
+    if (bytes != wire) xslab_free(bytes);
+    xslab_free(wire);
+    server_send_not_ok(sv, fd);
+    return 0;
+  }
+
+  server_send_ok(sv, fd);
+
+  bool ok = server_read_raw(sv, fd, wire, d->wire_size) == (int)d->wire_size;
+
+  if (ok && packed) ok = xlz_unpack(wire, d->wire_size, bytes, d->frag_size);
+  if (packed) xslab_free(wire);
+
+  uint32_t crc = ok ? xcrc32c(0, bytes, d->frag_size) : 0;
+
+  if (ok && check && crc != expect) {
+    printf("[REPAIR] : THE NEW COPY OF FRAG #%lu IS DAMAGED TOO (CRC %08x, WANT %08x).\n", d->frag_id, crc, expect);
+    ok = false;
+  }
+
+  if (ok && xfileserver_adopt_fragment(fs, fc, d->frag_id, bytes, d->frag_size, crc) != FRAG_OK) ok = false;
+
+  if (!ok) {
+    xslab_free(bytes);
+    server_send_not_ok(sv, fd);
+    return 0;
+  }
+
+  printf("[REPAIR] : FRAG #%lu OF FILE #%lu REPLACED.\n", d->frag_id, d->file_id);
+
+  server_send_ok(sv, fd);
+  return 1;
+}
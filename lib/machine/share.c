@@ -0,0 +1,134 @@
+#include "statemachine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Content addressed fragments (FRAGMENT_DEDUP)
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Before a buffered upload fans out, the index hashes each
+ *      fragment. One whose bytes were placed before, for another
+ *      file, is not sent: its replica slots take the holders of
+ *      the first copy and every holder gets a SHARE_FRAGMENT, so
+ *      it keeps the new fragment as a reference to bytes it has.
+ *
+ *      Holders that refuse (they lost the bytes) are left out,
+ *      if none takes it the fragment goes out as usual.
+ *
+ *      Repeats inside the same file are sent, their first copy
+ *      is not on any holder yet.
+ */
+
+// asks `holder` to keep fragment `frag_id` of fc as a copy of src's
+static bool share_on(Server *sv, xFileServer *fs, xFileContainer *fc, uint8_t frag_id, node_id_t holder, const xDedupEntry *src)
+{
+  if (holder == sv->me.node_id) {
+    xFileContainer *from = xfileserver_find_file(fs, src->file_id);
+    return xfileserver_share_fragment(fs, fc, frag_id, from, src->fragment_id) == FRAG_OK;
+  }
+
+  Address *a = sv->index_data->peer_ips + holder - 1; // nodes start at index 1
+
+  int fd = server_pool_get(sv, holder, a);
+  if (fd < 0) return false;
+
+  xShareFragment sh = {0};
+
+  memcpy(sh.file_name, fc->file_name, sizeof(sh.file_name));
+  sh.file_size            = fc->size;
+  sh.file_id              = fc->file_id;
+  sh.fragment_count_total = fc->fragment_count_total;
+  sh.frag_id              = frag_id;
+  sh.source_file_id       = src->file_id;
+  sh.source_frag_id       = src->fragment_id;
+
+  xPacket p = xpacket_new(sv, TYPE_SHARE_FRAGMENT);
+  p.bytes.comm.content.share_fragment = sh;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  if (server_send_to_socket(sv, &p, fd) <= 0 || !server_wait_ok(sv, fd)) {
+    printf("[DEDUP] : NODE #%lu DID NOT SHARE FRAG #%d.\n", holder, frag_id);
+    server_pool_fail(sv, fd);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ *  Shares every fragment of `f` whose bytes are already placed.
+ * ------------------------------------------------------------
+ *  Returns the replicas confirmed that way, `expected` gets how
+ *  many were asked for. Shared slots are flagged, fanout skips
+ *  them. Erasure coded files neither share nor get shared, their
+ *  fragments have a single holder each.
+ */
+int xprocedure_share_duplicates( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xFileContainer *fc, xFileInNetwork *f, const char *buffer, int *expected )
+{
+  xDedupTable *t = fnetidx->dedup;
+  *expected = 0;
+
+  if (t == NULL || f->parity) return 0;
+
+  int count     = f->total_fragments / REDUNDANCY;
+  uint64_t base = fc->size / count;
+  int confirmed = 0;
+
+  for (int k = 1; k <= count; k++) {
+    xFragmentNetworkPointer *slots = f->fragments + (k - 1) * REDUNDANCY;
+
+    xDedupKey key = xdedup_key(buffer + base * (k - 1), slots[0].size);
+    xDedupEntry *e = xdedup_find(t, &key);
+
+    if (e == NULL) {
+      xdedup_insert(t, &key, fc->file_id, k);
+      continue;
+    }
+
+    if (e->file_id == fc->file_id) continue;
+
+    xFileInNetwork *src = xfilenetindex_find_file(fnetidx, e->file_id);
+    if (src == NULL) continue;
+
+    xFragmentNetworkPointer shared[REDUNDANCY];
+    int asked = 0, kept = 0;
+
+    for (int j = 0; j < REDUNDANCY; j++) {
+      xFragmentNetworkPointer from = src->fragments[(e->fragment_id - 1) * REDUNDANCY + j];
+
+      memset(shared + j, 0, sizeof(xFragmentNetworkPointer));
+      shared[j].fragment = k;
+      shared[j].size     = slots[j].size;
+      shared[j].shared   = 1;
+
+      if (from.node_id == 0) continue;
+
+      asked++;
+
+      if (share_on(sv, fs, fc, k, from.node_id, e)) {
+        shared[j].node_id = from.node_id;
+        kept++;
+      }
+    }
+
+    // nobody has those bytes anymore, send them after all
+    if (kept == 0) continue;
+
+    memcpy(slots, shared, sizeof(shared));
+
+    e->refs++;
+    t->shared++;
+    t->shared_bytes += key.size;
+
+    *expected += asked;
+    confirmed += kept;
+
+    printf("[DEDUP] : FRAG #%d OF FILE #%u IS FRAG #%d OF FILE #%u, %d OF %d HOLDERS SHARE IT.\n", k, fc->file_id, e->fragment_id, e->file_id, kept, asked);
+  }
+
+  if (*expected > 0) xprocedure_index_changed(sv, fs, fnetidx, f);
+
+  return confirmed;
+}
@@ -0,0 +1,314 @@
+#include "statemachine.h"
+#include "../defines.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Hot standby index
+ * ------------------------------------------------------------
+ *  Notes:
+ *      The index picks its ring predecessor as standby, dials it
+ *      on a connection of its own and sends it the peer table and
+ *      every file entry. Only then is the standby announced around
+ *      the ring with PRESENT_STANDBY, the way the index is.
+ *
+ *      From there on every entry the index changes goes to the
+ *      standby as it is logged (xprocedure_index_changed). The
+ *      standby keeps it in its own network index, and in its own
+ *      log if it has a data dir.
+ *
+ *      Updates are numbered from the peer table on. A standby
+ *      that misses one, or can't apply one, drops the connection.
+ *      The index notices from IDLE and syncs it again from scratch.
+ *
+ *      Whenever the index loses its standby (dropped mirror, a
+ *      failed update, the node died) it announces standby #0
+ *      around the ring. Until a new one is synced and announced
+ *      nobody takes over, an index dying meanwhile sends the ring
+ *      back to BEGIN_OPERATION as it would without a standby.
+ *
+ *      When the index dies every node hears it from the ring and
+ *      takes the standby as the index, nobody starts over with a
+ *      presentation and a report of all it keeps. The new index
+ *      picks a standby of its own.
+ *
+ *      Loads are not mirrored, nodes report theirs again within
+ *      LOAD_REPORT_INTERVAL_MS. Neither are FRAGMENT_DEDUP hashes,
+ *      the new index only finds duplicates of what it places.
+ *      Uploads the index was taking when it died are lost.
+ */
+
+static void standby_lost(Server *sv)
+{
+  printf("[STANDBY] : LOST NODE #%lu, ANOTHER ONE IN %dms.\n", sv->standby.node_id, STANDBY_RETRY_MS);
+
+  if (sv->standby.stream_fd >= 0) server_close_socket(sv, sv->standby.stream_fd);
+
+  sv->standby.node_id     = 0;
+  sv->standby.stream_fd   = -1;
+  sv->standby.status.open = false;
+
+  sv->standby_retry_at = current_millis() + STANDBY_RETRY_MS;
+
+  // nobody may take over with what it had, PRESENT_STANDBY of node 0
+  xPacket p = xpacket_standby_presentation(sv);
+  server_send_to_peer_f(sv, &p);
+}
+
+// one update, the index forgets the standby if it can't take it
+static int standby_send(Server *sv, uint8_t kind, uint64_t count, const void *a, size_t an, const void *b, size_t bn)
+{
+  int fd = sv->standby.stream_fd;
+
+  xPacket p = xpacket_new(sv, TYPE_INDEX_MIRROR);
+  p.bytes.comm.content.index_mirror.kind  = kind;
+  p.bytes.comm.content.index_mirror.size  = an + bn;
+  p.bytes.comm.content.index_mirror.count = count;
+  p.bytes.comm.content.index_mirror.seq   = ++sv->standby_seq;
+  p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+  int ok = server_send_to_socket(sv, &p, fd) > 0
+        && tcp_send(fd, a, an) > 0
+        && (bn == 0 || tcp_send(fd, b, bn) > 0);
+
+  if (!ok) standby_lost(sv);
+
+  return ok;
+}
+
+static int standby_send_file(Server *sv, xFileServer *fs, const xFileInNetwork *f)
+{
+  xIndexLogEntry e;
+  size_t ptrs = xindexlog_entry(xfileserver_find_file(fs, f->file_id), f, &e);
+
+  return standby_send(sv, MIRROR_FILE, 0, &e, sizeof(e), f->fragments, ptrs);
+}
+
+// the standby never writes on the mirror, anything there means it dropped it
+static bool standby_dropped(Server *sv)
+{
+  struct pollfd pfd = { .fd = sv->standby.stream_fd, .events = POLLIN };
+
+  return poll(&pfd, 1, 0) > 0 && pfd.revents != 0;
+}
+
+// the first live node before us in the ring, 0 if we are alone
+static node_id_t standby_pick(Server *sv)
+{
+  node_id_t ring = sv->net_size + sv->death_count; // original count
+
+  for (node_id_t k = 1; k < ring; k++) {
+    node_id_t n = (sv->me.node_id - 1 + ring - k) % ring + 1;
+
+    if (server_is_valid_node(sv, n)) return n;
+  }
+
+  return 0;
+}
+
+/**
+ *  Logs a file's entry as it is now and mirrors it to the
+ *  standby. Every change of the index goes through here.
+ * ------------------------------------------------------------
+ */
+void xprocedure_index_changed( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xFileInNetwork *f )
+{
+  xindexlog_record(fnetidx, fs, f);
+
+  if (f != NULL && server_is_index(sv) && sv->standby.status.open) standby_send_file(sv, fs, f);
+}
+
+/**
+ *  Index side, sets a standby up when there is none or the one
+ *  there is fell out of step
+ * ------------------------------------------------------------
+ *  Returns 1 if one was synced and announced.
+ */
+int xprocedure_standby_designate( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx )
+{
+  if (!STANDBY_INDEX || !server_is_index(sv)) return 0;
+
+  if (sv->standby.status.open) {
+    if (!standby_dropped(sv)) return 0;
+
+    printf("[STANDBY] : NODE #%lu DROPPED THE MIRROR.\n", sv->standby.node_id);
+    standby_lost(sv);
+  }
+
+  uint64_t now = current_millis();
+  if (now < sv->standby_retry_at) return 0;
+
+  sv->standby_retry_at = now + STANDBY_RETRY_MS;
+
+  node_id_t n = standby_pick(sv);
+  if (n == 0) return 0;
+
+  Address *a = sv->index_data->peer_ips + n - 1; // nodes start at index 1
+
+  int fd = server_dial_presented(sv, a);
+  if (fd < 0) {
+    printf("[STANDBY] : NODE #%lu IS NOT REACHABLE.\n", n);
+    return 0;
+  }
+
+  sv->standby.node_id   = n;
+  sv->standby.ip        = *a;
+  sv->standby.stream_fd = fd;
+
+  // the whole index, then only what changes
+  size_t ring = sv->net_size + sv->death_count; // original count
+
+  sv->standby_seq = 0;
+
+  if (!standby_send(sv, MIRROR_PEERS, sv->index_data->known_peers, sv->index_data->peer_ips, ring * sizeof(Address), NULL, 0)) return 0;
+
+  for (uint32_t i = 0; i < fnetidx->table_size; i++) {
+    if (fnetidx->table[i].file_id == 0) continue;
+
+    if (!standby_send_file(sv, fs, fnetidx->table[i].file)) return 0;
+  }
+
+  sv->standby.status.open = true;
+
+  printf("[STANDBY] : NODE #%lu HAS THE INDEX, %u FILES.\n", n, fnetidx->file_count);
+
+  xPacket p = xpacket_standby_presentation(sv);
+  server_send_to_peer_f(sv, &p);
+
+  return 1;
+}
+
+/**
+ *  A PRESENT_STANDBY coming around the ring, kept and passed on.
+ *  Standby #0 means the index has none right now.
+ * ------------------------------------------------------------
+ */
+void xprocedure_standby_announced( Server *sv, xPacket *p )
+{
+  xStandbyPresentation a = p->bytes.comm.content.standby_presentation;
+
+  // back where it started
+  if (server_is_index(sv)) return;
+
+  if (a.index_id == sv->index.node_id) {
+    if (a.standby_id == 0) printf("[STANDBY] : INDEX #%lu HAS NO STANDBY FOR NOW.\n", a.index_id);
+    else printf("[STANDBY] : NODE #%lu TAKES OVER IF INDEX #%lu DIES.\n", a.standby_id, a.index_id);
+
+    sv->standby.node_id = a.standby_id;
+    sv->standby.ip      = a.standby_addr;
+  }
+
+  if (sv->peer_f.node_id != a.index_id) {
+    p->bytes.comm.sender_id = sv->me.node_id;
+    server_send_to_peer_f(sv, p);
+  }
+}
+
+/**
+ *  A node died, the index needs another standby if it was this one
+ * ------------------------------------------------------------
+ */
+void xprocedure_standby_forget( Server *sv, node_id_t dead )
+{
+  if (dead == 0 || dead != sv->standby.node_id) return;
+
+  if (server_is_index(sv)) {
+    standby_lost(sv);
+    return;
+  }
+
+  sv->standby.node_id = 0;
+}
+
+// the index syncs us again once it sees the connection gone
+static int standby_refuse(Server *sv, int fd, char *body)
+{
+  xslab_free(body);
+  server_close_socket(sv, fd);
+
+  if (fd == sv->standby.stream_fd) sv->standby.stream_fd = -1;
+
+  return 0;
+}
+
+/**
+ *  Standby side of INDEX_MIRROR, `fd` is the index's connection
+ * ------------------------------------------------------------
+ *  Returns 1 if the update was applied. If not, the connection
+ *  is dropped and the index starts over.
+ */
+int xprocedure_standby_receive( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xPacket *p, int fd )
+{
+  xIndexMirror m = p->bytes.comm.content.index_mirror;
+
+  if (m.size == 0 || m.size > INDEX_LOG_MAX_RECORD) {
+    printf("[STANDBY] : MIRROR OF %u BYTES, DROPPING THE CONNECTION.\n", m.size);
+    return standby_refuse(sv, fd, NULL);
+  }
+
+  char *body = xslab_alloc(m.size);
+
+  if (body == NULL || server_read_raw(sv, fd, body, m.size) != (int)m.size) {
+    printf("[STANDBY] : MIRROR ENDED EARLY.\n");
+    return standby_refuse(sv, fd, body);
+  }
+
+  // an old index that did not know it was replaced
+  if (p->bytes.comm.sender_id != sv->index.node_id) {
+    printf("[STANDBY] : MIRROR FROM NODE #%lu, WHICH IS NOT THE INDEX.\n", p->bytes.comm.sender_id);
+    return standby_refuse(sv, fd, body);
+  }
+
+  // a sync starts with the peer table, updates follow it one by one on its connection
+  bool starts = m.kind == MIRROR_PEERS && m.seq == 1;
+
+  if (!starts && (fd != sv->standby.stream_fd || m.seq != sv->standby_seq + 1)) {
+    printf("[STANDBY] : MIRROR UPDATE #%u OUT OF STEP, LAST WAS #%u.\n", m.seq, sv->standby_seq);
+    return standby_refuse(sv, fd, body);
+  }
+
+  int ok = 0;
+
+  switch (m.kind) {
+  case MIRROR_FILE: {
+    const xIndexLogEntry *e = (const xIndexLogEntry *)body;
+
+    if (m.size < sizeof(xIndexLogEntry) || m.size != sizeof(xIndexLogEntry) + e->total_fragments * sizeof(xFragmentNetworkPointer)) break;
+
+    xFileInNetwork *f = xindexlog_apply(fs, fnetidx, e, (const xFragmentNetworkPointer *)(body + sizeof(xIndexLogEntry)));
+
+    if (f != NULL) xindexlog_record(fnetidx, fs, f);
+
+    ok = f != NULL;
+    break;
+  }
+
+  case MIRROR_PEERS: {
+    size_t ring = (sv->net_size + sv->death_count) * sizeof(Address); // original count
+
+    memcpy(sv->index_data->peer_ips, body, m.size < ring ? m.size : ring);
+    sv->index_data->known_peers = m.count;
+
+    ok = 1;
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  if (!ok) {
+    printf("[STANDBY] : MIRROR OF KIND %d NOT APPLIED.\n", m.kind);
+    return standby_refuse(sv, fd, body);
+  }
+
+  if (starts) sv->standby.stream_fd = fd;
+  sv->standby_seq = m.seq;
+
+  xslab_free(body);
+
+  return ok;
+}
@@ -4,11 +4,125 @@
 
 #include "../server/server.h"
 #include "../fileserver/fs.h"
+#include "../memory/slab.h"
 
 
 void server_healthcheck(Server *sv);
 
 
+// ------------------------------------------------------------ 
+typedef enum eFanoutPhase {
+  FANOUT_QUEUED = 0,
+  FANOUT_ANNOUNCED,       // STORE_FRAGMENT sent, waiting holder's OK
+  FANOUT_STREAMING,       // raw bytes going out
+  FANOUT_STORING,         // all sent, waiting holder to keep it
+  FANOUT_DONE,
+  FANOUT_FAILED,
+} eFanoutPhase;
+
+typedef struct xFanoutTransfer {
+  node_id_t node_id;
+  int fd;
+  int ptr_index;
+
+  xFragmentNetworkPointer frag;
+  uint64_t offset;                    // of the fragment inside the file
+  size_t sent;
+  char *staged;                       // slab copy for a holder that can't take it yet
+
+  eFanoutPhase phase;
+
+  uint8_t   chain_len;                // holders after this one
+  node_id_t chain[REDUNDANCY];        // whole chain, [0] is this target
+  uint8_t   stored;                   // replicas confirmed by the head
+  uint32_t  crc;                      // of what was written, the head must report the same
+  bool      corrupt;                  // it did not, its copy is sent again
+  bool      resent;                   // this is that second try
+  bool      settled;                  // counted, missing replicas requeued
+} xFanoutTransfer;
+
+// every transfer of one file, fed the whole buffer or window by window
+typedef struct xFanout {
+  xFileContainer *fc;
+  xFileInNetwork *f;
+  const char *buffer;                 // whole file, NULL while streaming
+
+  xErasureShape shape;                // where each fragment lies, parity included
+  node_id_t deferred;                 // relaying this upload, keeps its data fragments itself
+
+  xFanoutTransfer *t;
+  int n;
+  int capacity;
+
+  int confirmed;
+  int expected;
+  uint64_t stalled_since;
+} xFanout;
+
+
+// ------------------------------------------------------------ 
+// A fragment this node passes on to its peer_f
+typedef struct xChainForward {
+  bool active;
+
+  int upstream_fd;                    // who gets our FRAG_STORED
+  node_id_t next;
+  int fd;                             // pooled fd to next, -1 until dialed
+  bool announced;                     // STORE_FRAGMENT went downstream
+
+  xRequestFragmentCreation fragc;     // as forwarded
+
+  const char *bytes;
+  bool held;                          // bytes are a retained slab block, let go when done
+  size_t received;                    // what we hold so far
+  size_t sent;
+
+  bool stored;                        // our own copy is kept
+  uint32_t crc;                       // of our copy, downstream must report the same
+  bool accepted;                      // downstream OK'ed the announce
+  bool broken;                        // downstream lost mid stream
+} xChainForward;
+
+typedef struct xChainQueue {
+  xChainForward *jobs;
+  int count;
+  int capacity;
+} xChainQueue;
+
+
+// ------------------------------------------------------------ 
+// Where the background checksum pass is, see scrub.c
+typedef struct xScrubber {
+  uint32_t file;                      // position in the file server's files
+  uint8_t  slot;                      // next held fragment of it
+  uint64_t last_ms;
+  uint64_t started_ms;                // this pass
+  uint64_t next_ms;                   // resting until then
+  int64_t  credit;                    // bytes it may check right now
+
+  uint64_t checked;                   // this pass
+  uint64_t damaged;
+} xScrubber;
+
+// ------------------------------------------------------------ 
+// What the last load report counted from, see xprocedure_report_load
+typedef struct xLoadReporter {
+  uint64_t last_ms;
+  uint64_t bytes_in;                  // the file server's counters then
+  uint64_t bytes_out;
+} xLoadReporter;
+
+// ------------------------------------------------------------ 
+// Data fragments the node relaying an upload keeps, see ingest.c
+typedef struct xRelayKeep {
+  xFileContainer *file;
+  xKeptFragment *frags;               // the index's list, `count` of them
+  uint16_t count;
+  char **bytes;                       // filled as the upload goes by
+  uint32_t *crc;
+} xRelayKeep;
+
+
 
 node_id_t xprocedure_wait_identification(Server *sv, int c);
 
@@ -20,17 +134,60 @@ node_id_t xprocedure_wait_identification(Server *sv, int c);
 
 void xprocedure_check_peer_b(Server *sv, xFileInNetwork *fni); 
 
-int xprocedure_send_request_fragment( Server *sv, Address *to , int file_id, int fragment_id, Address *deliver_to );
+int xprocedure_send_request_fragment( Server *sv, node_id_t holder, Address *to , int file_id, int fragment_id, node_id_t deliver_node, Address *deliver_to, bool repair );
+
+int xprocedure_send_use_local( Server *sv, int fragment_id, node_id_t deliver_node, Address *deliver_to ) ;
+
+int xprocedure_send_fragment( Server *sv, xFileServer *fs, int file_id, int fragment_id, node_id_t deliver_node, Address *deliver_to, bool repair ) ;
+
+
 
-int xprocedure_send_use_local( Server *sv, int fragment_id, Address *deliver_to ) ;
 
-int xprocedure_send_fragment( Server *sv, xFileServer *fs, int file_id, int fragment_id, Address *deliver_to ) ;
+int xprocedure_fanout( Server *sv, xFileContainer *fc, xFileInNetwork *f, char *buffer, int *expected );
+xFanout *xprocedure_fanout_begin( Server *sv, xFileContainer *fc, xFileInNetwork *f, const char *buffer, node_id_t deferred );
+void xprocedure_fanout_window( Server *sv, xFanout *fo, const char *window, uint64_t base, size_t len );
+int  xprocedure_fanout_end( Server *sv, xFanout *fo, int *expected );
+void xprocedure_fanout_abort( Server *sv, xFanout *fo );
 
+int xprocedure_gather( Server *sv, xFileServer *fs );
 
+int xprocedure_share_duplicates( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xFileContainer *fc, xFileInNetwork *f, const char *buffer, int *expected );
 
+node_id_t xprocedure_place_winner( Server *sv, uint32_t file_id, uint32_t frag, uint64_t size );
+xFileInNetwork *xprocedure_place_file( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const char *name, uint64_t sz, xFileContainer **out );
+int xprocedure_ingest( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const char *name, uint64_t sz, int client_fd, node_id_t relayed_by );
+void xprocedure_relay_keep_begin( Server *sv, xFileServer *fs, const xRequestFileCreation *fc, xRelayKeep *k );
+void xprocedure_relay_keep_window( xRelayKeep *k, const char *window, uint64_t base, size_t len );
+void xprocedure_relay_keep_end( Server *sv, xFileServer *fs, xRelayKeep *k, bool complete );
 
-int xprocedure_save_file_to_index( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xReportFileKnowledge *r, int c);
+int  xprocedure_chain_begin( Server *sv, xChainQueue *q, xRequestFragmentCreation *fragc, int upstream_fd );
+void xprocedure_chain_attach( xChainQueue *q, int job, const char *bytes );
+void xprocedure_chain_hold( xChainQueue *q, int job, char *bytes );
+void xprocedure_chain_pump( Server *sv, xChainQueue *q, int job, size_t received );
+void xprocedure_chain_stored( Server *sv, xChainQueue *q, int job, bool ok, uint32_t crc );
+void xprocedure_chain_run( Server *sv, xChainQueue *q );
+bool xprocedure_chain_owns( xChainQueue *q, int fd );
+
+void xprocedure_scrub( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xScrubber *s );
+int  xprocedure_repair_fragment( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, uint32_t file_id, uint8_t frag_id, node_id_t damaged );
+int  xprocedure_refetch_fragment( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xRefetchFragment *rf, node_id_t deliver_to );
+int  xprocedure_receive_repair( Server *sv, xFileServer *fs, int fd, const xDeclareFragmentTransport *d );
+
+xFragmentNetworkPointer *xprocedure_file_report( Server *sv, const xFileContainer *fc, xReportFileKnowledge *out );
+int xprocedure_save_file_to_index( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xReportFileKnowledge *r, const xFragmentNetworkPointer *held, int c);
 
 int xprocedure_peer_died( Server *sv ) ;
 
+int xprocedure_send_fragment_map( Server *sv, xFileNetworkIndex *fnetidx, const xFileContainer *fc, int fd );
+int xprocedure_relay_fragment_map( Server *sv, xPacket *res, int fd );
+int xprocedure_read_fragment( Server *sv, xFileServer *fs, const xReadFragment *r, int fd );
+
+void xprocedure_report_load( Server *sv, xFileServer *fs, const xChainQueue *chain, xLoadReporter *rep );
+
+void xprocedure_index_changed( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xFileInNetwork *f );
+int  xprocedure_standby_designate( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx );
+void xprocedure_standby_announced( Server *sv, xPacket *p );
+void xprocedure_standby_forget( Server *sv, node_id_t dead );
+int  xprocedure_standby_receive( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, const xPacket *p, int fd );
+
 #endif
@@ -0,0 +1,289 @@
+#include "slab.h"
+#include "../defines.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  Size classed allocator for fragment bytes and request buffers
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Every request is rounded up to a power of two class. A
+ *      freed block goes on its class' free list and serves the
+ *      next allocation of that class, so upload after upload
+ *      reuses the same blocks instead of fragmenting the heap.
+ *
+ *      Classes up to SLAB_CARVE_MAX are carved out of shared
+ *      chunks, those are kept for good. Bigger blocks are their
+ *      own malloc, cached up to SLAB_CACHE_LIMIT and given back
+ *      past it or on xslab_trim().
+ *
+ *      The server is single threaded, so is this.
+ */
+
+#define SLAB_LARGE      ( 0xff )
+#define SLAB_MAGIC_LIVE ( 0x51ab )
+#define SLAB_MAGIC_FREE ( 0xdead )
+
+// sits right before the bytes handed out, keeps them 16 aligned
+typedef struct xSlabHeader {
+    uint64_t size;              // asked for
+    uint8_t  cls;
+    uint8_t  carved;
+    uint16_t magic;
+    uint32_t refs;              // owners besides the first, see xslab_retain
+} xSlabHeader;
+
+static xSlabClass classes[SLAB_CLASS_COUNT];
+static bool ready = false;
+
+static char  *chunk      = NULL;
+static size_t chunk_left = 0;
+
+static xSlabStats stats;
+
+// -----------------------------------------------------------------------------
+// Classes, the free list link lives in the block's own bytes
+// -----------------------------------------------------------------------------
+static void slab_init(void) {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        memset(&classes[i], 0, sizeof(xSlabClass));
+        classes[i].size = (size_t)1 << (SLAB_MIN_SHIFT + i);
+    }
+
+    memset(&stats, 0, sizeof(xSlabStats));
+    ready = true;
+}
+
+static int slab_class_of(size_t size) {
+    int c = 0;
+
+    while (c < SLAB_CLASS_COUNT && classes[c].size < size) c++;
+
+    return c < SLAB_CLASS_COUNT ? c : SLAB_LARGE;
+}
+
+static void *slab_pop(xSlabClass *k) {
+    void *b = k->free_list;
+
+    if (b == NULL) return NULL;
+
+    k->free_list = *(void **)((xSlabHeader *)b + 1);
+    k->cached--;
+    k->reused++;
+
+    return b;
+}
+
+static void slab_push(xSlabClass *k, xSlabHeader *h) {
+    *(void **)(h + 1) = k->free_list;
+
+    k->free_list = h;
+    k->cached++;
+}
+
+// -----------------------------------------------------------------------------
+// Carves a block for a small class, the old chunk's tail is lost
+// -----------------------------------------------------------------------------
+static xSlabHeader *slab_carve(size_t stride) {
+    if (chunk_left < stride) {
+        char *c = malloc(SLAB_CHUNK_SIZE);
+        if (c == NULL) return NULL;
+
+        stats.fragmented_bytes += chunk_left;
+        stats.chunk_bytes      += SLAB_CHUNK_SIZE;
+
+        chunk      = c;
+        chunk_left = SLAB_CHUNK_SIZE;
+    }
+
+    xSlabHeader *h = (xSlabHeader *)chunk;
+
+    chunk      += stride;
+    chunk_left -= stride;
+
+    return h;
+}
+
+// -----------------------------------------------------------------------------
+// Allocate `size` bytes, never NULL for size 0
+// -----------------------------------------------------------------------------
+void *xslab_alloc(size_t size) {
+    if (!ready) slab_init();
+
+    int c = slab_class_of(size);
+    xSlabHeader *h = NULL;
+    size_t block = size;
+
+    if (c == SLAB_LARGE) {
+        h = malloc(sizeof(xSlabHeader) + size);
+        if (h == NULL) return NULL;
+
+        h->carved = 0;
+        stats.large_bytes += size;
+    }
+    else {
+        xSlabClass *k = classes + c;
+        block = k->size;
+
+        h = slab_pop(k);
+
+        if (h != NULL) {
+            stats.free_bytes -= block;
+            stats.reused++;
+        }
+        else if (block <= SLAB_CARVE_MAX) {
+            h = slab_carve(sizeof(xSlabHeader) + block);
+            if (h == NULL) return NULL;
+            h->carved = 1;
+        }
+        else {
+            h = malloc(sizeof(xSlabHeader) + block);
+            if (h == NULL) return NULL;
+            h->carved = 0;
+        }
+
+        k->live++;
+    }
+
+    h->size  = size;
+    h->cls   = (uint8_t)c;
+    h->magic = SLAB_MAGIC_LIVE;
+    h->refs  = 0;
+
+    stats.live_bytes       += size;
+    stats.block_bytes      += sizeof(xSlabHeader) + block;
+    stats.fragmented_bytes += block - size;
+    stats.allocs++;
+
+    return h + 1;
+}
+
+void *xslab_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) return NULL;
+
+    void *p = xslab_alloc(count * size);
+    if (p != NULL) memset(p, 0, count * size);
+
+    return p;
+}
+
+// -----------------------------------------------------------------------------
+// One more owner for a live block, it takes one more xslab_free to let it go
+// -----------------------------------------------------------------------------
+void *xslab_retain(void *ptr) {
+    if (ptr == NULL) return NULL;
+
+    xSlabHeader *h = (xSlabHeader *)ptr - 1;
+
+    if (h->magic != SLAB_MAGIC_LIVE) {
+        printf("[SLAB] : RETAINING %p THAT IS NOT A LIVE BLOCK.\n", ptr);
+        return NULL;
+    }
+
+    h->refs++;
+
+    return ptr;
+}
+
+// -----------------------------------------------------------------------------
+// Hand a block back, NULL is fine
+// -----------------------------------------------------------------------------
+void xslab_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    xSlabHeader *h = (xSlabHeader *)ptr - 1;
+
+    if (h->magic != SLAB_MAGIC_LIVE) {
+        printf("[SLAB] : FREEING %p THAT IS NOT A LIVE BLOCK.\n", ptr);
+        return;
+    }
+
+    // someone else still holds it
+    if (h->refs > 0) {
+        h->refs--;
+        return;
+    }
+
+    h->magic = SLAB_MAGIC_FREE;
+
+    stats.live_bytes -= h->size;
+
+    if (h->cls == SLAB_LARGE) {
+        stats.large_bytes -= h->size;
+        stats.block_bytes -= sizeof(xSlabHeader) + h->size;
+        free(h);
+        return;
+    }
+
+    xSlabClass *k = classes + h->cls;
+
+    k->live--;
+    stats.block_bytes      -= sizeof(xSlabHeader) + k->size;
+    stats.fragmented_bytes -= k->size - h->size;
+
+    if (!h->carved && stats.free_bytes + k->size > SLAB_CACHE_LIMIT) {
+        free(h);
+        return;
+    }
+
+    slab_push(k, h);
+    stats.free_bytes += k->size;
+}
+
+size_t xslab_size(const void *ptr) {
+    if (ptr == NULL) return 0;
+
+    return ((const xSlabHeader *)ptr - 1)->size;
+}
+
+// -----------------------------------------------------------------------------
+// Gives every cached block that is its own malloc back
+// -----------------------------------------------------------------------------
+void xslab_trim(void) {
+    if (!ready) return;
+
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        xSlabClass *k = classes + i;
+
+        if (k->size <= SLAB_CARVE_MAX) continue;
+
+        while (k->free_list != NULL) {
+            xSlabHeader *h = k->free_list;
+
+            k->free_list = *(void **)(h + 1);
+            k->cached--;
+
+            stats.free_bytes -= k->size;
+            free(h);
+        }
+    }
+}
+
+void xslab_stats(xSlabStats *out) {
+    if (!ready) slab_init();
+
+    *out = stats;
+}
+
+// -----------------------------------------------------------------------------
+void xslab_debug(void) {
+    if (!ready) slab_init();
+
+    printf("=== SLAB ===\n");
+    printf("Live: %lu bytes, %lu held (%lu large)\n", stats.live_bytes, stats.block_bytes, stats.large_bytes);
+    printf("Free: %lu bytes cached | Fragmented: %lu bytes | Chunks: %lu bytes\n", stats.free_bytes, stats.fragmented_bytes, stats.chunk_bytes);
+    printf("Allocations: %lu, %lu reused\n", stats.allocs, stats.reused);
+
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        xSlabClass *k = classes + i;
+
+        if (k->live == 0 && k->cached == 0) continue;
+
+        printf("  [%8zu] live=%lu cached=%lu reused=%lu\n", k->size, k->live, k->cached, k->reused);
+    }
+
+    printf("============\n\n");
+}
@@ -0,0 +1,46 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SLAB_MIN_SHIFT      ( 6 )           // smallest class, 64 bytes
+#define SLAB_MAX_SHIFT      ( 24 )          // largest class, 16MB, bigger goes straight to malloc
+#define SLAB_CLASS_COUNT    ( SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1 )
+
+#define SLAB_CHUNK_SIZE     ( 1 << 20 )     // small classes are carved out of these
+#define SLAB_CARVE_MAX      ( 64 * 1024 )   // classes up to this size share chunks
+
+typedef struct xSlabClass {
+    size_t size;                // usable bytes of a block
+    void *free_list;            // blocks handed back, linked through their bytes
+
+    uint64_t live;              // blocks out
+    uint64_t cached;            // blocks waiting on the free list
+    uint64_t reused;            // allocations served from the free list
+} xSlabClass;
+
+typedef struct xSlabStats {
+    uint64_t live_bytes;        // asked for by callers
+    uint64_t block_bytes;       // held by live blocks, headers included
+    uint64_t free_bytes;        // cached for reuse
+    uint64_t fragmented_bytes;  // rounding waste in live blocks and chunk tails
+    uint64_t chunk_bytes;       // reserved by chunks, never given back
+    uint64_t large_bytes;       // live allocations above the largest class
+    uint64_t allocs;
+    uint64_t reused;
+} xSlabStats;
+
+
+void *xslab_alloc(size_t size);
+void *xslab_calloc(size_t count, size_t size);
+void  xslab_free(void *ptr);
+void *xslab_retain(void *ptr);
+
+size_t xslab_size(const void *ptr);
+
+void xslab_stats(xSlabStats *out);
+void xslab_trim(void);
+void xslab_debug(void);
+
+#endif // SLAB_H
@@ -0,0 +1,313 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
+
+/**
+ *  Framed reads
+ * ------------------------------------------------------------
+ *  Notes:
+ *      TCP does not keep message boundaries, so a single recv
+ *      may hold half a packet or two packets and the start of
+ *      a raw payload. Readers buffer bytes per fd and hand out
+ *      exactly one `packet_size` long frame at a time. Raw reads
+ *      drain whatever the reader already holds first.
+ *
+ *      A state busy with something else (a GET being gathered)
+ *      parks the frames it does not own. They stay buffered in
+ *      order, invisible to reads and to the loop, until
+ *      server_release_parked hands them to IDLE. Replies to
+ *      requests nobody made would desync their connection.
+ */
+
+#define FRAME_MIN_SIZE      ( offsetof(xCommunicationPacket, content) )
+#define FRAME_MAX_SIZE      ( sizeof(((xPacket *)0)->bytes.raw) )
+
+// ------------------------------------------------------------
+// Reader owned by fd, created on first use
+// ------------------------------------------------------------
+xFrameReader *server_reader(Server *sv, int fd)
+{
+    if (!sv || fd < 0) return NULL;
+
+    if (fd >= sv->n_readers) {
+        int n = sv->n_readers ? sv->n_readers : 16;
+        while (n <= fd) n *= 2;
+
+        xFrameReader **r = realloc(sv->readers, n * sizeof(xFrameReader *));
+        if (!r) return NULL;
+
+        memset(r + sv->n_readers, 0, (n - sv->n_readers) * sizeof(xFrameReader *));
+        sv->readers = r;
+        sv->n_readers = n;
+    }
+
+    xFrameReader *r = sv->readers[fd];
+    if (r == NULL) {
+        r = calloc(1, sizeof(xFrameReader));
+        if (!r) return NULL;
+
+        r->fd = fd;
+        sv->readers[fd] = r;
+    }
+
+    return r;
+}
+
+// ------------------------------------------------------------
+// Forget buffered bytes, fd numbers get reused after close
+// ------------------------------------------------------------
+void server_reader_reset(Server *sv, int fd)
+{
+    if (!sv || fd < 0 || fd >= sv->n_readers) return;
+
+    xFrameReader *r = sv->readers[fd];
+    if (r == NULL) return;
+
+    if (r->muted) sv->loop.n_muted--;
+
+    r->fd = fd;
+    r->len = 0;
+    r->parked = 0;
+    r->watched = false;
+    r->held = false;
+    r->muted = false;
+}
+
+// bytes past the parked frames, the only ones reads see
+static uint8_t *frame_head(xFrameReader *r)
+{
+    return r->buf + r->parked;
+}
+
+static size_t frame_avail(const xFrameReader *r)
+{
+    return r->len - r->parked;
+}
+
+// takes n bytes off the head, parked frames stay where they are
+static void frame_consume(xFrameReader *r, size_t n)
+{
+    memmove(r->buf + r->parked, r->buf + r->parked + n, frame_avail(r) - n);
+    r->len -= n;
+}
+
+static size_t frame_size(const xFrameReader *r)
+{
+    if (frame_avail(r) < sizeof(uint16_t)) return 0;
+
+    uint16_t size;
+    memcpy(&size, r->buf + r->parked, sizeof(size));
+
+    return size;
+}
+
+static bool frame_complete(const xFrameReader *r)
+{
+    size_t size = frame_size(r);
+    return size >= FRAME_MIN_SIZE && frame_avail(r) >= size;
+}
+
+bool server_has_frame(Server *sv, int fd)
+{
+    if (!sv || fd < 0 || fd >= sv->n_readers) return false;
+
+    xFrameReader *r = sv->readers[fd];
+
+    return r != NULL && frame_complete(r);
+}
+
+// ------------------------------------------------------------
+// Any loop-watched fd holding a frame the socket won't signal
+// ------------------------------------------------------------
+bool server_has_pending_frames(Server *sv)
+{
+    if (!sv) return false;
+
+    for (int fd = 0; fd < sv->n_readers; fd++) {
+        xFrameReader *r = sv->readers[fd];
+        if (r != NULL && r->watched && frame_complete(r)) return true;
+    }
+
+    return false;
+}
+
+// pulls what the socket has, copies the next frame out and takes it if `consume`
+static int frame_next(Server *sv, int fd, xPacket *out, bool consume)
+{
+    xFrameReader *r = server_reader(sv, fd);
+    if (r == NULL) return -1;
+
+    int closed = 0;
+
+    if (!frame_complete(r) && r->len < sizeof(r->buf)) {
+        int n = tcp_recv_u(fd, r->buf + r->len, sizeof(r->buf) - r->len);
+
+        if (n > 0) {
+            r->len += n;
+        }
+        else if (n == 0) {
+            closed = 1;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("tcp_recv");
+            closed = 1;
+        }
+    }
+
+    size_t size = frame_size(r);
+
+    if (frame_avail(r) >= sizeof(uint16_t) && (size < FRAME_MIN_SIZE || size > FRAME_MAX_SIZE)) {
+        printf("[FRAME] : BAD FRAME SIZE %zu ON FD=%d, DROPPING %zu BYTES.\n", size, fd, frame_avail(r));
+        r->len = r->parked;
+        return -1;
+    }
+
+    if (!frame_complete(r)) {
+        return closed ? -1 : 0;
+    }
+
+    memset(out, 0, sizeof(xPacket));
+    memcpy(out->bytes.raw, frame_head(r), size);
+    out->size = size;
+
+    if (consume) frame_consume(r, size);
+
+    return 1;
+}
+
+/**
+ *  Non blocking. Pulls what the socket has and emits one frame.
+ * ------------------------------------------------------------
+ *  Returns:
+ *       1  frame copied to out
+ *       0  not enough bytes yet
+ *      -1  closed by peer or broken framing
+ */
+int server_poll_frame(Server *sv, int fd, xPacket *out)
+{
+    return frame_next(sv, fd, out, true);
+}
+
+// ------------------------------------------------------------
+// Same, but the frame stays where it is
+// ------------------------------------------------------------
+int server_peek_frame(Server *sv, int fd, xPacket *out)
+{
+    return frame_next(sv, fd, out, false);
+}
+
+/**
+ *  Sets the next complete frame aside until server_release_parked.
+ *  With `hold` the fd also leaves the loop, whatever follows the
+ *  frame (its raw bytes) must not be read as frames.
+ * ------------------------------------------------------------
+ *  Returns 1 if a frame was parked.
+ */
+int server_park_frame(Server *sv, int fd, bool hold)
+{
+    xFrameReader *r = server_reader(sv, fd);
+    if (r == NULL || !frame_complete(r)) return 0;
+
+    r->parked += frame_size(r);
+
+    if (hold && r->watched) {
+        server_loop_unwatch(sv, fd);
+        r->held = true;
+    }
+
+    return 1;
+}
+
+// ------------------------------------------------------------
+// Every parked frame can be read again, held fds rejoin the loop
+// ------------------------------------------------------------
+void server_release_parked(Server *sv)
+{
+    if (!sv) return;
+
+    for (int fd = 0; fd < sv->n_readers; fd++) {
+        xFrameReader *r = sv->readers[fd];
+        if (r == NULL || (r->parked == 0 && !r->held)) continue;
+
+        r->parked = 0;
+
+        if (r->held) {
+            r->held = false;
+            server_loop_watch(sv, fd, r->src);
+        }
+
+        sv->loop.progress = true;
+    }
+}
+
+// ------------------------------------------------------------
+// Blocking raw read of exactly len bytes (buffered ones first)
+// ------------------------------------------------------------
+int server_read_raw(Server *sv, int fd, void *dst, size_t len)
+{
+    xFrameReader *r = server_reader(sv, fd);
+    if (r == NULL) return -1;
+
+    uint8_t *out = (uint8_t *)dst;
+    size_t got = frame_avail(r) < len ? frame_avail(r) : len;
+
+    memcpy(out, frame_head(r), got);
+    frame_consume(r, got);
+
+    while (got < len) {
+        int n = tcp_recv(fd, out + got, len - got);
+
+        if (n > 0) {
+            got += n;
+            continue;
+        }
+
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        if (n < 0) perror("tcp_recv");
+        break;
+    }
+
+    return got;
+}
+
+/**
+ *  Non blocking raw read, at most len bytes (buffered ones first)
+ * ------------------------------------------------------------
+ *  Returns:
+ *      >0  bytes copied to dst
+ *       0  nothing available right now
+ *      -1  closed by peer
+ */
+int server_read_raw_u(Server *sv, int fd, void *dst, size_t len)
+{
+    xFrameReader *r = server_reader(sv, fd);
+    if (r == NULL) return -1;
+
+    uint8_t *out = (uint8_t *)dst;
+    size_t got = frame_avail(r) < len ? frame_avail(r) : len;
+
+    memcpy(out, frame_head(r), got);
+    frame_consume(r, got);
+
+    if (got == len) return got;
+
+    int n = tcp_recv_u(fd, out + got, len - got);
+
+    if (n > 0) return got + n;
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return got;
+
+    if (n < 0) perror("tcp_recv");
+
+    return got > 0 ? (int)got : -1;
+}
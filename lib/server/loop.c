@@ -0,0 +1,352 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/**
+ *  Readiness loop
+ * ------------------------------------------------------------
+ *  Notes:
+ *      Level triggered. Every wake up refills `ready` and states
+ *      consume the fds they care about with server_loop_ready.
+ *      If an iteration made progress the next wait does not
+ *      block, so chained states run back to back.
+ *
+ *      A waiting state that went a whole pass without progress
+ *      won't read what it left ready (a client that talks while
+ *      its GET is sent, a pooled reply in the middle of a GET).
+ *      Level triggered, those fds would end every wait at once,
+ *      so they are muted: unwatched until the state changes.
+ */
+
+#define LOOP_KEY(src, fd)   ( ((uint64_t)(src) << 32) | (uint32_t)(fd) )
+#define LOOP_FD(key)        ( (int)((key) & 0xFFFFFFFF) )
+#define LOOP_SRC(key)       ( (eLoopSource)((key) >> 32) )
+
+int server_loop_init(Server *sv)
+{
+    if (!sv) return 0;
+
+    sv->loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sv->loop.timer_fd = -1;
+    sv->loop.n_ready  = 0;
+    sv->loop.progress = true;
+    sv->loop.ticked   = false;
+    sv->loop.n_muted  = 0;
+
+    if (sv->loop.epoll_fd < 0) {
+        perror("epoll_create1");
+        return 0;
+    }
+
+#if SERVER_LOOP_TICK_MS > 0
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        perror("timerfd_create");
+        return 0;
+    }
+
+    struct itimerspec its = {0};
+    its.it_interval.tv_sec  = SERVER_LOOP_TICK_MS / 1000;
+    its.it_interval.tv_nsec = (SERVER_LOOP_TICK_MS % 1000) * 1000000L;
+    its.it_value            = its.it_interval;
+
+    if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        close(tfd);
+        return 0;
+    }
+
+    sv->loop.timer_fd = tfd;
+    server_loop_watch(sv, tfd, LOOP_TIMER);
+#endif
+
+    return 1;
+}
+
+// a muted fd someone watches or unwatches on purpose is no longer muted
+static void loop_unmark(Server *sv, int fd)
+{
+    if (fd >= sv->n_readers || sv->readers[fd] == NULL || !sv->readers[fd]->muted) return;
+
+    sv->readers[fd]->muted = false;
+    sv->loop.n_muted--;
+}
+
+// ------------------------------------------------------------
+// Registers fd, re-registering it if it is already there
+// ------------------------------------------------------------
+int server_loop_watch(Server *sv, int fd, eLoopSource src)
+{
+    if (!sv || fd < 0) return 0;
+
+    loop_unmark(sv, fd);
+
+    struct epoll_event ev = {0};
+    ev.data.u64 = LOOP_KEY(src, fd);
+
+    switch (src) {
+        // we only ever write to these, just want to know when they hang up
+        case LOOP_PEER_F:
+            ev.events = EPOLLRDHUP;
+            break;
+
+        case LOOP_LISTENER:
+        case LOOP_TIMER:
+            ev.events = EPOLLIN;
+            break;
+
+        // framed connections, their reader may hold frames epoll can't see
+        default: {
+            ev.events = EPOLLIN;
+
+            // pooled replies are mostly read synchronously, but the
+            // index also confirms relayed uploads on its own time
+            if (src == LOOP_INBOUND || src == LOOP_POOL || src == LOOP_CLIENT) tcp_nodelay(fd);
+            if (src == LOOP_POOL) ev.events |= EPOLLRDHUP;
+
+            xFrameReader *r = server_reader(sv, fd);
+            if (r) {
+                r->watched = true;
+                r->src = src;
+            }
+            break;
+        }
+    }
+
+    if (epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+        return 1;
+    }
+
+    if (errno == EEXIST && epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+        return 1;
+    }
+
+    perror("epoll_ctl");
+    return 0;
+}
+
+void server_loop_unwatch(Server *sv, int fd)
+{
+    if (!sv || fd < 0) return;
+
+    epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    loop_unmark(sv, fd);
+
+    if (fd < sv->n_readers && sv->readers[fd]) {
+        sv->readers[fd]->watched = false;
+    }
+
+    for (int i = 0; i < sv->loop.n_ready; i++) {
+        if (LOOP_FD(sv->loop.ready[i].data.u64) == fd) {
+            sv->loop.ready[i].events = 0;
+        }
+    }
+}
+
+static void loop_mute(Server *sv, int fd, eLoopSource src)
+{
+    xFrameReader *r = server_reader(sv, fd);
+    if (r == NULL || r->muted) return;
+
+    epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+    r->watched = false;
+    r->muted   = true;
+    r->src     = src;
+    sv->loop.n_muted++;
+}
+
+// ready on the last wait or holding a frame, and the state passed
+static void loop_mute_ignored(Server *sv)
+{
+    for (int i = 0; i < sv->loop.n_ready; i++) {
+        struct epoll_event *ev = &sv->loop.ready[i];
+        if (ev->events == 0) continue;
+
+        loop_mute(sv, LOOP_FD(ev->data.u64), LOOP_SRC(ev->data.u64));
+        ev->events = 0;
+    }
+
+    for (int fd = 0; fd < sv->n_readers; fd++) {
+        xFrameReader *r = sv->readers[fd];
+
+        if (r && r->watched && server_has_frame(sv, fd)) loop_mute(sv, fd, r->src);
+    }
+}
+
+// ------------------------------------------------------------
+// Watches again what was muted, on every state change
+// ------------------------------------------------------------
+void server_loop_unmute(Server *sv)
+{
+    if (!sv || sv->loop.n_muted == 0) return;
+
+    for (int fd = 0; fd < sv->n_readers; fd++) {
+        xFrameReader *r = sv->readers[fd];
+
+        if (r && r->muted) server_loop_watch(sv, fd, r->src);
+    }
+}
+
+// ------------------------------------------------------------
+// Blocks until something is ready, unless last iteration
+// made progress or the state is not a waiting one.
+// ------------------------------------------------------------
+int server_loop_wait(Server *sv)
+{
+    bool idle = server_state_waits(sv->state) && !sv->loop.progress;
+
+    if (idle) loop_mute_ignored(sv);
+
+    int timeout = ( idle && !server_has_pending_frames(sv) )
+        ? -1
+        : 0;
+
+    sv->loop.progress = false;
+    sv->loop.ticked   = false;
+
+    int n = epoll_wait(sv->loop.epoll_fd, sv->loop.ready, SERVER_LOOP_MAX_EVENTS, timeout);
+
+    if (n < 0) {
+        if (errno != EINTR) perror("epoll_wait");
+        sv->loop.n_ready = 0;
+        return 0;
+    }
+
+    sv->loop.n_ready = n;
+
+    for (int i = 0; i < n; i++) {
+        struct epoll_event *ev = &sv->loop.ready[i];
+        int fd = LOOP_FD(ev->data.u64);
+
+        switch (LOOP_SRC(ev->data.u64)) {
+            case LOOP_TIMER: {
+                uint64_t expirations;
+                if (read(fd, &expirations, sizeof(expirations)) > 0) {
+                    sv->loop.ticked = true;
+                }
+                ev->events = 0;
+                break;
+            }
+
+            // forward connections are write only, a hang up is all we
+            // get. the ring logic redials, so just stop watching.
+            case LOOP_PEER_F: {
+                if (ev->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    printf("[LOOP] : FD=%d HUNG UP.\n", fd);
+                    epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                }
+                ev->events = 0;
+                break;
+            }
+
+            case LOOP_POOL: {
+                if (ev->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    server_pool_fail(sv, fd);
+                    ev->events = 0;
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    return n;
+}
+
+// ------------------------------------------------------------
+// True once per wake up if fd has something to read (or hung up),
+// or if its reader already buffered a whole frame
+// ------------------------------------------------------------
+bool server_loop_ready(Server *sv, int fd)
+{
+    if (!sv || fd < 0) return false;
+
+    bool ready = server_has_frame(sv, fd);
+
+    for (int i = 0; i < sv->loop.n_ready; i++) {
+        struct epoll_event *ev = &sv->loop.ready[i];
+
+        if (LOOP_FD(ev->data.u64) != fd || ev->events == 0) continue;
+
+        ev->events = 0;
+        ready = true;
+    }
+
+    if (ready) sv->loop.progress = true;
+
+    return ready;
+}
+
+// ------------------------------------------------------------
+// Any ready fd of a given source, -1 if none. Consumes it.
+// ------------------------------------------------------------
+int server_loop_next_ready(Server *sv, eLoopSource src)
+{
+    if (!sv) return -1;
+
+    for (int i = 0; i < sv->loop.n_ready; i++) {
+        struct epoll_event *ev = &sv->loop.ready[i];
+
+        if (LOOP_SRC(ev->data.u64) != src || ev->events == 0) continue;
+
+        int fd = LOOP_FD(ev->data.u64);
+        server_loop_ready(sv, fd);
+        return fd;
+    }
+
+    for (int fd = 0; fd < sv->n_readers; fd++) {
+        xFrameReader *r = sv->readers[fd];
+
+        if (r && r->watched && r->src == src && server_has_frame(sv, fd)) {
+            sv->loop.progress = true;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+// ------------------------------------------------------------
+// Also wake up when a pooled fd can take more bytes
+// ------------------------------------------------------------
+void server_loop_want_write(Server *sv, int fd, bool on)
+{
+    if (!sv || fd < 0) return;
+
+    struct epoll_event ev = {0};
+    ev.data.u64 = LOOP_KEY(LOOP_POOL, fd);
+    ev.events   = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+
+    epoll_ctl(sv->loop.epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+bool server_loop_ticked(Server *sv)
+{
+    return sv && sv->loop.ticked;
+}
+
+// ------------------------------------------------------------
+// States that only react to sockets, these sleep in the kernel
+// ------------------------------------------------------------
+bool server_state_waits(eServerState st)
+{
+    switch (st) {
+        case SERVER_CONNECTING:
+        case SERVER_WAITING_NEW_PEER:
+        case SERVER_IDLE:
+        case SERVER_INDEX_WAITING_PEERS_KNOWLEDGE:
+        case SERVER_WAIT_REQUEST_FRAGMENTS:
+            return true;
+
+        default:
+            return false;
+    }
+}
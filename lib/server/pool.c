@@ -0,0 +1,252 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+/**
+ *  Connection pool
+ * ------------------------------------------------------------
+ *  Notes:
+ *      One outbound socket per node, presented once and reused
+ *      by every request to that node. The other side keeps it
+ *      as an inbound fd in its loop. Any protocol hiccup on a
+ *      pooled fd must go through server_pool_fail, half read
+ *      responses would desync the next request otherwise.
+ */
+
+static xPooledConnection *pool_find(Server *sv, node_id_t node)
+{
+    for (size_t i = 0; i < sv->pool.count; i++) {
+        if (sv->pool.conns[i].node_id == node) return sv->pool.conns + i;
+    }
+    return NULL;
+}
+
+static xPooledConnection *pool_find_fd(Server *sv, int fd)
+{
+    if (fd < 0) return NULL;
+
+    for (size_t i = 0; i < sv->pool.count; i++) {
+        if (sv->pool.conns[i].fd == fd) return sv->pool.conns + i;
+    }
+    return NULL;
+}
+
+static xPooledConnection *pool_entry(Server *sv, node_id_t node)
+{
+    xPooledConnection *c = pool_find(sv, node);
+    if (c) return c;
+
+    if (sv->pool.count == sv->pool.capacity) {
+        size_t cap = sv->pool.capacity ? sv->pool.capacity * 2 : 8;
+
+        xPooledConnection *n = realloc(sv->pool.conns, cap * sizeof(xPooledConnection));
+        if (!n) return NULL;
+
+        sv->pool.conns = n;
+        sv->pool.capacity = cap;
+    }
+
+    c = sv->pool.conns + sv->pool.count++;
+    memset(c, 0, sizeof(xPooledConnection));
+    c->node_id = node;
+    c->fd = -1;
+
+    return c;
+}
+
+static void pool_disconnect(Server *sv, xPooledConnection *c)
+{
+    if (c->fd >= 0) {
+        if (sv->index.stream_fd == c->fd) sv->index.stream_fd = -1;
+        server_close_socket(sv, c->fd);
+    }
+
+    c->fd = -1;
+}
+
+static void pool_backoff(xPooledConnection *c)
+{
+    c->backoff_ms = c->backoff_ms
+        ? c->backoff_ms * 2
+        : POOL_BACKOFF_MIN_MS;
+
+    if (c->backoff_ms > POOL_BACKOFF_MAX_MS) c->backoff_ms = POOL_BACKOFF_MAX_MS;
+
+    c->retry_at = current_millis() + c->backoff_ms;
+}
+
+// states whose listener only expects presented connections
+static bool pool_may_accept(Server *sv)
+{
+    switch (sv->state) {
+        case SERVER_BOOTING:
+        case SERVER_CONNECTING:
+        case SERVER_WAITING_NEW_PEER:
+        case SERVER_INDEX_WAITING_PEERS_KNOWLEDGE:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
+// ------------------------------------------------------------
+// Waits the OK for our presentation. The node we dialed may be
+// dialing someone who is dialing us, so keep answering our own
+// listener meanwhile or the ring deadlocks on itself.
+// ------------------------------------------------------------
+static int pool_wait_presented(Server *sv, int fd)
+{
+    uint64_t deadline = current_millis() + POOL_PRESENT_TIMEOUT_MS;
+
+    while (1) {
+        xPacket p = {0};
+        int r = server_poll_frame(sv, fd, &p);
+
+        if (r > 0) return p.bytes.comm.type == TYPE_OK;
+        if (r < 0) return 0;
+
+        uint64_t now = current_millis();
+        if (now >= deadline) return 0;
+
+        struct pollfd pfd[2] = {
+            { .fd = fd,              .events = POLLIN },
+            { .fd = sv->listener_fd, .events = POLLIN },
+        };
+        int nfds = pool_may_accept(sv) && sv->listener_fd >= 0 ? 2 : 1;
+
+        poll(pfd, nfds, (int)(deadline - now));
+
+        if (nfds == 2 && (pfd[1].revents & POLLIN)) {
+            server_accept_presented(sv);
+        }
+    }
+}
+
+// ------------------------------------------------------------
+// Dials `a` and presents ourselves, the socket is not pooled nor
+// watched. Returns the fd or -1.
+// ------------------------------------------------------------
+int server_dial_presented(Server *sv, Address *a)
+{
+    int fd = server_dial(sv, a);
+    if (fd < 0) return -1;
+
+    xPacket presentation = xpacket_presentation(sv);
+
+    if ( server_send_to_socket(sv, &presentation, fd) <= 0 || ! pool_wait_presented(sv, fd) ) {
+        printf("[POOL] : :%d REFUSED PRESENTATION.\n", a->port);
+        server_close_socket(sv, fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ *  Presented socket to `node`, dialing it if needed.
+ * ------------------------------------------------------------
+ *  Returns the fd or -1 if the node is unreachable (or still
+ *  in its backoff window).
+ */
+int server_pool_get(Server *sv, node_id_t node, const Address *a)
+{
+    if (!sv || !a) return -1;
+
+    xPooledConnection *c = pool_entry(sv, node);
+    if (!c) return -1;
+
+    // node moved (ring repair hands out new addresses)
+    if (memcmp(&c->ip, a, sizeof(Address)) != 0) {
+        pool_disconnect(sv, c);
+        c->ip = *a;
+        c->backoff_ms = 0;
+        c->retry_at = 0;
+    }
+
+    if (c->fd >= 0) return c->fd;
+
+    if (current_millis() < c->retry_at) return -1;
+
+    int fd = server_dial_presented(sv, &c->ip);
+    if (fd < 0) {
+        pool_backoff(c);
+        return -1;
+    }
+
+    c->fd = fd;
+    c->backoff_ms = 0;
+    c->retry_at = 0;
+
+    server_loop_watch(sv, fd, LOOP_POOL);
+
+    printf("[POOL] : CONNECTED TO NODE #%lu FD=%d.\n", node, fd);
+
+    return fd;
+}
+
+// ------------------------------------------------------------
+// Same, but keeps retrying (honoring the backoff) until timeout
+// ------------------------------------------------------------
+int server_pool_get_wait(Server *sv, node_id_t node, const Address *a, uint64_t timeout_ms)
+{
+    uint64_t deadline = current_millis() + timeout_ms;
+
+    while (1) {
+        int fd = server_pool_get(sv, node, a);
+        if (fd >= 0) return fd;
+
+        uint64_t now = current_millis();
+        if (now >= deadline) return -1;
+
+        xPooledConnection *c = pool_find(sv, node);
+        uint64_t wake = (c && c->retry_at > now) ? c->retry_at : now + POOL_BACKOFF_MIN_MS;
+        if (wake > deadline) wake = deadline;
+
+        poll(NULL, 0, (int)(wake - now));
+    }
+}
+
+// ------------------------------------------------------------
+// Connected fd to node, never dials. -1 if there is none.
+// ------------------------------------------------------------
+int server_pool_peek(Server *sv, node_id_t node)
+{
+    xPooledConnection *c = pool_find(sv, node);
+    return c ? c->fd : -1;
+}
+
+// ------------------------------------------------------------
+// Something went wrong mid request, next get redials
+// ------------------------------------------------------------
+void server_pool_fail(Server *sv, int fd)
+{
+    xPooledConnection *c = pool_find_fd(sv, fd);
+    if (!c) return;
+
+    printf("[POOL] : DROPPING CONNECTION TO NODE #%lu.\n", c->node_id);
+
+    pool_disconnect(sv, c);
+    pool_backoff(c);
+}
+
+// ------------------------------------------------------------
+// Node is gone for good
+// ------------------------------------------------------------
+void server_pool_drop(Server *sv, node_id_t node)
+{
+    xPooledConnection *c = pool_find(sv, node);
+    if (!c) return;
+
+    pool_disconnect(sv, c);
+    c->backoff_ms = 0;
+    c->retry_at = 0;
+}
+
+bool server_pool_owns(Server *sv, int fd)
+{
+    return pool_find_fd(sv, fd) != NULL;
+}
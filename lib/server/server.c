@@ -2,6 +2,8 @@
     
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 
 // ------------------------------------------------------------
 // Initialize server
@@ -42,8 +44,31 @@ int server_init(Server *sv, const Args *opts) {
     sv->listener_fd = -1;
     sv->client_fd   = -1;
 
+    sv->loop.epoll_fd = -1;
+    sv->loop.timer_fd = -1;
+    sv->loop.n_ready  = 0;
+
+    sv->readers   = NULL;
+    sv->n_readers = 0;
+
+    sv->pool.conns    = NULL;
+    sv->pool.count    = 0;
+    sv->pool.capacity = 0;
+
+    sv->upload_ack_fd = -1;
+
+    sv->send_chunk = opts->chunk_size > 0 ? (size_t)opts->chunk_size : SERVER_SEND_CHUNK_SIZE;
+
+    sv->index.stream_fd = -1;
+
     sv->index_data = NULL;
 
+    sv->standby.node_id = 0;
+    sv->standby.stream_fd = -1;
+    sv->standby.status.open = false;
+    sv->standby_retry_at = 0;
+    sv->standby_seq = 0;
+
 
     return 1;
 }
@@ -63,6 +88,12 @@ int server_open(Server *sv) {
 
     sv->listener_fd = fd;
 
+    if ( ! server_loop_init(sv) ) {
+        return 0;
+    }
+
+    server_loop_watch(sv, fd, LOOP_LISTENER);
+
     return 1;
 }
 
@@ -81,6 +112,12 @@ void server_close(Server *sv) {
     if (sv->listener_fd > 0)
         tcp_close(sv->listener_fd);
 
+    if (sv->loop.timer_fd > 0)
+        close(sv->loop.timer_fd);
+
+    if (sv->loop.epoll_fd > 0)
+        close(sv->loop.epoll_fd);
+
     free(sv);
 }
 
@@ -99,6 +136,10 @@ void server_set_state(Server *sv, eServerState st) {
     if (sv) sv->state = st;
 
     sv->state_changed_at = current_millis();
+    sv->loop.progress = true;
+
+    // what the last state ignored may be what this one wants
+    server_loop_unmute(sv);
 
     // required state swaps
     switch (st)  {
@@ -135,7 +176,10 @@ bool server_is_peerb_connected(const Server *sv)
 int server_dial(Server *sv, Address *a) {
     if (!sv) return 0;
 
-    int fd = tcp_open(a);
+    // the loop is single threaded, an unanswered SYN must not hold it
+    int fd = tcp_open_timeout(a, POOL_CONNECT_TIMEOUT_MS);
+
+    server_reader_reset(sv, fd);
 
     return fd;
 }
@@ -155,11 +199,20 @@ int server_dial_peer(Server *sv) {
         return 0;
     }
 
+    server_reader_reset(sv, fd);
+
     sv->peer_f.stream_fd = fd;
     sv->peer_f.status.open = true;
     sv->peer_f.status.tx = 0;
     sv->peer_f.status.rx = 0;
 
+    server_loop_watch(sv, fd, LOOP_PEER_F);
+
+    // the other side tells us from clients and pools by it
+    xPacket hello = xpacket_new(sv, TYPE_PRESENT_PEER);
+    hello.size = sizeof(hello.bytes.comm) + sizeof(hello.size);
+    server_send_to_peer_f(sv, &hello);
+
     return 1;
 }
 
@@ -168,7 +221,8 @@ int server_dial_peer(Server *sv) {
 int server_accept(Server *sv) {
     if (!sv || sv->listener_fd < 0) return -1;
 
-    tcp_socket client_fd = tcp_try_accept(sv->listener_fd);
+    // listener is non-blocking, the loop tells us when to call this
+    tcp_socket client_fd = tcp_accept(sv->listener_fd);
 
     if (client_fd == NO_CONNECTION_WAITING) {
         return NO_CONNECTION_WAITING;
@@ -179,112 +233,232 @@ int server_accept(Server *sv) {
         return 0;
     }
 
+    server_reader_reset(sv, client_fd);
+
     return client_fd;
 }
 
+// ------------------------------------------------------------
+// Accepts and runs the presentation protocol. Clients replace
+// the current one, nodes are kept as inbound fds in the loop.
+// Returns the presented node id, 0 if none or failed.
+// ------------------------------------------------------------
+node_id_t server_accept_presented(Server *sv) {
+    tcp_socket c = server_accept(sv);
+    if (c <= 0) return 0;
+
+    printf("new connection... waiting identification.\n");
+
+    node_id_t N = server_wait_client_presentation(sv, c);
+
+    if (!N) {
+        printf("FAILED PRESENTATION PROTOCOL.\n");
+        server_close_socket(sv, c);
+        return 0;
+    }
+
+    return server_keep_presented(sv, c, N);
+}
+
+// ------------------------------------------------------------
+// Accepts our backward peer, it sends PRESENT_PEER as soon as
+// it dials. Anybody else connecting meanwhile (a client, some
+// node's pool) is kept as server_accept_presented would.
+// Returns 1 if the peer is connected.
+// ------------------------------------------------------------
+int server_accept_peer_b(Server *sv) {
+    tcp_socket c = server_accept(sv);
+    if (c <= 0) return 0;
+
+    xPacket p = {0};
+    int r;
+    uint64_t deadline = current_millis() + POOL_PRESENT_TIMEOUT_MS;
+
+    while ( (r = server_poll_frame(sv, c, &p)) == 0 ) {
+        uint64_t now = current_millis();
+        if (now >= deadline) break;
+
+        struct pollfd pfd = { .fd = c, .events = POLLIN };
+        poll(&pfd, 1, (int)(deadline - now));
+    }
+
+    if ( r > 0 && p.bytes.comm.type == TYPE_PRESENT_PEER ) {
+        sv->peer_b.node_id     = p.bytes.comm.sender_id;
+        sv->peer_b.stream_fd   = c;
+        sv->peer_b.status.open = true;
+        server_loop_watch(sv, c, LOOP_PEER_B);
+        return 1;
+    }
+
+    if ( r > 0 && p.bytes.comm.type == TYPE_PRESENT_ITSELF && p.bytes.comm.sender_id != 0 ) {
+        server_keep_presented(sv, c, p.bytes.comm.sender_id);
+        return 0;
+    }
+
+    printf("NEW CONNECTION IS NOT OUR PEER.\n");
+    server_close_socket(sv, c);
+    return 0;
+}
+
+// ------------------------------------------------------------
+// A client replaces the current one, which is closed. Only from
+// IDLE, a busy node may still be serving it and refuses the new
+// one. Nodes and direct readers are kept as inbound fds in the
+// loop. Returns N, 0 if refused.
+// ------------------------------------------------------------
+node_id_t server_keep_presented(Server *sv, int c, node_id_t N) {
+
+    bool client = N == CLIENT_NODE_ID;
+
+    if (client && sv->client_fd > 0 && sv->state != SERVER_IDLE) {
+        printf("BUSY WITH A CLIENT, REFUSING ANOTHER ONE.\n");
+        server_send_not_ok(sv, c);
+        server_close_socket(sv, c);
+        return 0;
+    }
+
+    printf("PRESENTED AS NODE #%lu.\n", N);
+    xPacket pkt_ok = xpacket_ok(sv);
+    server_send_to_socket(sv, &pkt_ok, c);
+
+    if (client) {
+        printf("OMG! The user <3 \n");
+
+        if (sv->client_fd > 0) {
+            if (sv->upload_ack_fd == sv->client_fd) sv->upload_ack_fd = -1;
+            server_close_socket(sv, sv->client_fd);
+        }
+
+        sv->client_fd = c;
+        server_loop_watch(sv, c, LOOP_CLIENT);
+        return N;
+    }
+
+    // another node's pool or a direct reader, requests arrive through the loop
+    server_loop_watch(sv, c, LOOP_INBOUND);
+    return N;
+}
+
 void server_close_socket(Server *sv, int socket) {
     if (!sv || sv->listener_fd < 0) return;
+    server_loop_unwatch(sv, socket);
+    server_reader_reset(sv, socket);
     return tcp_close( socket );
 }
 
 
 // ------------------------------------------------------------
 //  Dial Index
+//      pooled, so the socket comes back already presented
 // ------------------------------------------------------------
 int server_dial_index(Server *sv) {
     if (!sv) return 0;
     
     // printf("Calling index...\n");
 
-    int fd = tcp_open(&sv->index.ip);
+    int fd = server_pool_get_wait(sv, sv->index.node_id, &sv->index.ip, POOL_CONNECT_TIMEOUT_MS);
 
     if (fd < 0) {
-        perror("tcp_open");
+        printf("INDEX #%ld UNREACHABLE.\n", sv->index.node_id);
+        sv->index.stream_fd = -1;
+        sv->index.status.open = false;
+        return 0;
+    }
+
+    sv->index.stream_fd = fd;
+    sv->index.status.open = true;
+
+    return 1;
+}
+
+// ------------------------------------------------------------
+//  Same, but never waits: 0 while the pool backs off or dials
+//  in vain. For reports that can just skip a round.
+// ------------------------------------------------------------
+int server_try_index(Server *sv) {
+    if (!sv) return 0;
+
+    int fd = server_pool_get(sv, sv->index.node_id, &sv->index.ip);
+
+    if (fd < 0) {
+        sv->index.stream_fd = -1;
+        sv->index.status.open = false;
         return 0;
     }
 
     sv->index.stream_fd = fd;
     sv->index.status.open = true;
-    sv->index.status.tx = 0;
-    sv->index.status.rx = 0;
 
     return 1;
 }
 
 // ------------------------------------------------------------
+//  Control packets only. Raw payloads go through tcp_send,
+//  since the length prefix is stamped here.
 // ------------------------------------------------------------
 size_t server_send_to_peer_f(Server *sv, xPacket *packet) {
+    packet->bytes.comm.packet_size = packet->size;
     return tcp_send( sv->peer_f.stream_fd, packet->bytes.raw , packet->size );
 }
 // ------------------------------------------------------------
 size_t server_send_to_index(Server *sv, xPacket *packet) {
+    packet->bytes.comm.packet_size = packet->size;
     return tcp_send( sv->index.stream_fd, packet->bytes.raw , packet->size );
 }
 // ------------------------------------------------------------
 size_t server_send_to_socket(Server *sv, xPacket *packet, int fd) {
+    packet->bytes.comm.packet_size = packet->size;
     return tcp_send( fd , packet->bytes.raw , packet->size );
 }
 // ------------------------------------------------------------
-int server_send_large_buffer_to( Server *sv, int fd, int buffer_size, char *buffer)
+static int server_send_large( Server *sv, int fd, int buffer_size, char *buffer, int zerocopy)
 {
-    printf("SENDING LARGE BUFFER\n");
-    int n_packets = buffer_size / SERVER_BUCKET_SIZE + 1;
-    
-    xPacket x = {0};
-    char* bucket = (char*)&x.bytes.raw;
-
-    int results = 0;
+    printf("SENDING LARGE BUFFER | %d bytes\n", buffer_size);
 
-    int curptr = 0;
-    for ( int i = 0 ; i < n_packets ; i++ ) 
-    {
-        printf("SENDING PART %d of %d\n", i+1, n_packets);
+    ssize_t sent = tcp_send_bulk(fd, buffer, buffer_size, sv->send_chunk, zerocopy);
 
-		int st  = i * SERVER_BUCKET_SIZE; 
-		int end = st + SERVER_BUCKET_SIZE; 
-		if ( end > buffer_size )
-        {
-			end = buffer_size;
-		}
+    if ( sent != buffer_size ) {
+        printf("SOMETHING STRANGE HAPPENED, %zd of %d bytes sent.\n", sent, buffer_size);
+        return 0;
+    }
 
-        int size = end - st;
+    return 1;
+}
 
-        memcpy( bucket, buffer + curptr, size );
-        x.size = size;
+int server_send_large_buffer_to( Server *sv, int fd, int buffer_size, char *buffer)
+{
+    return server_send_large(sv, fd, buffer_size, buffer, 0);
+}
 
-        int r = server_send_to_socket(sv, &x, fd);
-        
-        if ( r <= 0 ) {
-            printf("SOMETING STRANGE HAPPENED ON BUCKET #%d\n", i+1);
-        }
+// ------------------------------------------------------------
+// Straight from the caller's memory, no copies. Returns once the
+// peer ACKed it all, the loop waits meanwhile, so only for callers
+// that wait for the peer's answer right after. A stream that did
+// not go out whole is dropped, the receiver discards it.
+// ------------------------------------------------------------
+int server_send_large_buffer_pinned( Server *sv, int fd, int buffer_size, char *buffer)
+{
+    int zerocopy = SERVER_SEND_ZEROCOPY && buffer_size >= SERVER_ZEROCOPY_MIN_SIZE;
 
-        results += r;
-        curptr += size;
+    if ( server_send_large(sv, fd, buffer_size, buffer, zerocopy) ) return 1;
 
-        printf("TOTAL of %d bytes sent.\n", curptr);
-    }
-    return 1;
+    server_pool_fail(sv, fd);
+    return 0;
 }
 
 
 int server_wait_large_buffer_from( Server *sv, int fd, int buffer_size, char *file_buffer )
 {
     printf("WAITING LARGE BUFFER\n");
-    int n_packets = buffer_size / SERVER_BUCKET_SIZE + 1;
-
-    printf("WAITING RAW PACKETS\n");
-    printf("size=%d n=%d \n", buffer_size, n_packets );
-
-    int populated = 0;
-    for (int i = 0; i < n_packets; i++)
-    {
-        xPacket p = server_wait_from_socket(&sv, fd);
+    printf("size=%d \n", buffer_size );
 
-        memcpy(file_buffer + populated, p.bytes.raw, p.size);
+    int populated = server_read_raw(sv, fd, file_buffer, buffer_size);
 
-        populated += p.size;
+    printf("RAW : %.2f%% bytes.\n", (100 * (float)populated / (float)buffer_size));
 
-        printf("RAW : %.2f%% bytes.\n", (100 * (float)populated / (float)buffer_size));
+    if ( populated != buffer_size ) {
+        printf("RAW STREAM ENDED EARLY.\n");
+        return 0;
     }
 
     printf("DONE\n");
@@ -297,6 +471,35 @@ int server_is_index(Server *sv)
 {
     return sv->index.node_id == sv->me.node_id;
 }
+
+// ------------------------------------------------------------
+// The index died: its standby, if one was announced, is the
+// index from now on. Returns 1 if it took over.
+// ------------------------------------------------------------
+int server_index_failover(Server *sv, node_id_t dead)
+{
+    if ( dead != sv->index.node_id || sv->standby.node_id == 0 || sv->standby.node_id == dead ) return 0;
+
+    sv->index.node_id     = sv->standby.node_id;
+    sv->index.ip          = sv->standby.ip;
+    sv->index.stream_fd   = -1;
+    sv->index.status.open = false;
+
+    // the mirror came on an inbound fd, the loop closes it when it hangs up
+    sv->standby.node_id     = 0;
+    sv->standby.stream_fd   = -1;
+    sv->standby.status.open = false;
+    sv->standby_retry_at    = 0;
+
+    if ( server_is_index(sv) )
+    {
+        printf("[STANDBY] : INDEX #%lu DIED, TAKING OVER.\n", dead);
+        return 1;
+    }
+
+    printf("[STANDBY] : INDEX #%lu DIED, NODE #%lu TAKES OVER.\n", dead, sv->index.node_id);
+    return 1;
+}
 //-
 //
 //
@@ -320,36 +523,36 @@ node_id_t server_wait_client_presentation(Server *sv, int c) {
     return p.bytes.comm.sender_id;
 }
 
+// ------------------------------------------------------------
+// Blocks until a whole frame arrives. size = 0 if closed.
+// ------------------------------------------------------------
 xPacket server_wait_from_socket(Server *sv, int fd) {
 
     xPacket p = {0};
 
-    int read = tcp_recv( fd, p.bytes.raw, sizeof(p.bytes.raw));
+    while (1) {
+        int r = server_poll_frame(sv, fd, &p);
+
+        if (r > 0) break;
 
-    p.size = read;
+        if (r < 0) {
+            p.size = 0;
+            break;
+        }
 
-    if (read < 0) {
-        perror("tcp_recv");
-        // maybe handle?
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if ( poll(&pfd, 1, -1) < 0 && errno != EINTR ) {
+            perror("poll");
+            p.size = -1;
+            break;
+        }
     }
 
     return p;
 }
 
 xPacket server_wait_from_peer_b(Server *sv) {
-
-    xPacket p = {0};
-
-    int read = tcp_recv( sv->peer_b.stream_fd, p.bytes.raw, sizeof(p.bytes.raw));
-
-    p.size = read;
-
-    if (read < 0) {
-        perror("tcp_recv");
-        // maybe handle?
-    }
-
-    return p;
+    return server_wait_from_socket(sv, sv->peer_b.stream_fd);
 }
 
 
@@ -364,6 +567,36 @@ int server_is_valid_node(Server *sv, node_id_t n) {
     return a->port != 0;
 }
 
+// the live node after n in the ring, its peer_f. 0 if none
+node_id_t server_next_valid_node(Server *sv, node_id_t n) {
+
+    node_id_t ring = sv->net_size + sv->death_count; // original count
+
+    for (node_id_t k = 1; k < ring; k++) {
+        node_id_t next = (n - 1 + k) % ring + 1;
+
+        if ( server_is_valid_node(sv, next) ) return next;
+    }
+
+    return 0;
+}
+
+// peer table and loads, sized for every node the ring ever had
+int server_index_data_init(Server *sv) {
+
+    if ( sv->index_data != NULL ) return 1;
+
+    size_t ring = sv->net_size + sv->death_count;
+
+    sv->index_data = calloc(1, sizeof(xIndexData));
+    if ( sv->index_data == NULL ) return 0;
+
+    sv->index_data->peer_ips = calloc(ring, sizeof(Address));
+    sv->index_data->load     = calloc(ring, sizeof(xNodeLoad));
+
+    return sv->index_data->peer_ips != NULL && sv->index_data->load != NULL;
+}
+
 node_id_t server_index_save_reported_peer(Server *sv, xPacket *p) {
 
     node_id_t sender    = p->bytes.comm.sender_id;
@@ -377,6 +610,58 @@ node_id_t server_index_save_reported_peer(Server *sv, xPacket *p) {
     return sender;
 }
 
+void server_index_save_load(Server *sv, node_id_t n, const xReportLoad *r) {
+
+    if ( sv->index_data == NULL || sv->index_data->load == NULL || n <= 0 || n > sv->net_size + sv->death_count ) return;
+
+    xNodeLoad *l = sv->index_data->load + n - 1;
+
+    l->reported_ms = current_millis();
+    l->report      = *r;
+}
+
+// room for `size` more bytes as of its last report
+int server_node_has_room(Server *sv, node_id_t n, uint64_t size) {
+
+    if ( sv->index_data == NULL || sv->index_data->load == NULL || n <= 0 ) return 1;
+
+    const xNodeLoad *l = sv->index_data->load + n - 1;
+
+    return l->reported_ms == 0 || l->report.free_bytes >= size;
+}
+
+/**
+ *  How much new data a node should get next to the others, 1 for
+ *  an empty and idle one.
+ * ------------------------------------------------------------
+ *  Notes:
+ *      The share of its room still free, divided by how busy it
+ *      is: moving PLACEMENT_BUSY_BYTES_PER_SEC or passing on
+ *      PLACEMENT_BUSY_TRANSFERS fragments halves it, both thirds
+ *      it. A report older than a few intervals says nothing about
+ *      its load anymore, only its room counts then.
+ */
+double server_node_weight(Server *sv, node_id_t n) {
+
+    if ( sv->index_data == NULL || sv->index_data->load == NULL || n <= 0 ) return 1.0;
+
+    const xNodeLoad *l = sv->index_data->load + n - 1;
+
+    if ( l->reported_ms == 0 ) return 1.0;
+
+    const xReportLoad *r = &l->report;
+
+    double room = r->free_bytes + r->stored > 0 ? (double)r->free_bytes / (r->free_bytes + r->stored) : 1.0;
+
+    if ( current_millis() - l->reported_ms > 3 * LOAD_REPORT_INTERVAL_MS ) return room;
+
+    double busy = 1.0
+        + (double)r->bytes_per_sec / PLACEMENT_BUSY_BYTES_PER_SEC
+        + (double)r->inflight / PLACEMENT_BUSY_TRANSFERS;
+
+    return room / busy;
+}
+
 
 
 /**
@@ -443,6 +728,31 @@ xPacket xpacket_presentation( Server *sv )
     return p;
 }
 // ------------------------------------------------------------
+xPacket xpacket_index_presentation( Server *sv ) 
+{
+    xPacket p = xpacket_new(sv, TYPE_PRESENT_INDEX);
+
+    p.bytes.comm.content.index_presentation.index_id   = sv->index.node_id;
+    p.bytes.comm.content.index_presentation.index_addr = sv->index.ip;
+
+    p.size = sizeof( p.bytes.comm );
+
+    return p;
+}
+// ------------------------------------------------------------
+xPacket xpacket_standby_presentation( Server *sv ) 
+{
+    xPacket p = xpacket_new(sv, TYPE_PRESENT_STANDBY);
+
+    p.bytes.comm.content.standby_presentation.index_id     = sv->index.node_id;
+    p.bytes.comm.content.standby_presentation.standby_id   = sv->standby.node_id;
+    p.bytes.comm.content.standby_presentation.standby_addr = sv->standby.ip;
+
+    p.size = sizeof( p.bytes.comm );
+
+    return p;
+}
+// ------------------------------------------------------------
 xPacket xpacket_send_fragment( Server *sv, xRequestFragmentCreation *frag) 
 {
     xPacket p = {0};
@@ -457,8 +767,26 @@ xPacket xpacket_send_fragment( Server *sv, xRequestFragmentCreation *frag)
 
     return p;
 }
+
+xPacket xpacket_fragment_stored( Server *sv, uint64_t file_id, uint64_t frag_id, uint8_t replicas, uint32_t crc ) 
+{
+    xPacket p = {0};
+
+    p.bytes.comm.sender_id  = sv->me.node_id;
+    p.bytes.comm.type       = TYPE_FRAG_STORED;
+
+    p.bytes.comm.content.fragment_stored.file_id  = file_id;
+    p.bytes.comm.content.fragment_stored.frag_id  = frag_id;
+    p.bytes.comm.content.fragment_stored.replicas = replicas;
+    p.bytes.comm.content.fragment_stored.crc      = crc;
+
+    p.size = sizeof( p.bytes.comm ) + sizeof(p.size);
+    p.bytes.comm.packet_size = p.size;
+
+    return p;
+}
 // ------------------------------------------------------------
-xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesize, int frag_count )
+xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesize, int frag_count, int parity )
 {
     xPacket p = {0};
     p.bytes.comm.sender_id  = sv->me.node_id;
@@ -467,6 +795,7 @@ xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesiz
     p.bytes.comm.content.request_file_response.file_id = file_id;
     p.bytes.comm.content.request_file_response.file_size = filesize;
     p.bytes.comm.content.request_file_response.fragment_count_total = frag_count;
+    p.bytes.comm.content.request_file_response.parity = parity;
 
     p.size = sizeof( p.bytes.comm ) + sizeof(p.size);
     p.bytes.comm.packet_size = p.size;
@@ -474,6 +803,16 @@ xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesiz
     return p;
 }
 
+// ------------------------------------------------------------
+xPacket xpacket_report_load( Server *sv, const xReportLoad *r )
+{
+    xPacket p = xpacket_new(sv, TYPE_REPORT_LOAD);
+    p.bytes.comm.content.report_load = *r;
+    p.size = sizeof(p.bytes.comm) + sizeof(p.size);
+
+    return p;
+}
+
 // ------------------------------------------------------------
 xPacket xpacket_peer_dead( Server *sv, node_id_t peer )
 {
@@ -546,6 +885,7 @@ void xreqfragcreation_new( xRequestFragmentCreation *fragcreation, xFileContaine
     fragcreation->file_size             = fc->size;
     fragcreation->file_id               = fc->file_id;
     fragcreation->fragment_count_total  = fc->fragment_count_total;
+    fragcreation->parity                = fc->parity;
     fragcreation->frag_id               = frag->fragment;
     fragcreation->frag_size             = frag->size;
     fragcreation->ptr_index             = ptr_index;
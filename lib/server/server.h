@@ -12,6 +12,7 @@
 #include <memory.h>  
 
 #include <poll.h>  
+#include <sys/epoll.h>  
 
 
 #include "../args.h"  
@@ -23,6 +24,7 @@
 
 
 #define CLIENT_NODE_ID              ((node_id_t)((2<<64) - 1))
+#define DIRECT_READER_ID            ((node_id_t)(UINT64_MAX - 1)) // a client reading fragments from a holder, see direct.c
 
 
 // returns current milliseconds
@@ -62,6 +64,70 @@ typedef struct {
     Address ip;
     node_id_t node_id;
 } xWhoAmI;
+
+// ------------------------------------------------------------ 
+// EVENT LOOP
+//  every long lived fd of the node is registered here, so idle
+//  states sleep in epoll_wait instead of polling each socket.
+typedef enum {
+    LOOP_LISTENER   = 1,
+    LOOP_PEER_B,
+    LOOP_PEER_F,
+    LOOP_POOL,                  // outbound, pooled
+    LOOP_INBOUND,               // accepted, presented nodes
+    LOOP_CLIENT,
+    LOOP_TIMER,
+} eLoopSource;
+
+typedef struct xEventLoop {
+    int epoll_fd;
+    int timer_fd;               // periodic tick, -1 if disabled
+
+    bool progress;              // something happened since last wait
+    bool ticked;                // timer fired on last wait
+
+    int n_ready;
+    struct epoll_event ready[SERVER_LOOP_MAX_EVENTS];
+
+    int n_muted;                // fds the state left ready, see loop.c
+} xEventLoop;
+
+// ------------------------------------------------------------ 
+// FRAMING
+//  control packets carry their own length in `packet_size`, raw
+//  payloads are always announced by one so their size is known.
+//  one reader per fd keeps whatever was read past the frame.
+//  a state may park frames it can't take now, they stay at the
+//  front of the buffer and are skipped until released.
+typedef struct xFrameReader {
+    int fd;
+    bool watched;               // registered in the loop
+    bool held;                  // unwatched until parked frames are released
+    bool muted;                 // unwatched until the state changes
+    eLoopSource src;
+    size_t len;                 // buffered bytes
+    size_t parked;              // of those, parked frames
+    uint8_t buf[SERVER_READER_BUFFER_SIZE];
+} xFrameReader;
+
+// ------------------------------------------------------------ 
+// CONNECTION POOL
+//  outbound sockets to other nodes, already presented, kept
+//  open across requests. dead ones are redialed with backoff.
+typedef struct xPooledConnection {
+    node_id_t node_id;
+    Address ip;
+    int fd;                     // -1 while disconnected
+
+    uint64_t retry_at;          // millis, no dial before that
+    uint32_t backoff_ms;
+} xPooledConnection;
+
+typedef struct xConnectionPool {
+    xPooledConnection *conns;   // malloc'ed
+    size_t count;
+    size_t capacity;
+} xConnectionPool;
 // ------------------------------------------------------------ 
 
 
@@ -72,11 +138,34 @@ typedef struct {
  * 
  *  ------------------------------------------------------------ 
  */
-typedef struct xIndexPresentationPacket {
-  node_id_t sender_id;
+typedef struct xIndexPresentation {
   node_id_t index_id;
   Address index_addr;
-} xIndexPresentationPacket;
+} xIndexPresentation;
+
+// the index's choice of who takes over from it, passed around the ring
+typedef struct xStandbyPresentation {
+  node_id_t index_id;
+  node_id_t standby_id;
+  Address standby_addr;
+} xStandbyPresentation;
+
+// the index's metadata going to its standby, `size` raw bytes follow:
+//  MIRROR_FILE   an xIndexLogEntry and its pointers, as logged
+//  MIRROR_PEERS  the peer table, `count` is the index's known_peers,
+//                it starts every sync
+// `seq` numbers the updates of a sync from 1, one missing breaks it
+typedef enum eIndexMirror {
+  MIRROR_FILE   = 1,
+  MIRROR_PEERS  = 2,
+} eIndexMirror;
+
+typedef struct xIndexMirror {
+  uint8_t  kind;
+  uint32_t size;
+  uint64_t count;
+  uint32_t seq;
+} xIndexMirror;
 
 typedef struct xPeerReportMessage{
   Address peer_addr;
@@ -96,12 +185,68 @@ typedef struct xRequestFragmentCreation{
   uint64_t file_size;
   uint64_t file_id;
   uint8_t fragment_count_total;
+  uint8_t parity;         // erasure coded parity fragments among them
   uint16_t ptr_index;
     
   uint64_t frag_id;
   uint64_t frag_size;
+
+  uint8_t   chain_len;    // replicas the receiver still has to forward
+  node_id_t chain_next;   // who gets it next, 0 means its peer_f
 } xRequestFragmentCreation;
 
+typedef struct xFragmentStored{
+  uint64_t file_id;
+  uint64_t frag_id;
+  uint8_t  replicas;      // kept by the receiver and everyone after it
+  uint32_t crc;           // CRC32C of what the receiver got
+} xFragmentStored;
+
+// the index's answer to a relayed CREATE_FILE, followed by `count`
+// raw xKeptFragment. the relay keeps those as they go by and sends
+// a FRAG_STORED for each once the last byte went out
+typedef struct xKeepFragments{
+  uint64_t file_id;
+  uint64_t file_size;
+  uint8_t  fragment_count_total;
+  uint8_t  parity;
+  uint16_t count;
+} xKeepFragments;
+
+typedef struct __attribute((packed)) xKeptFragment{
+  uint8_t   fragment;
+  uint64_t  offset;     // in the file
+  uint64_t  size;
+} xKeptFragment;
+
+// the sender's copy of a fragment failed its checksum, the index
+// has another holder send it a good one
+typedef struct xRepairFragment{
+  uint64_t file_id;
+  uint64_t frag_id;
+} xRepairFragment;
+
+// the copy `holder` sent the sender for a GET failed its checksum,
+// the index has another holder (or a parity fragment) sent instead
+typedef struct xRefetchFragment{
+  uint64_t file_id;
+  uint64_t frag_id;
+  node_id_t holder;
+  uint8_t attempt;      // earlier asks of the same GET, each goes elsewhere
+} xRefetchFragment;
+
+// keep fragment `frag_id` of a file as a copy of one already held,
+// the index found both have the same bytes
+typedef struct xShareFragment{
+  char file_name[200];
+  uint64_t file_size;
+  uint32_t file_id;
+  uint32_t source_file_id;
+  uint8_t  fragment_count_total;
+  uint8_t  frag_id;
+  uint8_t  source_frag_id;
+} xShareFragment;
+
 typedef struct xPeerDied{
   node_id_t peer_id;
   Address   sender_address;
@@ -111,18 +256,41 @@ typedef struct xPeerDied{
 
 typedef struct xRequestFile{
   char name[200];
+  uint8_t direct;       // the client reads from the holders itself, see direct.c
 } xRequestFile;
 
+// for a direct read followed by `locations` raw xFragmentLocation,
+// none if the file can't be read that way right now
 typedef struct xResponseRequestFile{
   uint64_t  file_size;
   uint64_t  file_id;
   uint8_t   fragment_count_total;
+  uint8_t   parity;     // erasure coded parity fragments among them
+  uint16_t  locations;
 } xResponseRequestFile;
 
+// one holder of a data fragment, laid out for clients as it is on the wire
+typedef struct __attribute((packed)) xFragmentLocation{
+  uint8_t   fragment;
+  uint64_t  offset;     // in the file
+  uint64_t  size;
+  node_id_t node_id;
+  Address   holder;
+} xFragmentLocation;
+
+// a client asking a holder for a fragment, DECLARE_FRAG and its raw
+// bytes come back (never packed), NOT_OK if it is not kept there
+typedef struct xReadFragment{
+  uint64_t  file_id;
+  uint64_t  frag_id;
+} xReadFragment;
+
 typedef struct xDeliverFragmentTo{
   uint64_t  file_id;
   uint64_t  frag_id;
   Address   to;
+  node_id_t to_node;
+  uint8_t   repair;     // goes out as a repair, see xDeclareFragmentTransport
 } xDeliverFragmentTo;
 
 typedef struct xDeclareFragmentTransport{
@@ -130,6 +298,11 @@ typedef struct xDeclareFragmentTransport{
   uint64_t frag_id;
   uint64_t frag_size;
   uint64_t file_size;
+  uint64_t wire_size;   // raw bytes that follow, frag_size unless packed
+  uint8_t  codec;       // LZ_CODEC_*
+  uint8_t  checked;     // `crc` is set
+  uint32_t crc;         // CRC32C of the fragment, not of what is on the wire
+  uint8_t  repair;      // replaces a damaged copy the receiver keeps, no GET waits for it
 } xDeclareFragmentTransport;
 
 typedef struct xDeclareFragmentUseLocal{
@@ -138,18 +311,32 @@ typedef struct xDeclareFragmentUseLocal{
 
 
 
+// followed by `frag_held` raw xFragmentNetworkPointer, one per
+// fragment the sender keeps
 typedef struct xReportFileKnowledge{
 
   char file_name[200];
 
   uint64_t file_size;   
-  uint16_t file_id;     
+  uint32_t file_id;     
   uint8_t  frag_count;  
-
-  xFragmentNetworkPointer fragments[2];
+  uint8_t  frag_held;
+  uint8_t  parity;
 
 } xReportFileKnowledge;
 
+// sent to the index every LOAD_REPORT_INTERVAL_MS, placement
+// leaves out nodes without room for a fragment and favours the
+// emptier and quieter ones
+typedef struct xReportLoad{
+  uint64_t free_bytes;  // what the node can still take
+  uint64_t stored;      // fragment bytes it keeps, every tier
+  uint64_t resident;    // of those, in memory
+  uint64_t budget;      // 0 is no limit
+  uint32_t inflight;    // fragments it is passing on right now
+  uint64_t bytes_per_sec; // fragment bytes taken in and served lately
+} xReportLoad;
+
 
 // -
 
@@ -162,17 +349,28 @@ typedef enum { // force to uint8_t
   // TYPE_LEADER_IS_DEAD     = 0 , // disseminates panic in the network
 
   TYPE_PRESENT_ITSELF     = 1,
+  TYPE_PRESENT_INDEX      = 2,
+  TYPE_PRESENT_STANDBY    = 3,
+  TYPE_INDEX_MIRROR       = 4,
+  TYPE_PRESENT_PEER       = 7, // first thing on a ring connection
   // ------------------------------------------------------------
   TYPE_REPORT_SELF        = 5, 
   TYPE_REPORT_FILE        = 6, 
+  TYPE_REPORT_LOAD        = 8,
   // ------------------------------------------------------------
   TYPE_REQUEST_FILE_INDEX, 
   // ------------------------------------------------------------
   TYPE_CREATE_FILE        = 10,
   TYPE_STORE_FRAGMENT     = 11,
+  TYPE_FRAG_STORED        = 12,
+  TYPE_SHARE_FRAGMENT     = 13,
+  TYPE_REPAIR_FRAGMENT    = 14,
+  TYPE_KEEP_FRAGMENTS     = 18, // index to the node relaying an upload
+  TYPE_REFETCH_FRAGMENT   = 19, // a GET got a damaged copy
   // ------------------------------------------------------------
   TYPE_REQUEST_FILE       = 15,
   TYPE_RESPONSE_FILE      = 16,
+  TYPE_READ_FRAGMENT      = 17,
   // ------------------------------------------------------------
   TYPE_REQUEST_FRAG       = 20,
   TYPE_DECLARE_FRAG       = 21,
@@ -197,20 +395,30 @@ typedef struct __attribute((packed)) {
 
   union {
     // ----------------------------------------
+    xIndexPresentation        index_presentation;
+    xStandbyPresentation      standby_presentation;
+    xIndexMirror              index_mirror;
     xPeerReportMessage        report_self;
     xReportFileKnowledge      report_file;
+    xReportLoad           report_load;
     // ----------------------------------------
     xRequestFileCreation      create_file;
     xResponseFileCreation     res_create_file;
     // ----------------------------------------
     xRequestFile              request_file;
     xResponseRequestFile      request_file_response;
+    xReadFragment             read_fragment;
     xDeliverFragmentTo        deliver_fragment_to;
     xDeclareFragmentTransport declare_fragment_transport;
     xDeclareFragmentUseLocal  declare_fragment_use_local;
     // xPeerReportMessage report_peer;
     // ----------------------------------------
     xRequestFragmentCreation  create_frag;
+    xFragmentStored           fragment_stored;
+    xKeepFragments            keep_fragments;
+    xShareFragment            share_fragment;
+    xRepairFragment           repair_fragment;
+    xRefetchFragment          refetch_fragment;
     // ----------------------------------------
     xPeerDied                 peer_died;
 
@@ -222,11 +430,7 @@ typedef struct __attribute((packed)) {
 typedef struct {
 
   union PacketType {
-    
-    // this is dumb. but il keep it to remind me of how dumb one can be
-    xIndexPresentationPacket index_presentation_pkt; 
 
-    // this should be enough
     xCommunicationPacket comm; 
 
     uint8_t raw[4096];
@@ -237,6 +441,29 @@ typedef struct {
 
 } xPacket;
 
+// ------------------------------------------------------------ 
+// one holder streaming a fragment into a GET's reassembly buffer
+typedef struct xGatherStream {
+    int fd;
+    int frag_id;
+    node_id_t holder;           // who sends it
+    char *dst;                  // bytes of its xGatherSlot, or `packed`
+    size_t size;                // as sent
+    size_t received;
+    char *packed;               // slab, unpacked into the slot once complete
+    bool checked;               // the holder knew the fragment's checksum
+    uint32_t expect;            // that checksum
+    uint32_t crc;               // of what came in so far, unless packed
+} xGatherStream;
+
+// a fragment waiting for its turn to go out to the client
+typedef struct xGatherSlot {
+    char *bytes;                // NULL until announced
+    size_t size;
+    bool ready;                 // every byte is in
+    bool owned;                 // malloc'ed here, local copies are not
+} xGatherSlot;
+
 // ------------------------------------------------------------ 
 
 
@@ -258,11 +485,15 @@ typedef union {
       xRequestFragmentCreation fragc;
 
       char *buffer;  // set by the raw bytes handler
+      uint32_t crc;  // CRC32C of the fragment, summed as it came in
+      int chain_job; // forwarding job for STORE_FRAGMENT, -1 if none
+      node_id_t relayed_by; // entry node passing a CREATE_FILE on, 0 if none
   } StateRawPackets;
 
   struct StateHandleNewFile { 
       xFileContainer *fc;
       char *buffer; 
+      int from_fd;   // acked once every replica is stored
   } StateHandleNewFile;
   
   struct StateRequestedFile { 
@@ -271,10 +502,18 @@ typedef union {
     int file_id; 
     uint64_t file_size; 
     int fragment_count ;
+    int parity;              // erasure coded, any fragment_count - parity fragments will do
     int fragment_found;
     node_id_t deliver_to;    
 
-    char *buffer;
+    xGatherSlot *slots;      // malloc'ed, fragment_count long
+    int next_out;            // first fragment the client has not got
+    bool client_ok;          // client said it is ready to read
+
+    xGatherStream *streams;  // malloc'ed, fragment_count long
+    int n_streams;
+    uint64_t moved_at;       // millis, last time a fragment moved
+    int refetched;           // damaged copies asked again
   } StateRequestedFile;
  
 
@@ -327,9 +566,16 @@ typedef enum  {
 
 
 
+// last load report of a node, never reported means room and no load
+typedef struct xNodeLoad {
+  uint64_t reported_ms;
+  xReportLoad report;
+} xNodeLoad;
+
 typedef struct xIndexData {
   Address *peer_ips; // malloc'ed list
   size_t known_peers;
+  xNodeLoad *load;   // malloc'ed, by node id - 1
 } xIndexData;
 
 // ------------------------------------------------------------ 
@@ -351,6 +597,13 @@ typedef struct xServer {
     // 
     xPeerConnection index;
     xIndexData *index_data;
+
+    // takes over if the index dies, see standby.c. On the index
+    // stream_fd carries the mirror and status.open means synced,
+    // on the standby it is the connection the last sync came on
+    xPeerConnection standby;
+    uint64_t standby_retry_at;
+    uint32_t standby_seq;       // last update sent, or applied
     
 
     int listener_fd;            // TCP listener socket
@@ -358,6 +611,17 @@ typedef struct xServer {
                                 //
     int client_fd;            // TCP listener socket
 
+    xEventLoop loop;
+
+    xFrameReader **readers;     // malloc'ed, indexed by fd
+    int n_readers;
+
+    xConnectionPool pool;
+
+    size_t send_chunk;          // bytes per send on bulk transfers
+
+    int upload_ack_fd;          // client waiting for the index to confirm its upload
+
 } Server;
 
 
@@ -373,19 +637,69 @@ bool server_is_peerb_connected(const Server *sv);
 
 
 
+// ------------------------------------------------------------
+// EVENT LOOP
+// ------------------------------------------------------------
+int server_loop_init(Server *sv);
+int server_loop_watch(Server *sv, int fd, eLoopSource src);
+void server_loop_unwatch(Server *sv, int fd);
+int server_loop_wait(Server *sv);
+bool server_loop_ready(Server *sv, int fd);
+int server_loop_next_ready(Server *sv, eLoopSource src);
+bool server_loop_ticked(Server *sv);
+void server_loop_want_write(Server *sv, int fd, bool on);
+void server_loop_unmute(Server *sv);
+bool server_state_waits(eServerState st);
+
+// ------------------------------------------------------------
+// FRAMING
+// ------------------------------------------------------------
+xFrameReader *server_reader(Server *sv, int fd);
+void server_reader_reset(Server *sv, int fd);
+bool server_has_frame(Server *sv, int fd);
+bool server_has_pending_frames(Server *sv);
+int server_poll_frame(Server *sv, int fd, xPacket *out);
+int server_peek_frame(Server *sv, int fd, xPacket *out);
+int server_park_frame(Server *sv, int fd, bool hold);
+void server_release_parked(Server *sv);
+int server_read_raw(Server *sv, int fd, void *dst, size_t len);
+int server_read_raw_u(Server *sv, int fd, void *dst, size_t len);
+
+// ------------------------------------------------------------
+// CONNECTION POOL
+// ------------------------------------------------------------
+int server_pool_get(Server *sv, node_id_t node, const Address *a);
+int server_pool_peek(Server *sv, node_id_t node);
+int server_pool_get_wait(Server *sv, node_id_t node, const Address *a, uint64_t timeout_ms);
+void server_pool_fail(Server *sv, int fd);
+void server_pool_drop(Server *sv, node_id_t node);
+bool server_pool_owns(Server *sv, int fd);
+int server_dial_presented(Server *sv, Address *a);
+
+
 int server_accept(Server *sv);
+node_id_t server_accept_presented(Server *sv);
+node_id_t server_keep_presented(Server *sv, int c, node_id_t N);
+int server_accept_peer_b(Server *sv);
 void server_close_socket(Server *sv, int socket);
 
 int server_dial(Server *sv, Address * a);
 int server_dial_index(Server *sv);
+int server_try_index(Server *sv);
 int server_dial_peer(Server *sv);
 
 
 int server_is_index(Server *sv);
+int server_index_failover(Server *sv, node_id_t dead);
 
 
 int server_is_valid_node(Server *sv, node_id_t n);
+node_id_t server_next_valid_node(Server *sv, node_id_t n);
+int server_index_data_init(Server *sv);
 node_id_t server_index_save_reported_peer(Server *sv, xPacket *p);
+void server_index_save_load(Server *sv, node_id_t n, const xReportLoad *r);
+int  server_node_has_room(Server *sv, node_id_t n, uint64_t size);
+double server_node_weight(Server *sv, node_id_t n);
 
 
 size_t server_send_to_peer_f(Server *sv, xPacket *packet);
@@ -394,6 +708,7 @@ size_t server_send_to_socket(Server *sv, xPacket *packet, int fd);
 
 
 int server_send_large_buffer_to( Server *sv, int fd, int buffer_size, char *fragbuffer);
+int server_send_large_buffer_pinned( Server *sv, int fd, int buffer_size, char *fragbuffer);
 int server_wait_large_buffer_from( Server *sv, int fd, int buffer_size, char *file_buffer );
 
 
@@ -419,12 +734,16 @@ xPacket xpacket_new( Server *sv, uint8_t type );
 
 xPacket xpacket_report_self( Server *sv );
 xPacket xpacket_presentation( Server *sv );
+xPacket xpacket_index_presentation( Server *sv );
+xPacket xpacket_standby_presentation( Server *sv );
 xPacket xpacket_ok( Server *sv ); 
 xPacket xpacket_not_ok( Server *sv ); 
 xPacket xpacket_send_fragment( Server *sv, xRequestFragmentCreation *frag);
-xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesize, int frag_count );
+xPacket xpacket_fragment_stored( Server *sv, uint64_t file_id, uint64_t frag_id, uint8_t replicas, uint32_t crc );
+xPacket xpacket_request_file_response( Server *sv, int file_id, uint64_t filesize, int frag_count, int parity );
 
 xPacket xpacket_peer_dead( Server *sv, node_id_t p );
+xPacket xpacket_report_load( Server *sv, const xReportLoad *r );
 
 
 void xpacket_debug(const xPacket *p);
@@ -3,6 +3,8 @@
 #include "tcplib.h"
 #include "nettypes.h"
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <poll.h>
@@ -164,7 +166,8 @@ int tcp_send(tcp_socket client_sock, const void *buffer, size_t len) {
     size_t total_sent = 0;
 
     while (total_sent < len) {
-        ssize_t n = send(client_sock, buf + total_sent, len - total_sent, 0);
+        // connections outlive peers now, a dead one must not SIGPIPE us
+        ssize_t n = send(client_sock, buf + total_sent, len - total_sent, MSG_NOSIGNAL);
 
         // printf("__ sent %d bytes\n", total_sent+n);
         if (n > 0) {
@@ -190,6 +193,139 @@ int tcp_send(tcp_socket client_sock, const void *buffer, size_t len) {
 }
 
 
+// ------------------------------------------------------------ 
+// Waits until the kernel let go of every MSG_ZEROCOPY send
+// ------------------------------------------------------------ 
+static int tcp_zerocopy_drain(tcp_socket sock, uint32_t pending) {
+    uint32_t done = 0;
+    int idle = 0;
+
+    while (done < pending) {
+        struct pollfd pfd = { .fd = sock, .events = 0 };
+
+        // POLLERR is reported regardless of events
+        if (poll(&pfd, 1, 100) <= 0) {
+            if (++idle * 100 >= TCP_ZEROCOPY_DRAIN_MS) return 0;
+            continue;
+        }
+
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            perror("recvmsg errqueue");
+            return 0;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // [ee_info, ee_data] is the range of completed sends
+            done += ee->ee_data - ee->ee_info + 1;
+        }
+    }
+
+    return 1;
+}
+
+// ------------------------------------------------------------ 
+// Completions on the error queue count per socket, not per call.
+// Whatever an earlier send left there would be taken for ours.
+// ------------------------------------------------------------ 
+static void tcp_zerocopy_forget(tcp_socket sock) {
+    char control[128];
+
+    while (1) {
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0) continue;
+        if (errno != EINTR) return;
+    }
+}
+
+/**
+ *  Sends len bytes straight from buffer, chunk bytes per syscall.
+ * ------------------------------------------------------------ 
+ *  Notes:
+ *      With zerocopy the kernel pins the pages instead of copying
+ *      them, so this only returns once every chunk was released,
+ *      the caller is free to drop the buffer afterwards. That is
+ *      once the peer ACKed them, the caller blocks until then.
+ *      Falls back to plain sends where MSG_ZEROCOPY is missing.
+ *
+ *      Returns -1 if the pages were not released within
+ *      TCP_ZEROCOPY_DRAIN_MS. The kernel may still be sending
+ *      them, the buffer must be left alone and the connection
+ *      dropped.
+ */
+ssize_t tcp_send_bulk(tcp_socket sock, const void *buffer, size_t len, size_t chunk, int zerocopy) {
+    const char *buf = (const char *)buffer;
+    size_t total_sent = 0;
+    uint32_t zc_sends = 0;
+
+    if (chunk == 0) chunk = len;
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    if (zerocopy) {
+        int opt = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) < 0) zerocopy = 0;
+        else tcp_zerocopy_forget(sock);
+    }
+#else
+    zerocopy = 0;
+#endif
+
+    while (total_sent < len) {
+        size_t n = len - total_sent;
+        if (n > chunk) n = chunk;
+
+        int flags = MSG_NOSIGNAL;
+#if defined(MSG_ZEROCOPY)
+        if (zerocopy) flags |= MSG_ZEROCOPY;
+#endif
+
+        ssize_t r = send(sock, buf + total_sent, n, flags);
+
+        if (r > 0) {
+            total_sent += r;
+            if (zerocopy) zc_sends++;
+            continue;
+        }
+
+        if (r < 0 && errno == EINTR) continue;
+
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        // out of optmem for pinned pages, copy from here on
+        if (r < 0 && errno == ENOBUFS && zerocopy) {
+            zerocopy = 0;
+            continue;
+        }
+
+        perror("send");
+        break;
+    }
+
+    if (zc_sends > 0 && ! tcp_zerocopy_drain(sock, zc_sends)) {
+        fprintf(stderr, "tcp_send_bulk: zerocopy completions timed out\n");
+        return -1;
+    }
+
+    return total_sent;
+}
+
+
 int tcp_send_u(tcp_socket client_sock, const void *buffer, size_t len) {
     return send(client_sock, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
 }
@@ -198,9 +334,24 @@ void tcp_close(tcp_socket sock) {
     close(sock);
 }
 
+// small request/response packets on a kept-alive socket would sit in Nagle
+int tcp_nodelay(tcp_socket sock) {
+    int opt = 1;
+    return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
 
 // ------------------------------------------------------------ 
 int tcp_open(const Address *address) {
+    return tcp_open_timeout(address, -1);
+}
+
+// ------------------------------------------------------------ 
+// Connects within timeout_ms (-1 waits as long as the kernel
+// does), a host dropping SYNs would hold the caller for minutes.
+// The socket is blocking again once connected.
+// ------------------------------------------------------------ 
+int tcp_open_timeout(const Address *address, int timeout_ms) {
     if (!address) {
         fprintf(stderr, "tcp_connect: invalid address\n");
         return -1;
@@ -221,11 +372,51 @@ int tcp_open(const Address *address) {
 
     memcpy(&addr.sin_addr.s_addr, address->ip.octet, 4);
 
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(sockfd);
+        return -1;
+    }
+
+    int r = connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+
+    if (r < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+
+        do {
+            r = poll(&pfd, 1, timeout_ms);
+        } while (r < 0 && errno == EINTR);
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (r == 0) {
+            err = ETIMEDOUT;
+        }
+        else if (r > 0 && getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+        else if (r < 0) {
+            err = errno;
+        }
+
+        errno = err;
+        r = err ? -1 : 0;
+    }
+
+    if (r < 0) {
         perror("connect");
         close(sockfd);
         return -1;
     }
 
+    if (fcntl(sockfd, F_SETFL, flags) == -1) {
+        perror("fcntl");
+        close(sockfd);
+        return -1;
+    }
+
     return sockfd;
 }
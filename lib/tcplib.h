@@ -3,8 +3,10 @@
 
 #include "nettypes.h"
 #include <stddef.h> // size_t
+#include <sys/types.h> // ssize_t
 
 #define NO_CONNECTION_WAITING           (-2)
+#define TCP_ZEROCOPY_DRAIN_MS           (5000)
 
 typedef int tcp_socket;
 
@@ -24,10 +26,13 @@ int tcp_recv_flags(tcp_socket client_sock, void *buffer, size_t len, int flags);
 
 int tcp_send(tcp_socket client_sock, const void *buffer, size_t len);
 int tcp_send_u(tcp_socket client_sock, const void *buffer, size_t len);
+ssize_t tcp_send_bulk(tcp_socket sock, const void *buffer, size_t len, size_t chunk, int zerocopy);
 
 void tcp_close(tcp_socket sock);
+int tcp_nodelay(tcp_socket sock);
 
 int tcp_open(const Address *address);
+int tcp_open_timeout(const Address *address, int timeout_ms);
 
 #endif 
 
@@ -12,6 +12,32 @@
 
 
 
+// ------------------------------------------------------------
+// What the index keeps besides the network index. Built once,
+// by the index as it starts or by its standby as the mirror
+// comes in, so taking over finds it ready.
+// ------------------------------------------------------------
+static void index_open( Server *sv, xFileServer *fs, xFileNetworkIndex *fnetidx, xIndexLog *ilog, xDedupTable *dedup )
+{
+    if ( ! server_index_data_init(sv) )
+    {
+        perror("Unable to allocate the index's peer table.");
+        exit(1);
+    }
+
+    // what we placed before a restart, reports only reconcile it
+    if ( fs->store != NULL && fnetidx->log == NULL && xindexlog_open(ilog, fs->store->dir, fs, fnetidx) )
+    {
+        fnetidx->log = ilog;
+    }
+
+    if ( FRAGMENT_DEDUP && fnetidx->dedup == NULL && xdedup_init(dedup) )
+    {
+        fnetidx->dedup = dedup;
+    }
+}
+
+
 int main(int argc, char **argv) {
 
     // print shit
@@ -40,6 +66,10 @@ int main(int argc, char **argv) {
 
     xFileServer fs;
     xFileNetworkIndex fnetidx; // used only by the index
+    xChainQueue chain = {0};   // fragments being passed along the ring
+    xScrubber scrub = {0};     // background checksum pass over kept fragments
+    xLoadReporter load = {0};  // last load report to the index
+    xRelayKeep keep = {0};     // our own fragments of an upload we relay
     
     if ( ! server_init(&sv, &args) )
     {
@@ -53,6 +83,31 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // fragments kept in mapped segments come back before we report
+    xFileStore store;
+    xIndexLog  ilog;      // the index's placements, next to the store
+    xDedupTable dedup;    // contents the index placed, with FRAGMENT_DEDUP
+    if ( args.data_dir[0] != '\0' )
+    {
+        if ( ! xfilestore_open(&store, args.data_dir, args.id) )
+        {
+            perror("Unable to open the data directory.");
+            return 1;
+        }
+
+        fs.store = &store;
+        xfileserver_restore(&fs);
+    }
+
+    // past its budget a node without a data dir spills cold fragments
+    xFileStore spill;
+    uint64_t budget_mb = args.memory_budget >= 0 ? (uint64_t)args.memory_budget : MEMORY_BUDGET_MB;
+    if ( ! xfileserver_open_spill(&fs, &spill, SPILL_DIR, args.id, budget_mb * 1024 * 1024) )
+    {
+        perror("Unable to open the spill directory.");
+        return 1;
+    }
+
     if ( ! xfilenetindex_init(&fnetidx) )
     {
         perror("Unable to initalize file network index server.");
@@ -66,8 +121,8 @@ int main(int argc, char **argv) {
 
         xFileContainer *file = xfileserver_add_file(&fs, "data.bin", 1, sz, 2);
 
-        xfileserver_add_fragment(file, 1, frag1, sizeof(frag1));
-        xfileserver_add_fragment(file, 2, frag2, sizeof(frag2));
+        xfileserver_add_fragment(&fs, file, 1, frag1, sizeof(frag1));
+        xfileserver_add_fragment(&fs, file, 2, frag2, sizeof(frag2));
 
         xfileserver_debug(&fs);
     #endif
@@ -90,14 +145,12 @@ int main(int argc, char **argv) {
 
         case SERVER_CONNECTING:
         {
-            if (!server_is_peerb_connected(&sv))
+            if (!server_is_peerb_connected(&sv) && server_loop_ready(&sv, sv.listener_fd))
             {
-                tcp_socket client = server_accept(&sv);
-                if (client > 0)
-                {
-                    sv.peer_b.status.open = true;
-                    sv.peer_b.stream_fd = client;
-                }
+                // whoever dials after our peer waits in the backlog until
+                // we operate, the listener would keep the loop awake
+                if (server_accept_peer_b(&sv))
+                    server_loop_unwatch(&sv, sv.listener_fd);
             }
 
             if (!server_is_peerf_connected(&sv))
@@ -110,6 +163,7 @@ int main(int argc, char **argv) {
             // if both connected, can proceed operations
             if (server_is_peerf_connected(&sv) && server_is_peerb_connected(&sv))
             {
+                server_loop_watch(&sv, sv.listener_fd, LOOP_LISTENER);
                 server_set_state(&sv, SERVER_BEGIN_OPERATION);
             }
 
@@ -122,17 +176,14 @@ int main(int argc, char **argv) {
          */
         case SERVER_WAITING_NEW_PEER:
         {
-            if (!server_is_peerb_connected(&sv))
+            if (!server_is_peerb_connected(&sv) && server_loop_ready(&sv, sv.listener_fd))
             {
-                tcp_socket client = server_accept(&sv);
-                if (client > 0)
+                if (server_accept_peer_b(&sv))
                 {
-                    printf("NEW PEER CONNECTED.\n");
-                    sv.peer_b.status.open = true;
-                    sv.peer_b.stream_fd = client;
+                    printf("NEW PEER CONNECTED, NODE #%lu.\n", sv.peer_b.node_id);
 
-                    // if i'm node 1, my previous peer was index 
-                    if ( sv.me.node_id == 1 )
+                    // my previous peer was the index and it had no standby
+                    if ( sv.index.node_id == 0 )
                     {
                       printf("OMG! THE INDEX DIED...\n");
                       server_set_state(&sv, SERVER_BEGIN_OPERATION);
@@ -150,43 +201,24 @@ int main(int argc, char **argv) {
             // if i'm the index i must assume leadership
             if (sv.net_size == sv.me.node_id)
             {
-                sv.index_data           = malloc(sizeof(xIndexData));
-                sv.index_data->peer_ips = malloc(sv.net_size * sizeof(Address));
-
+                index_open(&sv, &fs, &fnetidx, &ilog, &dedup);
 
                 if  ( fs.file_count > 0  )
                 {
                     printf("\tI HAVE TO INDEX MY OWN FILES\n");
-                    for (int i = 0; i < fs.file_count; i++)
+                    for (uint32_t i = 0; i < fs.file_count; i++)
                     {
-                        xFileContainer f = fs.files[i];
+                        xReportFileKnowledge rn;
+                        xFragmentNetworkPointer *held = xprocedure_file_report(&sv, fs.files[i], &rn);
 
-                        xReportFileKnowledge rn = {0};
-                        rn.file_id = f.file_id;
-                        rn.file_size = f.size;
-                        rn.frag_count = f.fragment_count_total;
-                        memcpy(rn.file_name, f.file_name, sizeof(f.file_name));
-
-                        printf("\t\tREPORTING FILE %s | SIZE %ld | FRAGS %ld \n",
+                        printf("\t\tREPORTING FILE %s | SIZE %lu | FRAGS %d | HELD %d \n",
                                rn.file_name,
                                rn.file_size,
-                               rn.frag_count);
+                               rn.frag_count,
+                               rn.frag_held);
 
-                        for (int j = 0; j < 2; j++)
-                        {
-                            if (f.fragments[j].fragment_id != 0)
-                            {
-                                rn.fragments[j].fragment = f.fragments[j].fragment_id;
-                                rn.fragments[j].size = f.fragments[j].fragment_size;
-                                rn.fragments[j].node_id = sv.me.node_id;
-
-                                printf("\t\tREPORTING FRAG %d | SIZE %d \n",
-                                       rn.fragments[j].fragment,
-                                       rn.fragments[j].size);
-                            }
-                        }
-
-                        xprocedure_save_file_to_index(&sv, &fs, &fnetidx, &rn, 0);
+                        xprocedure_save_file_to_index(&sv, &fs, &fnetidx, &rn, held, 0);
+                        xslab_free(held);
                     }
                 }
 
@@ -206,14 +238,9 @@ int main(int argc, char **argv) {
         case SERVER_INDEX_PRESENT_ITSELF:
         {
             sv.index.node_id = sv.me.node_id;
+            sv.index.ip      = sv.me.ip;
 
-            xPacket p = {0};
-
-            p.bytes.index_presentation_pkt.sender_id = sv.me.node_id;
-            p.bytes.index_presentation_pkt.index_id = sv.me.node_id;
-            p.bytes.index_presentation_pkt.index_addr = sv.me.ip;
-
-            p.size = sizeof(p.bytes.index_presentation_pkt);
+            xPacket p = xpacket_index_presentation(&sv);
 
             int w = server_send_to_peer_f(&sv, &p);
 
@@ -238,6 +265,9 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            if ( ! server_loop_ready(&sv, sv.listener_fd) )
+                break;
+
             tcp_socket c = server_accept(&sv);
             if (c <= 0)
                 break;
@@ -249,7 +279,7 @@ int main(int argc, char **argv) {
                 break;
             }
             /**
-             *  Receives all data and closes the connection
+             *  Receives all data, then keeps the connection
              * ------------------------------------------------------------
              *  Notes:  
              *          This will read infinite packets 
@@ -265,9 +295,11 @@ int main(int argc, char **argv) {
 
                 printf("RECEBENDO CONHECIMENTO. \n");
                 xPacket p = server_wait_from_socket(&sv, c);
-                if (p.size < 0)
+                if (p.size <= 0)
                 {
                     printf("DEU MERDA RECEBENDO CONHECIMENTO EM. \n");
+                    server_close_socket(&sv, c);
+                    c = -1;
                     break;
                 }
 
@@ -306,8 +338,20 @@ int main(int argc, char **argv) {
                     printf("File ID: %llu\n", (unsigned long long)r.file_id);
                     printf("File Size: %llu\n", (unsigned long long)r.file_size);
 
-                    xprocedure_save_file_to_index( &sv, &fs, &fnetidx, &r, c );
-                    server_send_ok(&sv, c);
+                    // the held fragments follow the report as raw bytes
+                    size_t list_size = r.frag_held * sizeof(xFragmentNetworkPointer);
+                    xFragmentNetworkPointer *held = xslab_alloc(list_size);
+
+                    if ( held == NULL || server_read_raw( &sv, c, held, list_size ) != (int)list_size )
+                    {
+                        printf("REPORT ENDED EARLY.\n");
+                        xslab_free(held);
+                        break;
+                    }
+
+                    // framed, so reports come back to back with no OK in between
+                    xprocedure_save_file_to_index( &sv, &fs, &fnetidx, &r, held, c );
+                    xslab_free(held);
 
                     break;
                 }
@@ -329,7 +373,10 @@ int main(int argc, char **argv) {
 
             }
         client_done:
-            server_close_socket(&sv, c);
+            // it is the node's pooled connection, later requests come through it
+            if (c >= 0)
+                server_loop_watch(&sv, c, LOOP_INBOUND);
+
             if (sv.machine_state.StateIndexWaitingPeers.connected == sv.net_size - 1)
                 server_set_state(&sv, SERVER_IDLE);
             break;
@@ -343,8 +390,14 @@ int main(int argc, char **argv) {
 
             xPacket p = server_wait_from_peer_b(&sv);
 
+            if ( p.bytes.comm.type != TYPE_PRESENT_INDEX )
+            {
+                printf("EXPECTED INDEX GOSSIP, GOT TYPE %d.\n", p.bytes.comm.type);
+                break;
+            }
+
             // ----------------------------------------
-            xIndexPresentationPacket p2 = p.bytes.index_presentation_pkt;
+            xIndexPresentation p2 = p.bytes.comm.content.index_presentation;
             char addr[40];
             address_to_string(&p2.index_addr, addr, 40);
 
@@ -357,7 +410,7 @@ int main(int argc, char **argv) {
             {
 
                 // set my own id
-                p.bytes.index_presentation_pkt.sender_id = sv.me.node_id;
+                p.bytes.comm.sender_id = sv.me.node_id;
 
                 int w = server_send_to_peer_f(&sv, &p);
 
@@ -379,25 +432,13 @@ int main(int argc, char **argv) {
         {
             printf("THE HIVE REQUIRES MY KNOWLEDGE\n");
 
+            // pooled, comes back already presented
             if (!server_dial_index(&sv))
             {
                 printf("\tError connecting to index.\n");
                 break;
             }
 
-            xPacket presentation = xpacket_presentation(&sv) ;
-            int r = server_send_to_index(&sv, &presentation);
-            if ( ! r ) 
-            {
-                printf("\tError sending presentation.\n");
-                break;
-            }
-            if ( ! server_wait_ok(&sv, sv.index.stream_fd) )
-            {
-                printf("\tIndex did not confirm presentation.\n");
-                break;
-            }
-
             xPacket pkt_report_self = xpacket_report_self(&sv);
             if ( server_send_to_index(&sv, &pkt_report_self) <= 0 ) {
                 printf("\tError sending data to index.");
@@ -410,40 +451,16 @@ int main(int argc, char **argv) {
             if ( fs.file_count > 0 )
             {
                 printf("\tI HAVE FILES TO REPORT\n");
-                for ( int i = 0 ; i < fs.file_count ; i++)
+                for ( uint32_t i = 0 ; i < fs.file_count ; i++)
                 {
-                    xFileContainer f = fs.files[i];
-
-                    printf("\t\tREPORTING FILE %s | SIZE %d | FRAGS %d \n", 
-                        f.file_name, 
-                        f.size, 
-                        f.fragment_count_total);
+                    xReportFileKnowledge rn;
+                    xFragmentNetworkPointer *held = xprocedure_file_report(&sv, fs.files[i], &rn);
 
-                    xReportFileKnowledge rn = {0};
-                    rn.file_id = f.file_id;
-                    rn.file_size  = f.size;
-                    rn.frag_count = f.fragment_count_total;
-                    memcpy(rn.file_name, f.file_name, sizeof(f.file_name));
-
-                    printf("\t\tREPORTING FILE %s | SIZE %ld | FRAGS %ld \n", 
+                    printf("\t\tREPORTING FILE %s | SIZE %lu | FRAGS %d | HELD %d \n", 
                         rn.file_name, 
                         rn.file_size, 
-                        rn.frag_count);
-
-                    for (int j = 0; j<2; j++)
-                    {
-                        if ( f.fragments[j].fragment_id != 0 )
-                        {
-                            rn.fragments[j].fragment    = f.fragments[j].fragment_id;
-                            rn.fragments[j].size        = f.fragments[j].fragment_size;
-                            rn.fragments[j].node_id     = sv.me.node_id;
-
-                            printf("\t\tREPORTING FRAG %d | SIZE %d \n", 
-                                rn.fragments[j].fragment,
-                                rn.fragments[j].size
-                            );
-                        }
-                    }
+                        rn.frag_count,
+                        rn.frag_held);
 
                     xPacket pkt_rfn = xpacket_new(&sv, TYPE_REPORT_FILE);
                     pkt_rfn.bytes.comm.content.report_file = rn;
@@ -451,15 +468,19 @@ int main(int argc, char **argv) {
                     
                     xpacket_debug(&pkt_rfn);
 
+                    // every held fragment in one go, right behind the report
                     int R = server_send_to_index(&sv, &pkt_rfn);
+                    if (R > 0 && rn.frag_held > 0)
+                        R = tcp_send(sv.index.stream_fd, held, rn.frag_held * sizeof(xFragmentNetworkPointer));
+
+                    xslab_free(held);
+
                     if (R <= 0)
                     {
                         printf("\t\tError sending file to index. ");
                         perror("index write");
                         continue;
                     }
-
-                    server_wait_ok( &sv, sv.index.stream_fd );
                 }
             }
             else 
@@ -483,24 +504,30 @@ int main(int argc, char **argv) {
         case SERVER_IDLE:
         {
 
-            server_healthcheck(&sv);
-
-            if ( sv.peer_b.status.open )
+            if ( server_loop_ready(&sv, sv.peer_b.stream_fd) )
             {
-                xprocedure_check_peer_b( &sv, &fnetidx );
+                server_healthcheck(&sv);
+
+                if ( sv.peer_b.status.open )
+                {
+                    xprocedure_check_peer_b( &sv, &fnetidx );
+                }
             }
 
             if (sv.client_fd > 0)
             { // client is connected
-                bool h = FD_tcp_has_data(sv.client_fd);
+                bool h = server_loop_ready(&sv, sv.client_fd);
 
                 if (h)
                 {
                     xPacket p = server_wait_from_socket(&sv, sv.client_fd);
 
-                    if (p.size == 0)
+                    if (p.size <= 0)
                     {
                         printf("prolly closed by peer.\n");
+                        server_loop_unwatch(&sv, sv.client_fd);
+                        tcp_close(sv.client_fd);
+                        if (sv.upload_ack_fd == sv.client_fd) sv.upload_ack_fd = -1;
                         sv.client_fd = 0;
                         break;
                     }
@@ -514,55 +541,72 @@ int main(int argc, char **argv) {
             }
 
 
-            tcp_socket c = server_accept(&sv);
+            // fragments still on their way to peer_f
+            xprocedure_chain_run(&sv, &chain);
 
-            if (c > 0)
-            {
-                printf("new connection... waiting identification.\n");
+            // index confirming an upload we relayed
+            int pf = server_loop_next_ready(&sv, LOOP_POOL);
 
-                node_id_t N = server_wait_client_presentation(&sv, c);
+            if (pf >= 0 && ! xprocedure_chain_owns(&chain, pf))
+            {
+                xPacket ack = {0};
+                int r = server_poll_frame(&sv, pf, &ack);
 
-                if (!N)
+                if (r < 0)
                 {
-                    printf("FAILED PRESENTATION PROTOCOL.\n");
-                    tcp_close(c);
-                    break;
+                    server_pool_fail(&sv, pf);
                 }
-
-                else
+                else if (r > 0 && pf == sv.index.stream_fd && sv.upload_ack_fd >= 0)
+                {
+                    printf("UPLOAD ACK FROM INDEX: %d\n", ack.bytes.comm.type);
+                    server_send_to_socket(&sv, &ack, sv.upload_ack_fd);
+                    sv.upload_ack_fd = -1;
+                }
+                else if (r > 0)
                 {
-                    printf("PRESENTED AS NODE #%lu.\n", N);
-                    xPacket pkt_ok = xpacket_ok(&sv);
-                    server_send_to_socket( &sv, &pkt_ok, c );  
+                    printf("UNEXPECTED PACKET TYPE %d ON POOLED FD=%d\n", ack.bytes.comm.type, pf);
+                }
+            }
 
-                    if (N == CLIENT_NODE_ID)
-                    {
-                        printf("OMG! The user <3 \n");
-                        sv.client_fd = c;
-                        break;
-                    }
+            // requests coming through other nodes' pooled connections
+            int in = server_loop_next_ready(&sv, LOOP_INBOUND);
 
-                    printf("Waiting...\n");
-                    xPacket p = server_wait_from_socket(&sv, c);
+            if (in >= 0)
+            {
+                xPacket p = {0};
+                int r = server_poll_frame(&sv, in, &p);
 
-                    if (p.size == 0)
-                    {
-                        printf("prolly closed by peer.\n");
-                        break;
-                    }
+                if (r < 0)
+                {
+                    printf("INBOUND FD=%d CLOSED.\n", in);
+                    server_close_socket(&sv, in);
+                    if (in == sv.standby.stream_fd) sv.standby.stream_fd = -1; // the mirror, on the standby
+                    break;
+                }
 
+                if (r > 0)
+                {
                     printf("RECEIVED TYPE %d\n", p.bytes.comm.type);
 
                     server_set_state(&sv, SERVER_RECEIVED_PACKET);
-                    sv.machine_state.StateReceivedPacket.from_fd = c; 
+                    sv.machine_state.StateReceivedPacket.from_fd = in;
                     sv.machine_state.StateReceivedPacket.packet = p;
-
                     break;
-
                 }
+            }
 
+            if ( server_loop_ready(&sv, sv.listener_fd) )
+            {
+                server_accept_presented(&sv);
             }
 
+            // nothing else to do, spend the scrub credit
+            xprocedure_scrub(&sv, &fs, &fnetidx, &scrub);
+
+            xprocedure_report_load(&sv, &fs, &chain, &load);
+
+            xprocedure_standby_designate(&sv, &fs, &fnetidx);
+
             // auto kill for testing
             // if ( sv.me.node_id == 2)
             // {
@@ -594,18 +638,21 @@ int main(int argc, char **argv) {
 
                 if (sv.index.node_id != sv.me.node_id) {
                     printf("SINCRONIZANDO INDEX.\n");
-                    while( server_dial_index(&sv) == 0)
+                    // pool retries with backoff, the client bytes get
+                    // drained below even if the index never shows up
+                    if ( server_dial_index(&sv) )
                     {
-                        usleep(10 * 1000);
-                    }
-
-                    xPacket presentation = xpacket_presentation(&sv);
-
-                    int r = server_send_to_index(&sv, &presentation);
-
-                    xpacket_debug(&p);
+                        p.bytes.comm.sender_id = sv.me.node_id;
+                        xpacket_debug(&p);
+                        server_send_to_index(&sv, &p);
 
-                    r = server_send_to_index(&sv, &p);
+                        // it can't send us fragments while we relay, we keep ours as they go by
+                        if ( INGEST_STREAMING && !FRAGMENT_DEDUP ) xprocedure_relay_keep_begin(&sv, &fs, &fc, &keep);
+                    }
+                    else
+                    {
+                        printf("OH SHIT, INDEX IS NOT REACHABLE!\n");
+                    }
                 }
                 // uau
                 sv.machine_state.StateRawPackets.trigger_pkt = TYPE_CREATE_FILE;
@@ -613,6 +660,8 @@ int main(int argc, char **argv) {
                 sv.machine_state.StateRawPackets.n_pkts = (fc.file_size / 4096) + 1;
                 sv.machine_state.StateRawPackets.total_size = fc.file_size;
                 sv.machine_state.StateRawPackets.client_fd = sv.machine_state.StateReceivedPacket.from_fd;
+                sv.machine_state.StateRawPackets.chain_job = -1;
+                sv.machine_state.StateRawPackets.relayed_by = p.bytes.comm.sender_id;
                 server_set_state(&sv, SERVER_WAITING_RAW_PACKETS);
 
                 break;
@@ -629,7 +678,7 @@ int main(int argc, char **argv) {
                 xFileContainer *f = xfileserver_find_file(&fs, fragc.file_id);
                 if ( f == NULL ) 
                 { // must create file container
-                    f = xfileserver_add_file( &fs,  fragc.file_name, fragc.file_id, fragc.file_size, fragc.fragment_count_total);
+                    f = xfileserver_add_file( &fs,  fragc.file_name, fragc.file_id, fragc.file_size, fragc.fragment_count_total, fragc.parity);
                     printf("FILE CREATED \n");
                 }    
 
@@ -639,13 +688,107 @@ int main(int argc, char **argv) {
                 sv.machine_state.StateRawPackets.n_pkts         = (fragc.frag_size / 4096) + 1;
                 sv.machine_state.StateRawPackets.total_size     = fragc.frag_size;
                 sv.machine_state.StateRawPackets.client_fd      = sv.machine_state.StateReceivedPacket.from_fd;
+                sv.machine_state.StateRawPackets.chain_job      = CHAIN_REPLICATION
+                    ? xprocedure_chain_begin( &sv, &chain, &fragc, fd )
+                    : -1;
 
                 server_set_state(&sv, SERVER_WAITING_RAW_PACKETS);
 
                 // send a ok to signal it is ready
                 xPacket pok = xpacket_ok(&sv);
-                server_send_to_socket( &sv, &pok, sv.machine_state.StateReceivedPacket.from_fd );
+                server_send_to_socket( &sv, &pok, fd );
+
+                break;
+            }
+
+            case TYPE_SHARE_FRAGMENT:
+            {
+                xShareFragment sh = p.bytes.comm.content.share_fragment;
+
+                printf("SHARING FRAG #%d OF FILE #%u WITH FRAG #%d OF FILE #%u\n", sh.frag_id, sh.file_id, sh.source_frag_id, sh.source_file_id);
+
+                xFileContainer *src = xfileserver_find_file(&fs, sh.source_file_id);
+                xFileContainer *f   = xfileserver_find_file(&fs, sh.file_id);
+
+                if ( f == NULL && src != NULL )
+                {
+                    f = xfileserver_add_file( &fs, sh.file_name, sh.file_id, sh.file_size, sh.fragment_count_total, 0 );
+                }
+
+                if ( xfileserver_share_fragment(&fs, f, sh.frag_id, src, sh.source_frag_id) == FRAG_OK )
+                {
+                    server_send_ok(&sv, fd);
+                }
+                else
+                {
+                    printf("[!] NOTHING TO SHARE.\n");
+                    server_send_not_ok(&sv, fd);
+                }
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            case TYPE_REPAIR_FRAGMENT:
+            {
+                xRepairFragment rp = p.bytes.comm.content.repair_fragment;
+
+                printf("NODE #%lu HAS A DAMAGED FRAG #%lu OF FILE #%lu\n", p.bytes.comm.sender_id, rp.frag_id, rp.file_id);
 
+                // fire and forget, the holder's pooled fd has nobody waiting on it
+                if ( server_is_index(&sv) )
+                {
+                    xprocedure_repair_fragment(&sv, &fs, &fnetidx, rp.file_id, rp.frag_id, p.bytes.comm.sender_id);
+                }
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            case TYPE_REFETCH_FRAGMENT:
+            {
+                xRefetchFragment rf = p.bytes.comm.content.refetch_fragment;
+
+                printf("NODE #%lu GOT A DAMAGED FRAG #%lu OF FILE #%lu FROM NODE #%lu\n", p.bytes.comm.sender_id, rf.frag_id, rf.file_id, rf.holder);
+
+                // fire and forget too, the GET takes whatever shows up
+                if ( server_is_index(&sv) )
+                {
+                    xprocedure_refetch_fragment(&sv, &fs, &fnetidx, &rf, p.bytes.comm.sender_id);
+                }
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            case TYPE_REPORT_LOAD:
+            {
+                // fire and forget, placement reads it
+                xReportLoad rl = p.bytes.comm.content.report_load;
+
+                server_index_save_load(&sv, p.bytes.comm.sender_id, &rl);
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            case TYPE_DECLARE_FRAG:
+            {
+                // a good copy of something we had damaged
+                xDeclareFragmentTransport d = p.bytes.comm.content.declare_fragment_transport;
+
+                if ( d.repair )
+                {
+                    xprocedure_receive_repair(&sv, &fs, fd, &d);
+                }
+                else
+                {
+                    // a GET that already ended, its holder is late
+                    printf("FRAG #%lu OF FILE #%lu CAME AFTER ITS GET.\n", d.frag_id, d.file_id);
+                    server_send_not_ok(&sv, fd);
+                }
+
+                server_set_state(&sv, SERVER_IDLE);
                 break;
             }
 
@@ -660,22 +803,26 @@ int main(int argc, char **argv) {
                     xFileContainer *fc = xfileserver_find_file_by_name( &fs, f.name );
                     if ( fc == NULL ) {
                        server_send_not_ok( &sv, fd );
-                       server_close_socket( &sv, fd );
                        server_set_state(&sv, SERVER_IDLE);
                        break;
                     }
 
                     printf("THIS GUY JUST ASKED FOR A FILE WITH %ld bytes and .\n", fc->size);
 
-                    xPacket response = xpacket_request_file_response(&sv, fc->file_id, fc->size, fc->fragment_count_total);
-
-                    server_send_to_socket(&sv, &response, fd);
+                    // only the map, the client reads from the holders
+                    if ( f.direct ) {
+                        xprocedure_send_fragment_map(&sv, &fnetidx, fc, fd);
+                        server_set_state(&sv, SERVER_IDLE);
+                        break;
+                    }
 
+                    // answered once we know the holders can serve it
                     sv.machine_state.StateRequestedFile.f               = f;
                     sv.machine_state.StateRequestedFile.from_fd         = fd;
                     sv.machine_state.StateRequestedFile.file_id         = fc->file_id;
                     sv.machine_state.StateRequestedFile.file_size       = fc->size;
                     sv.machine_state.StateRequestedFile.fragment_count  = fc->fragment_count_total;
+                    sv.machine_state.StateRequestedFile.parity          = fc->parity;
                     sv.machine_state.StateRequestedFile.deliver_to      = p.bytes.comm.sender_id;
 
                     server_set_state(&sv, SERVER_INDEX_REQUEST_FRAGMENTS);
@@ -687,23 +834,22 @@ int main(int argc, char **argv) {
                         printf("OH SHIT, INDEX IS NOT REACHABLE!\n");
                     }
                     else {
-                        
-                        xPacket presentation = xpacket_presentation(&sv);
-                        server_send_to_index(&sv, &presentation);
-                        server_wait_ok(&sv, sv.index.stream_fd);
                         p.bytes.comm.sender_id = sv.me.node_id;
                         server_send_to_index(&sv, &p); // just forwards it
                         
                         xPacket res = server_wait_from_socket(&sv, sv.index.stream_fd);
 
-                        usleep( 10 * 10000 );
-
                         if ( res.bytes.comm.type == TYPE_NOT_OK )
                         {
                             printf("REJECTED BY INDEX\n");
                             // server_send_to_socket( &sv, &res, fd );
                             server_send_not_ok(&sv, fd);
-                            server_close_socket(&sv, sv.index.stream_fd);
+                            server_set_state(&sv, SERVER_IDLE);
+                            break;
+                        }
+
+                        if ( f.direct ) {
+                            xprocedure_relay_fragment_map(&sv, &res, fd);
                             server_set_state(&sv, SERVER_IDLE);
                             break;
                         }
@@ -713,15 +859,21 @@ int main(int argc, char **argv) {
                         sv.machine_state.StateRequestedFile.file_id         = res.bytes.comm.content.request_file_response.file_id;
                         sv.machine_state.StateRequestedFile.file_size       = res.bytes.comm.content.request_file_response.file_size;
                         sv.machine_state.StateRequestedFile.fragment_count  = res.bytes.comm.content.request_file_response.fragment_count_total;
+                        sv.machine_state.StateRequestedFile.parity          = res.bytes.comm.content.request_file_response.parity;
                         sv.machine_state.StateRequestedFile.fragment_found  = 0;
-                        sv.machine_state.StateRequestedFile.buffer          = (char *) malloc( sv.machine_state.StateRequestedFile.file_size * sizeof(char) );
-
-                        memset( sv.machine_state.StateRequestedFile.buffer , '.', sv.machine_state.StateRequestedFile.file_size) ;
+                        sv.machine_state.StateRequestedFile.slots           = calloc( sv.machine_state.StateRequestedFile.fragment_count, sizeof(xGatherSlot) );
+                        sv.machine_state.StateRequestedFile.next_out        = 0;
+                        sv.machine_state.StateRequestedFile.client_ok       = false;
+                        sv.machine_state.StateRequestedFile.streams         = calloc( sv.machine_state.StateRequestedFile.fragment_count, sizeof(xGatherStream) );
+                        sv.machine_state.StateRequestedFile.n_streams       = 0;
+                        sv.machine_state.StateRequestedFile.moved_at        = current_millis();
+                        sv.machine_state.StateRequestedFile.refetched       = 0;
 
                         xPacket confirm = xpacket_request_file_response( &sv, 
                             sv.machine_state.StateRequestedFile.file_id,
                             sv.machine_state.StateRequestedFile.file_size,
-                            sv.machine_state.StateRequestedFile.fragment_count  
+                            sv.machine_state.StateRequestedFile.fragment_count,
+                            sv.machine_state.StateRequestedFile.parity
                         );
 
                         int w = server_send_to_socket( &sv, &confirm, fd );
@@ -737,17 +889,41 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            case TYPE_INDEX_MIRROR:
+            {
+                // we are the standby, the index sends what it changes
+                index_open(&sv, &fs, &fnetidx, &ilog, &dedup);
+
+                xprocedure_standby_receive(&sv, &fs, &fnetidx, &p, fd);
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            case TYPE_READ_FRAGMENT:
+            {
+                // a client reading straight from us
+                xReadFragment rf = p.bytes.comm.content.read_fragment;
+
+                xprocedure_read_fragment(&sv, &fs, &rf, fd);
+
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
             case TYPE_REQUEST_FRAG: 
             {
                 printf("SOMEONE REQUESTED FRAGMENT.\n");
                 int fragid = p.bytes.comm.content.deliver_fragment_to.frag_id;
                 int fileid = p.bytes.comm.content.deliver_fragment_to.file_id;
                 Address to = p.bytes.comm.content.deliver_fragment_to.to;
+                node_id_t to_node = p.bytes.comm.content.deliver_fragment_to.to_node;
+                bool repair = p.bytes.comm.content.deliver_fragment_to.repair;
                 printf("FILE %d \t FRAG \t %d TO : %d ", fileid, fragid, to.port);
 
                 server_send_ok( &sv, fd );
 
-                int r = xprocedure_send_fragment( &sv, &fs, fileid, fragid, &to );
+                int r = xprocedure_send_fragment( &sv, &fs, fileid, fragid, to_node, &to, repair );
 
                 server_set_state(&sv, SERVER_IDLE);
                 break;
@@ -777,38 +953,75 @@ int main(int argc, char **argv) {
             int c = sv.machine_state.StateRawPackets.client_fd;
             uint8_t trigger = sv.machine_state.StateRawPackets.trigger_pkt;
 
-            char *file_buffer = (char *)malloc(sizeof(char) * size);
+            printf("WAITING RAW PAKCETS\n");
+            printf("size=%d n=%d client=%d\n", size, n, c);
+
+            // the index places the upload while it streams in, dedup hashes it whole first
+            if ( INGEST_STREAMING && !FRAGMENT_DEDUP && trigger == TYPE_CREATE_FILE && sv.index.node_id == sv.me.node_id )
+            {
+                xRequestFileCreation fc = sv.machine_state.StateRawPackets.fc;
 
-            sv.machine_state.StateRawPackets.buffer = file_buffer;
+                if ( xprocedure_ingest(&sv, &fs, &fnetidx, fc.name, fc.file_size, c, sv.machine_state.StateRawPackets.relayed_by) )
+                    server_send_ok(&sv, c);
+                else
+                    server_send_not_ok(&sv, c);
 
-            xPacket xx = {0};
-            xx.bytes.comm.sender_id = sv.me.node_id;
-            xx.bytes.comm.content.report_self.peer_addr = sv.peer_f.ip;
-            xx.size = sizeof(xx.bytes.comm);
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
 
-            usleep(1 * 1000);
+            bool relay = trigger == TYPE_CREATE_FILE && sv.index.node_id != sv.me.node_id && sv.index.stream_fd >= 0;
 
-            printf("WAITING RAW PAKCETS\n");
-            printf("size=%d n=%d client=%d\n", size, n, c);
+            // an entry node only passes uploads on, one window at a time
+            bool windowed = trigger == TYPE_CREATE_FILE && sv.index.node_id != sv.me.node_id;
+            int capacity = windowed && size > INGEST_WINDOW_SIZE ? INGEST_WINDOW_SIZE : size;
 
+            char *file_buffer = (char *)xslab_alloc(capacity);
+
+            sv.machine_state.StateRawPackets.buffer = file_buffer;
+
+            // chain replication forwards the fragment as it arrives
+            int chain_job = trigger == TYPE_STORE_FRAGMENT ? sv.machine_state.StateRawPackets.chain_job : -1;
+            xprocedure_chain_attach( &chain, chain_job, file_buffer );
+
+            // raw bytes follow the announcing packet, read exactly `size`
+            // straight into the buffer that ends up owning them. only
+            // a relay needs to stop every bucket to forward it.
             int populated = 0;
-            for (int i = 0; i < n; i++)
+            uint32_t crc  = 0;
+            while (populated < size)
             {
-                xPacket p = server_wait_from_socket(&sv, c);
+                int chunk = size - populated;
+                if ((relay || chain_job >= 0) && chunk > SERVER_BUCKET_SIZE) chunk = SERVER_BUCKET_SIZE;
+                if (windowed && chunk > capacity) chunk = capacity;
 
-                memcpy(file_buffer + populated, p.bytes.raw, p.size);
+                char *dst = windowed ? file_buffer : file_buffer + populated;
 
-                populated += p.size;
+                int r = server_read_raw(&sv, c, dst, chunk);
+                if (r <= 0)
+                {
+                    printf("RAW STREAM ENDED EARLY.\n");
+                    break;
+                }
 
-                if ( trigger == TYPE_CREATE_FILE && sv.index.node_id != sv.me.node_id )
+                if ( relay )
                 {
-                    printf("SINCRONIZANDO INDEX.\n");
-                    server_send_to_index( &sv, &p );
+                    xprocedure_relay_keep_window( &keep, dst, populated, r );
+                    tcp_send( sv.index.stream_fd, dst, r );
                 }
 
-                printf("RAW : %.2f%% bytes.\n", (100 * (float)populated / (float)size));
+                populated += r;
+
+                // while the bytes are still in cache
+                if (trigger == TYPE_STORE_FRAGMENT) crc = xcrc32c(crc, dst, r);
+
+                xprocedure_chain_pump( &sv, &chain, chain_job, populated );
             }
 
+            sv.machine_state.StateRawPackets.crc = crc;
+
+            printf("RAW : %.2f%% bytes.\n", (100 * (float)populated / (float)size));
+
             printf("DONE\n");
             switch (trigger) {
             case TYPE_CREATE_FILE: 
@@ -819,6 +1032,22 @@ int main(int argc, char **argv) {
                     break;
                 }
 
+                // already relayed to the index, its ack comes back
+                // through the pool and gets forwarded from IDLE
+                xslab_free(file_buffer);
+                sv.machine_state.StateRawPackets.buffer = NULL;
+
+                xprocedure_relay_keep_end( &sv, &fs, &keep, relay && populated == size );
+
+                if ( relay && populated == size )
+                {
+                    sv.upload_ack_fd = c;
+                }
+                else
+                {
+                    server_send_not_ok(&sv, c);
+                }
+
                 server_set_state(&sv, SERVER_IDLE);
                 break;
             }
@@ -850,90 +1079,19 @@ int main(int argc, char **argv) {
             xRequestFileCreation fc = sv.machine_state.StateRawPackets.fc;
             char *b     = sv.machine_state.StateRawPackets.buffer;
             uint64_t sz = sv.machine_state.StateRawPackets.total_size;
+            int from_fd = sv.machine_state.StateRawPackets.client_fd;
 
             printf("HANDLING A %ldbyte FILE named %s... \n", sz, fc.name);
 
-            int fragcount = sv.net_size;
-             
-            if ( sz <= sv.net_size || sz <= MINIMAL_SIZE_FOR_SPLIT ) 
-            {
-                printf("FILE TOO SMALL TO SPLIT.\n");
-                fragcount = 1;
-            }
-
-            int id = fs.file_count+1;
-            xFileContainer *file = xfileserver_add_file(&fs, fc.name, id, sz, fragcount);
-   
-
-            printf("INDEXING FILE...\n");
-            xFileInNetwork *f = xfilenetindex_new_file(id, fragcount * REDUNDANCY);
-
-            int fragsz = sz / fragcount;
-            int remain = sz % fragcount;
-    
-            int internaloffset = 0;
-
-            for ( int i = 0; i < fragcount; i++ ) 
-            {
-                int fragmentsz = (i+1) == fragcount 
-                    ? fragsz + remain 
-                    : fragsz;
-                   
-                while (1) {
-                    if ( (i+internaloffset) >= (sv.index_data->known_peers) ) {
-                        break;
-                    }
-
-                    Address *a = sv.index_data->peer_ips + i + internaloffset;
-
-                    if ( a->port == 0 ) {
-                        printf("INCREASING OFFSET\n");
-                        internaloffset++;
-                        continue;
-                    }
-
-                    printf("FOUND VALID PEER AT :%d\n", a->port);
-
-                    break;
-                }
-
-                int node = i + internaloffset;
-
-                printf("Fragment #%d size %d\n", i, fragmentsz);
-
-                int j = 0;
-                int tries = 0;
-                while (j < REDUNDANCY && tries < sv.index_data->known_peers+1)
-                {
-                    node_id_t nid = (node + tries++) % (sv.net_size + sv.death_count); // original count
-                    nid += 1; 
-
-                    printf("\tTrying Fragment #%d into node %ld\n", i, nid);
-                    if (!server_is_valid_node(&sv, nid)) continue;
-
-                    printf("\tFragment #%d into node %ld\n", i, nid);
-                    f->fragments[i * REDUNDANCY + j].fragment = i + 1;
-                    f->fragments[i * REDUNDANCY + j].size = fragmentsz;
-                    f->fragments[i * REDUNDANCY + j].node_id = nid;
-
-                    j++;
-                }
-
-                printf("- DONE\n");
-
-            }
-
-            /**
-             * Adds to the index, will be used later to fan out 
-             * segments
-             */
-            xfilenetindex_add_file(&fnetidx, f);
+            xFileContainer *file = NULL;
+            xprocedure_place_file(&sv, &fs, &fnetidx, fc.name, sz, &file);
 
             xfileserver_debug(&fs);
 
             server_set_state(&sv, SERVER_INDEX_FANOUT_FRAGMENTS);
             sv.machine_state.StateHandleNewFile.fc      = file;
             sv.machine_state.StateHandleNewFile.buffer  = b;
+            sv.machine_state.StateHandleNewFile.from_fd = from_fd;
             break;
 weird:
             printf("SOMETHING REALLY WEIRD JUST HAPPENED.\n");
@@ -963,83 +1121,62 @@ weird:
             #endif
             
 
-            size_t bufptr = 0;
-            int baseoffset = fc->size / (f->total_fragments / REDUNDANCY ); 
+            // fragments whose bytes are placed already are shared, not sent
+            int shared_expected  = 0;
+            int shared_confirmed = xprocedure_share_duplicates( &sv, &fs, &fnetidx, fc, f, buffer, &shared_expected );
+
+            xErasureShape shape;
+            xfileserver_shape(fc, &shape);
 
+            // own replicas first, a single copy into local storage
             for ( int i = 0 ; i < f->total_fragments ; i++ )
             {
                 xFragmentNetworkPointer frag = f->fragments[i];
-                int offset =  baseoffset * (frag.fragment - 1);
 
-                printf("FRAG #%d SIZE=%ld OFFSET=%d\n", frag.fragment, frag.size, offset);
+                if ( frag.node_id != sv.me.node_id || frag.shared ) continue;
 
-                // IF IS MY FRAGMENT
-                if ( frag.node_id == sv.me.node_id ) 
-                {
-                    printf("OHH THIS ONE IS MINE...\n");
-
-                    char *buf = (char*) malloc( sizeof(char) * frag.size );
-                    memcpy(buf, buffer + offset, frag.size);
-
-                    // special
-                    if ( fc->fragments[0].fragment_id == 0 ) {
-                        printf("INTO POS 0\n");
-                        fc->fragments[0].fragment_id    = frag.fragment; 
-                        fc->fragments[0].fragment_size  = frag.size; 
-                        fc->fragments[0].fragment_bytes = buf;
-                    } else 
-                    {
-                        printf("INTO POS 1\n");
-                        fc->fragments[1].fragment_id    = frag.fragment; 
-                        fc->fragments[1].fragment_size  = frag.size; 
-                        fc->fragments[1].fragment_bytes = buf;
-                    }
-                } else 
+                if ( frag.fragment > shape.data )
                 {
-                    Address *a = sv.index_data->peer_ips + frag.node_id - 1; // nodes start at index 1
-                    if (a == NULL) {
-                        printf("NODE #%ld address is NULL", frag.node_id);
-                        // TODO: falhar
-                        continue;
-                    }
+                    printf("OHH PARITY FRAG #%d IS MINE... SIZE=%ld\n", frag.fragment, frag.size);
 
-                    printf("DIALING :%d...\n", a->port);                
+                    char *parity = xerasure_parity(&shape, frag.fragment, buffer);
 
-                    int fd = server_dial(&sv, a);
-                    xPacket p = xpacket_presentation(&sv);
+                    if ( parity && xfileserver_adopt_fragment(&fs, fc, frag.fragment, parity, frag.size, xcrc32c(0, parity, frag.size)) != FRAG_OK )
+                        xslab_free(parity);
 
-                    server_send_to_socket(&sv, &p, fd);
-
-                    xPacket read = server_wait_from_socket(&sv, fd);
-                    printf("RECEIVED RESPONSE %d\n", read.bytes.comm.type);                
+                    continue;
+                }
 
-                     
-                    xRequestFragmentCreation fragcreation = {0};
-                    xreqfragcreation_new(&fragcreation, fc, &frag, i);
+                int offset = xerasure_offset(&shape, frag.fragment);
+                printf("OHH FRAG #%d IS MINE... SIZE=%ld OFFSET=%d\n", frag.fragment, frag.size, offset);
 
-                    xPacket pkt_fragment = xpacket_send_fragment(&sv, &fragcreation);
+                xfileserver_add_fragment(&fs, fc, frag.fragment, buffer + offset, frag.size);
+            }
 
-                    printf("SENDING to :%d\n", a->port);                
+            // everyone else at once
+            int expected  = 0;
+            int confirmed = xprocedure_fanout( &sv, fc, f, buffer, &expected );
 
-                    server_send_to_socket(&sv, &pkt_fragment, fd);
-                    read = server_wait_from_socket(&sv, fd);
+            expected  += shared_expected;
+            confirmed += shared_confirmed;
 
-                    printf("RECEIVED RESPONSE %d\n", read.bytes.comm.type);                
-                    printf("STARTING RAW TRANSMISSION: %d\n", read.bytes.comm.type);                
-                    
-                    char *fragbuffer = buffer + offset; // frag id starts at 1
-                    
-                    #if LOG_BUFFERS
-                        printf("-FRAG %3d--------\n", frag.fragment);
-                        printf("%.*s\n", frag.size, fragbuffer);
-                        printf("--------------------\n");
-                    #endif
+            int from_fd = sv.machine_state.StateHandleNewFile.from_fd;
 
-                    server_send_large_buffer_to( &sv, fd, frag.size, fragbuffer);
-                }
+            if ( confirmed == expected )
+            {
+                server_send_ok(&sv, from_fd);
+            }
+            else
+            {
+                printf("ONLY %d OF %d REPLICAS STORED.\n", confirmed, expected);
+                server_send_not_ok(&sv, from_fd);
             }
 
             xfileserver_debug(&fs);
+            if ( fnetidx.dedup ) xdedup_debug(fnetidx.dedup);
+
+            xslab_free(buffer);
+            sv.machine_state.StateHandleNewFile.buffer = NULL;
 
             server_set_state( &sv, SERVER_IDLE);
             break;
@@ -1051,6 +1188,7 @@ weird:
             int frag_count  = sv.machine_state.StateRequestedFile.fragment_count;
 
             int deliver_to  = sv.machine_state.StateRequestedFile.deliver_to;
+            int from_fd     = sv.machine_state.StateRequestedFile.from_fd;
 
             printf("I MUST REQUEST FRAGMENTS of FILE #%d.\n", file_id);
 
@@ -1058,13 +1196,36 @@ weird:
             
             if ( file_idx_ptr == NULL ) {
                 printf("[!] FILE DOES NOT EXIST IN INDEX.\n");
+                server_send_not_ok(&sv, from_fd);
                 server_set_state(&sv, SERVER_IDLE);
+                break;
             }
 
             xFragmentNetworkPointer *ptr        = file_idx_ptr->fragments;
-            xFragmentNetworkPointer **frags     = (xFragmentNetworkPointer **) malloc( frag_count * __SIZEOF_POINTER__ );
+            xFragmentNetworkPointer **frags     = (xFragmentNetworkPointer **) xslab_alloc( frag_count * __SIZEOF_POINTER__ );
+
+            int unreachable = 0; // fragments nobody alive holds
+
+            // coded: any `data` live holders will do, data ones first
+            if (file_idx_ptr->parity)
+            {
+                int data = frag_count - file_idx_ptr->parity;
+                int n = 0;
+
+                for (int i = 0; i < frag_count && n < data; i++)
+                {
+                    if ( server_is_valid_node(&sv, ptr[i].node_id) ) frags[n++] = ptr + i;
+                }
+
+                if ( n < data )
+                {
+                    printf("[!] ONLY %d OF THE %d FRAGMENTS NEEDED ARE REACHABLE.\n", n, data);
+                    unreachable = data - n;
+                }
 
-            if (sv.death_count > 0)
+                frag_count = n;
+            }
+            else if (sv.death_count > 0)
             {
                 printf("OH... WE'VE HAD CASUALTIES...\n");
 
@@ -1090,6 +1251,8 @@ weird:
                         frags[i] = ptr + dx;
 
                         printf("2. USING IDX = %d | FRAG %d, NODE %ld \n", dx, frags[i]->fragment, frags[i]->node_id);
+
+                        if ( ! server_is_valid_node(&sv, frags[i]->node_id) ) unreachable++;
                     }
                 }
             }
@@ -1098,6 +1261,24 @@ weird:
                 for (int i = 0; i < frag_count; i++ ) frags[i] =  ptr + ( i * REDUNDANCY );
             }
 
+            // the entry node would wait for fragments that never come
+            if ( unreachable > 0 )
+            {
+                printf("[!] %d FRAGMENTS OF FILE #%d HAVE NO LIVE HOLDER.\n", unreachable, file_id);
+                server_send_not_ok(&sv, from_fd);
+
+                xslab_free(frags);
+                server_set_state(&sv, SERVER_IDLE);
+                break;
+            }
+
+            xPacket response = xpacket_request_file_response(&sv, file_id,
+                sv.machine_state.StateRequestedFile.file_size,
+                sv.machine_state.StateRequestedFile.fragment_count,
+                sv.machine_state.StateRequestedFile.parity);
+
+            server_send_to_socket(&sv, &response, from_fd);
+
             for (int i = 0; i < frag_count; i++ )
             {
                 xFragmentNetworkPointer *frag = frags[i];
@@ -1106,13 +1287,13 @@ weird:
                 if ( frag->node_id == deliver_to ) 
                 {
                     printf("SENDING USE LOCAL.\n");
-                    int r = xprocedure_send_use_local( &sv, frag->fragment, deliver_to_addr);
+                    int r = xprocedure_send_use_local( &sv, frag->fragment, deliver_to, deliver_to_addr);
                     continue;
                 }
 
                 if (frag->node_id == sv.me.node_id) 
                 {
-                    int r = xprocedure_send_fragment( &sv, &fs, file_id, frag->fragment, deliver_to_addr );
+                    int r = xprocedure_send_fragment( &sv, &fs, file_id, frag->fragment, deliver_to, deliver_to_addr, false );
                     printf("SENT FRAGMENT #%d TO %ld : %d\n", frag->fragment, deliver_to, r);
                 }
                 else {
@@ -1125,11 +1306,11 @@ weird:
                     }
 
                     printf("ASKING FRAGMENT #%d TO NODE %ld DELIVER TO %ld\n", frag->fragment, frag->node_id, deliver_to);
-                    xprocedure_send_request_fragment( &sv, addr, file_id, frag->fragment, deliver_to_addr);
+                    xprocedure_send_request_fragment( &sv, frag->node_id, addr, file_id, frag->fragment, deliver_to, deliver_to_addr, false);
                 }
             }
 
-            free(frags);
+            xslab_free(frags);
 
             server_set_state(&sv, SERVER_IDLE);
             break;
@@ -1145,10 +1326,19 @@ weird:
             xRequestFragmentCreation c  = sv.machine_state.StateRawPackets.fragc;
             xFileContainer *fc          = xfileserver_find_file(&fs, c.file_id);
             char *buffer                = sv.machine_state.StateRawPackets.buffer;
+            int from_fd                 = sv.machine_state.StateRawPackets.client_fd;
+            int chain_job               = sv.machine_state.StateRawPackets.chain_job;
+            uint32_t crc                = sv.machine_state.StateRawPackets.crc;
 
             // this is a problem
             if (fc == NULL) {
                 printf("FILE IS UNKNOWN....\n");
+                xslab_free(buffer);
+
+                if (chain_job >= 0)
+                    xprocedure_chain_stored(&sv, &chain, chain_job, false, 0);
+                else
+                    server_send_not_ok(&sv, from_fd);
                 server_set_state(&sv, SERVER_IDLE);
                 break;
             }
@@ -1161,18 +1351,40 @@ weird:
                 printf("--------------------\n");
             #endif
             
-            eFileAddFragStatus f = xfileserver_add_fragment(fc, c.frag_id, buffer, c.frag_size);
+            // the chain forwards the bytes as they came, the file server may copy or pack them
+            if (chain_job >= 0) xprocedure_chain_hold(&chain, chain_job, buffer);
+
+            // the receive buffer becomes the fragment, no copy
+            eFileAddFragStatus f = xfileserver_adopt_fragment(&fs, fc, c.frag_id, buffer, c.frag_size, crc);
             if ( f == FRAG_OK ) 
             {
-                printf("FRAGMENT INCLUDED SUCCESFULLY.\b");
+                printf("FRAGMENT INCLUDED SUCCESFULLY.\n");
+
+                // upstream hears from us once the rest of the chain answered
+                if (chain_job >= 0)
+                {
+                    xprocedure_chain_stored(&sv, &chain, chain_job, true, crc);
+                }
+                else
+                {
+                    xPacket stored = xpacket_fragment_stored(&sv, c.file_id, c.frag_id, 1, crc);
+                    server_send_to_socket(&sv, &stored, from_fd);
+                }
             } else
             {
                 printf("ERROR INCLUDING FRAGMENT");
+
+                if (chain_job >= 0)
+                    xprocedure_chain_stored(&sv, &chain, chain_job, false, 0);
+                else
+                    server_send_not_ok(&sv, from_fd);
+
+                xslab_free(buffer);
             }
 
             xfileserver_debug(&fs);
 
-            free(buffer); //this clears from state also, so it should not be used anymore.
+            sv.machine_state.StateRawPackets.buffer = NULL; // owned by the file server now
                           // TODO: clear whole machine
             server_set_state(&sv, SERVER_IDLE);
             break;
@@ -1180,109 +1392,16 @@ weird:
 
         case SERVER_WAIT_REQUEST_FRAGMENTS: {
 
-            int w = sv.machine_state.StateRequestedFile.fragment_count;
-            int d = sv.machine_state.StateRequestedFile.fragment_found;
-            char* buf = sv.machine_state.StateRequestedFile.buffer;
-
-            // printf("IM WAITING MY %d/%d FRAGMENTS.\n", d, w);
-            int file_id = sv.machine_state.StateRequestedFile.file_id;
-            int file_sz = sv.machine_state.StateRequestedFile.file_size;
-
-            if ( w != d ) {
-                tcp_socket c = server_accept(&sv);
-
-                if (c > 0)
-                {
-                    printf("new connection... waiting identification.\n");
-
-                    node_id_t N = server_wait_client_presentation(&sv, c);
-
-                    if (!N)
-                    {
-                        printf("FAILED PRESENTATION PROTOCOL.\n");
-                        break;
-                    }
-                    else
-                    {
-                        printf("PRESENTED AS NODE #%lu.\n", N);
-                        xPacket pkt_ok = xpacket_ok(&sv);
-                        server_send_to_socket(&sv, &pkt_ok, c);
-
-                        printf("Waiting...\n");
-
-                        xPacket p = server_wait_from_socket(&sv, c);
-
-                        if (p.size == 0)
-                        {
-                            printf("prolly closed by peer.\n");
-                            break;
-                        }
-
-                        printf("RECEIVED PACKET OF TYPE %d \n", p.bytes.comm.type);
-
-                        server_send_ok(&sv, c);
-
-                        if ( p.bytes.comm.type == TYPE_DECLARE_USE_LOCAL )
-                        { // MUST USE ITS LOCAL COPY
-
-                            printf("USING MY LOCAL COPY \n");
-
-                            // if this piece of shit is in my memory
-                            xFileContainer *fc = xfileserver_find_file(&fs, file_id);
-                            if (fc != NULL)
-                            {
-                                xFileFragment *fp = fc->fragments;
-                                if ( fp->fragment_id != p.bytes.comm.content.declare_fragment_use_local.frag_id)
-                                {
-                                    fp = fc->fragments + 1;
-                                }
-
-                                int size_per_frag = fc->size / w;
-                                int offset = size_per_frag * (fp->fragment_id - 1);
-                                printf("FRAG #%d \t SIZE:  %ld \t OFFSET %d \n", fp->fragment_id, fp->fragment_size, offset);
-
-                                memcpy(buf + offset, fp->fragment_bytes, fp->fragment_size);
-
-                                sv.machine_state.StateRequestedFile.fragment_found++;
-                            }
-                        }
-                        else // DELIVERING FRAGMENT
-                        {
-                            // TODO: this has no error validation, fix it
-                            int frag_size = p.bytes.comm.content.declare_fragment_transport.frag_size;
-                            // int file_size = p.bytes.comm.content.declare_fragment_transport.file_size;
-                            int frag_id = p.bytes.comm.content.declare_fragment_transport.frag_id;
-                            char *buffer = (char *)malloc(frag_size * sizeof(char));
-
-                            server_wait_large_buffer_from(&sv, c, frag_size, buffer);
-
-                            server_send_ok(&sv, c);
-                            server_close_socket(&sv, c);
-
-                            int size_per_frag = sv.machine_state.StateRequestedFile.file_size / w;
-                            int offset = size_per_frag * (frag_id - 1);
-                            printf("FRAG #%d \t SIZE:  %d \t OFFSET %d \n", frag_id, frag_size, offset);
-                            memcpy(buf + offset, buffer, frag_size);
-
-                            sv.machine_state.StateRequestedFile.fragment_found++;
-                            free(buffer);
-                        }
-                    }
-                }
-
+            // every holder streams at once, the client gets the
+            // file in order while the rest is still arriving
+            if ( ! xprocedure_gather(&sv, &fs) )
                 break;
-            } 
-
-            int client = sv.machine_state.StateRequestedFile.from_fd;
-
-            printf("------------------------------------------------------------\n");
-            printf(" BUFFER:\n %s \n", buf);
-            printf("------------------------------------------------------------\n");
 
-            printf("WAITING OK TO START \n");
-            server_wait_ok(&sv, client);
+            free(sv.machine_state.StateRequestedFile.slots);
+            sv.machine_state.StateRequestedFile.slots = NULL;
 
-            server_send_large_buffer_to( &sv, client, file_sz, buf );
+            free(sv.machine_state.StateRequestedFile.streams);
+            sv.machine_state.StateRequestedFile.streams = NULL;
 
             server_set_state(&sv, SERVER_IDLE);
 
@@ -1295,7 +1414,8 @@ weird:
         }
         }
 
-        usleep( 1 * 1000 );
+        // sleeps in the kernel until a watched fd or the tick wakes us
+        server_loop_wait(&sv);
     }
 
 